@@ -1,4 +1,6 @@
 #include "../common/common.hpp"
+#include "../common/frames.hpp"
+#include "../common/protocol.hpp"
 #include <iostream>
 #include <cstring>
 #include <fstream>
@@ -8,12 +10,16 @@
 #define DEFAULT_PORT "58016"
 #define TIMEOUT 5
 #define DEFAULT_ERR_MSG "ERR reply from server"
+#define WATCH_TIMEOUT DEFAULT_IDLE_TIMEOUT // seconds 'watch' waits for the scoreboard to change
 
 static bool in_game = false;
 static bool exit_app = false;
 static bool is_plid_set = false;
 static char current_plid[PLID_SIZE];
 static char current_trial = '0';
+static bool keep_alive = false;
+static bool binary_mode = false; // udp requests go as binary frames (see frames.hpp)
+static net::tcp_connection tcp_session;
 
 static void do_start(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr);
 static void do_try(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr);
@@ -22,6 +28,7 @@ static void do_exit(net::stream<net::file_source>& msg, net::udp_connection& udp
 static void do_debug(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr);
 static void do_show_trials(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr);
 static void do_scoreboard(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr);
+static void do_watch(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr);
 
 int main(int argc, char** argv) {
 	int argi = 1;
@@ -45,6 +52,24 @@ int main(int argc, char** argv) {
 			read_gsip = true;
 			continue;
 		}
+		if (arg == "-k") {
+			if (keep_alive) {
+				std::cout << "Duplicated -k." << std::endl;
+				return 1;
+			}
+			keep_alive = true;
+			argi++;
+			continue;
+		}
+		if (arg == "-b") {
+			if (binary_mode) {
+				std::cout << "Duplicated -b." << std::endl;
+				return 1;
+			}
+			binary_mode = true;
+			argi++;
+			continue;
+		}
 		if (arg == "-p") {
 			if (read_gsport) {
 				std::cout << "Can only set port once." << std::endl;
@@ -80,6 +105,7 @@ int main(int argc, char** argv) {
 	actions.add_action("try", do_try);
 	actions.add_action({"show_trials", "st"}, do_show_trials);
 	actions.add_action({"scoreboard", "sb"}, do_scoreboard);
+	actions.add_action("watch", do_watch);
 	actions.add_action("quit", do_quit);
 	actions.add_action("exit", do_exit);
 	actions.add_action("debug", do_debug);
@@ -144,6 +170,42 @@ static void setup_game_clientside(const net::field& plid) {
 		current_plid[i] = plid[i];
 }
 
+/// Sends 'req' to the game server (as a binary frame in binary mode) and
+/// returns its reply. A server without the binary mode answers a frame with
+/// a bare ERR, in which case the client falls back to the text protocol.
+/// Throws bad_response if the reply is malformed.
+static net::game_reply exchange(net::udp_connection& udp, const net::game_request& req) {
+	net::other_address other;
+	net::expected<net::game_reply> reply = net::failure{net::failure::kind::SYNTAX, "No reply"};
+	if (binary_mode) {
+		auto ans_strm = udp.request(net::encode_request(req), other, net::answers);
+		if (net::is_binary(ans_strm.text()))
+			reply = net::decode_reply(ans_strm.text());
+		else if (net::error_reply::parse(ans_strm.text())) {
+			std::cout << "The server has no binary mode, switching to text.\n";
+			binary_mode = false;
+		}
+	}
+	if (!binary_mode) {
+		auto ans_strm = udp.request(net::make_request(req), other, net::answers);
+		reply = net::parse_reply(req.op, ans_strm.text());
+	}
+	if (!reply || (reply->op != req.op && reply->op != net::game_op::NONE))
+		throw net::bad_response{std::string{"Bad server "} + net::op_name(req.op) + " response"};
+	return *reply;
+}
+
+/// Writes the colors of 'key' separated by spaces.
+static void write_key(const char key[GUESS_SIZE]) {
+	char correct_guess[2 * GUESS_SIZE];
+	for (size_t i = 0; i < GUESS_SIZE; i++) {
+		correct_guess[2 * i] = key[i];
+		correct_guess[2 * i + 1] = ' ';
+	}
+	correct_guess[2 * GUESS_SIZE - 1] = '\0';
+	std::cout << correct_guess;
+}
+
 /// Implements the 'start' command by asking the game server to start
 /// a new game using the UDP protocol
 static void do_start(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr) {
@@ -157,224 +219,121 @@ static void do_start(net::stream<net::file_source>& msg, net::udp_connection& ud
 	if (in_game)
 		throw net::game_error{"Ongoing game"};
 
-	net::out_stream out_strm;
-	out_strm.write("SNG").write(fields[0]).write_and_fill(fields[1], MAX_PLAYTIME_SIZE, '0').prime();
-	net::other_address other;
-	auto ans_strm = udp.request(out_strm, other);
-	net::field res;
-	try {
-		res = ans_strm.read(3, 3);
-		if (res != "RSG") {
-			if (res == "ERR") {
-				ans_strm.check_strict_end();
-				std::cout << DEFAULT_ERR_MSG << '\n';
-				return;
-			}
-			throw net::bad_response{"Unknown reply"};
-		}
-
-		res = ans_strm.read(2, 3);
-		ans_strm.check_strict_end();
-	} catch (net::interaction_error& err) {
-		throw net::bad_response{"Bad server start response"};
+	net::game_request req{net::game_op::START};
+	std::memcpy(req.plid, fields[0].data(), PLID_SIZE);
+	req.playtime = static_cast<uint16_t>(std::stoi(fields[1]));
+	net::game_reply reply = exchange(udp, req);
+	if (reply.op == net::game_op::NONE) {
+		std::cout << DEFAULT_ERR_MSG << '\n';
+		return;
 	}
 
-	if (res == "OK") {
+	if (reply.status == net::game_status::OK) {
 		setup_game_clientside(fields[0]);
 		std::cout << "Successfully setup a new game (OK)\n";
 		return;
 	}
 
-	if (res == "NOK") {
+	if (reply.status == net::game_status::NOK) {
 		std::cout << "Game with the given plid already underway (NOK)\n";
 		return;
 	}
 
-	if (res == "ERR") {
-		std::cout << "Server got incorrect start syntax (ERR)\n";
-		return;
-	}
-	throw net::bad_response{"Unknown status"};
+	std::cout << "Server got incorrect start syntax (ERR)\n";
 }
 
 /// Implements the 'try' command by sending a guess (C1 C2 C3 C4) to
 /// the game server using the UDP protocol
 static void do_try(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr) {
-	net::out_stream out_strm;
-	out_strm.write("TRY");
-	out_strm.write({current_plid, PLID_SIZE});
-	
-	net::field res;
+	net::game_request req{net::game_op::TRY};
 	for (size_t i = 0; i < GUESS_SIZE; i++) {
 		auto res = msg.read(1, 1);
 		if (!net::is_valid_color(res))
 			throw net::syntax_error{"Bad color at position " + std::to_string(i + 1)};
-		out_strm.write(res[0]);
+		req.code[i] = res[0];
 	}
 	if (!msg.no_more_fields())
 		throw net::syntax_error{"Try only takes X Y Z W"};
 	if (!in_game)
 		throw net::game_error{"Not in game"};
-	out_strm.write(current_trial + 1).prime();
-
-	net::other_address other;
-	auto ans_strm = udp.request(out_strm, other);
-	try {
-		res = ans_strm.read(3, 3);
-		if (res != "RTR") {
-			if (res == "ERR") {
-				ans_strm.check_strict_end();
-				std::cout << DEFAULT_ERR_MSG << '\n';
-				return;
-			}
-			throw net::bad_response{"Unknown reply"};
-		}
-
-		res = ans_strm.read(2, 3);
-		if (res == "DUP") {
-			ans_strm.check_strict_end();
-			std::cout << "Duplicated guess (DUP)\n";
-			return;
-		}
-		if (res == "INV") {
-			in_game = false;
-			ans_strm.check_strict_end();
-			std::cout << "Invalid trial (closing down game) (INV)\n";
-			return;
-		}
-		if (res == "NOK") {
-			in_game = false;
-			ans_strm.check_strict_end();
-			std::cout << "No ongoing game (NOK)\n";
-			return;
-		}
-		if (res == "ERR") {
-			ans_strm.check_strict_end();
+	std::memcpy(req.plid, current_plid, PLID_SIZE);
+	req.trial = static_cast<char>(current_trial + 1);
+
+	net::game_reply reply = exchange(udp, req);
+	switch (reply.status) {
+	case net::game_status::OK:
+		break;
+	case net::game_status::ERR:
+		if (reply.op == net::game_op::NONE)
+			std::cout << DEFAULT_ERR_MSG << '\n';
+		else
 			std::cout << "Server got wrong try syntax (ERR)\n";
-			return;
-		}
-	} catch (net::interaction_error& err) {
-		throw net::bad_response{"Bad server try response"};
-	}
-
-	bool is_ENT = res == "ENT";
-	if (is_ENT || res == "ETM") {
+		return;
+	case net::game_status::DUP:
+		std::cout << "Duplicated guess (DUP)\n";
+		return;
+	case net::game_status::INV:
 		in_game = false;
-		char correct_guess[2 * GUESS_SIZE];
-		for (size_t i = 0; i < 2 * GUESS_SIZE; i += 2) {
-			try {
-				res = ans_strm.read(1, 1);
-			} catch (net::interaction_error& err) {
-				throw net::bad_response{"Bad server try response"};
-			}
-			if (!net::is_valid_color(res))
-				throw net::bad_response{"Invalid color"};
-			correct_guess[i] = res[0];
-			correct_guess[i + 1] = ' ';
-		}
-		try {
-			ans_strm.check_strict_end();
-		} catch (net::interaction_error& err) {
-			throw net::bad_response{"Bad server response"};
-		}
-		correct_guess[2 * GUESS_SIZE - 1] = '\0';
-		if (is_ENT)
+		std::cout << "Invalid trial (closing down game) (INV)\n";
+		return;
+	case net::game_status::NOK:
+		in_game = false;
+		std::cout << "No ongoing game (NOK)\n";
+		return;
+	case net::game_status::ENT:
+	case net::game_status::ETM:
+		in_game = false;
+		if (reply.status == net::game_status::ENT)
 			std::cout << "You ran out of tries!";
 		else
 			std::cout << "You ran out of time!";
-		std::cout << " The secret key was " << correct_guess << "." << std::endl;
+		std::cout << " The secret key was ";
+		write_key(reply.key);
+		std::cout << "." << std::endl;
 		return;
 	}
 
-	if (res != "OK")
-		throw net::bad_response{"Unknown status"};
-
 	current_trial++;
-	char info[3];
-	try {
-		for (size_t i = 0; i < 3; i++) {
-			res = ans_strm.read(1, 1);
-			info[i] = res[0];
-		}
-		ans_strm.check_strict_end();
-	} catch (net::interaction_error& err) {
-		throw net::bad_response{"Bad server try response"};
-	}
-	if (info[2] < '0' || info[1] < '0' || info[0] != current_trial)
-		throw net::bad_response{"Illegal nT/nB/nW"}; //  confirm nT and nB, nW >= 0
-	if (info[1] + info[2] - 2 * '0' > GUESS_SIZE) // assert nB + nW <= GUESS_SIZE
+	if (reply.trial != current_trial)
+		throw net::bad_response{"Illegal nT/nB/nW"}; //  confirm nT
+	if (reply.nB + reply.nW > GUESS_SIZE) // assert nB + nW <= GUESS_SIZE
 		throw net::bad_response{"Illegal nB/nW (nB + nW > 4)"};
-	if (info[1] == '0' + GUESS_SIZE) { // nB == GUESS_SIZE
+	if (reply.nB == GUESS_SIZE) {
 		in_game = false;
 		std::cout << "You won in " << current_trial << " tries!" << std::endl;
 		return;
 	}
-	std::cout << "You guessed " << info[1] << " colors in the correct place and";
-	std::cout << " there were " << info[2] << " correct colors with an incorrect placement\n";
+	std::cout << "You guessed " << +reply.nB << " colors in the correct place and";
+	std::cout << " there were " << +reply.nW << " correct colors with an incorrect placement\n";
 	return;
 }
 
 /// Asks the game server to end the game (if there is one under way)
 /// using the UDP protocol
 static void end_game(net::udp_connection& udp) {
-	net::out_stream out_strm;
-	out_strm.write("QUT").write({current_plid, PLID_SIZE}).prime();
+	net::game_request req{net::game_op::QUIT};
+	std::memcpy(req.plid, current_plid, PLID_SIZE);
 	in_game = false;
 
-	net::other_address other;
-	auto ans_strm = udp.request(out_strm, other);
-	net::field res;
-	try {
-		res = ans_strm.read(3, 3);
-		if (res != "RQT") {
-			if (res == "ERR") {
-				ans_strm.check_strict_end();
-				std::cout << DEFAULT_ERR_MSG << '\n';
-				return;
-			}
-			throw net::bad_response{"Unknown reply"};
-		}
-		
-		res = ans_strm.read(2, 3);
-		if (res == "ERR") {
-			ans_strm.check_strict_end();
-			std::cout << "Quit failed, quitting anyways (ERR)\n";
-			return;
-		}
-
-		if (res == "NOK") {
-			ans_strm.check_strict_end();
-			std::cout << "Apparently no ongoing game (NOK)\n";
-			return;
-		}
-	} catch (net::interaction_error& err) {
-		throw net::bad_response{"Bad server quit response"};
+	net::game_reply reply = exchange(udp, req);
+	if (reply.op == net::game_op::NONE) {
+		std::cout << DEFAULT_ERR_MSG << '\n';
+		return;
 	}
 
-	if (res != "OK")
-		throw net::bad_response{"Unknown status"};
-
-	in_game = false;
-	char correct_guess[2 * GUESS_SIZE];
-	for (size_t i = 0; i < 2 * GUESS_SIZE; i += 2) {
-		try {
-			res = ans_strm.read(1, 1);
-		} catch (net::interaction_error& err) {
-			throw net::bad_response{"Bad server quit response"};
-		}
-		if (!net::is_valid_color(res))
-			throw net::bad_response{"Invalid color"};
-		correct_guess[i] = res[0];
-		correct_guess[i + 1] = ' ';
+	if (reply.status == net::game_status::ERR) {
+		std::cout << "Quit failed, quitting anyways (ERR)\n";
+		return;
 	}
-	try {
-		ans_strm.check_strict_end();
-	} catch (net::interaction_error& err) {
-		throw net::bad_response{"Bad server quit response"};
+
+	if (reply.status == net::game_status::NOK) {
+		std::cout << "Apparently no ongoing game (NOK)\n";
+		return;
 	}
-	correct_guess[2 * GUESS_SIZE - 1] = '\0';
+
 	std::cout << "You quit the game! The secret key was ";
-	std::cout << correct_guess << '.' << std::endl;
+	write_key(reply.key);
+	std::cout << '.' << std::endl;
 	return;
 }
 
@@ -408,56 +367,36 @@ static void do_debug(net::stream<net::file_source>& msg, net::udp_connection& ud
 	if (!net::is_valid_max_playtime(res[1]))
 		throw net::syntax_error{"Invalid duration"};
 	
-	net::out_stream out_strm;
-	out_strm.write("DBG");
-	out_strm.write(res[0]);
-	out_strm.write_and_fill(res[1], MAX_PLAYTIME_SIZE, '0');
+	net::game_request req{net::game_op::DEBUG};
 	for (size_t i = 2; i < 2 + GUESS_SIZE; i++) {
 		if (!net::is_valid_color(res[i]))
 			throw net::syntax_error{"Invalid color at position " + std::to_string(i - 1)};
-		out_strm.write(res[i]);
+		req.code[i - 2] = res[i][0];
 	}
-	out_strm.prime();
+	std::memcpy(req.plid, res[0].data(), PLID_SIZE);
+	req.playtime = static_cast<uint16_t>(std::stoi(res[1]));
 
 	if (in_game)
 		throw net::game_error{"Ongoing game"};
 
-	net::other_address other;
-	net::field ans_res;
-	try {
-		auto ans_strm = udp.request(out_strm, other);
-		ans_res = ans_strm.read(3, 3);
-		if (ans_res != "RDB") {
-			if (ans_res == "ERR") {
-				ans_strm.check_strict_end();
-				std::cout << DEFAULT_ERR_MSG << '\n';
-				return;
-			}
-			throw net::bad_response{"Unknown reply"};
-		}
-
-		ans_res = ans_strm.read(2, 3);
-		ans_strm.check_strict_end();
-	} catch (net::interaction_error& err) {
-		throw net::bad_response{"Bad server debug response"};
+	net::game_reply reply = exchange(udp, req);
+	if (reply.op == net::game_op::NONE) {
+		std::cout << DEFAULT_ERR_MSG << '\n';
+		return;
 	}
 
-	if (ans_res == "OK") {
+	if (reply.status == net::game_status::OK) {
 		setup_game_clientside(res[0]);
 		std::cout << "Managed to setup new debug game (OK)\n";
 		return;
 	}
 
-	if (ans_res == "NOK") {
+	if (reply.status == net::game_status::NOK) {
 		std::cout << "Ongoing game for the given plid (NOK)\n";
 		return;
 	}
 
-	if (ans_res == "ERR") {
-		std::cout << "Server got malformed message (ERR)\n";
-		return;
-	}
-	throw net::bad_response{"Unknown status"};
+	std::cout << "Server got malformed message (ERR)\n";
 }
 
 // Read a file name, size and its content
@@ -504,6 +443,51 @@ static void write_file(const std::string& filename, const std::string& file) {
 		throw net::io_error{"Could not write file"};
 }
 
+// Asks the server to keep the (freshly opened) tcp session alive.
+// If the server does not support it, keep-alive is turned off.
+static void start_keep_alive() {
+	net::out_stream out_strm = net::keep_alive_request::make();
+	auto ans_strm = tcp_session.request(out_strm);
+	net::field fld;
+	try {
+		fld = ans_strm.read(3, 3);
+		if (fld == "RKA") {
+			fld = ans_strm.read(2, 2);
+			ans_strm.check_strict_end();
+			if (fld == "OK")
+				return;
+			throw net::bad_response{"Unknown status"};
+		}
+		if (fld != "ERR")
+			throw net::bad_response{"Unknown reply"};
+		ans_strm.check_strict_end();
+	} catch (net::interaction_error& err) {
+		throw net::bad_response{"Bad server keep-alive response"};
+	}
+	std::cout << "The server does not support keep-alive (using a connection per request)\n";
+	keep_alive = false;
+}
+
+// Returns the tcp session to send the next request through.
+// In keep-alive mode the previous session is reused while it is still open;
+// otherwise (or if the server closed it) a new connection is established.
+static net::tcp_connection& get_tcp_session(const net::self_address& tcp_addr) {
+	if (keep_alive && tcp_session.reusable())
+		return tcp_session;
+	tcp_session = net::tcp_connection{tcp_addr};
+	if (!tcp_session.valid())
+		throw net::socket_error{"Could not open tcp socket"};
+	if (!keep_alive)
+		return tcp_session;
+	start_keep_alive();
+	if (keep_alive)
+		return tcp_session;
+	tcp_session = net::tcp_connection{tcp_addr}; // server closed after the ERR
+	if (!tcp_session.valid())
+		throw net::socket_error{"Could not open tcp socket"};
+	return tcp_session;
+}
+
 // Implements the 'show_trials' command by asking the game server to send a list
 // of previously made trials and the respective results by establishing a TCP session
 static void do_show_trials(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr) {
@@ -511,13 +495,9 @@ static void do_show_trials(net::stream<net::file_source>& msg, net::udp_connecti
 		throw net::syntax_error{"show_trials does not take arguments"};
 	if (!is_plid_set)
 		throw net::game_error{"No valid player id has been set"};
-	net::out_stream out_strm;
-	out_strm.write("STR").write({current_plid, PLID_SIZE}).prime();
+	net::out_stream out_strm = net::trials_request::make(std::string_view{current_plid, PLID_SIZE});
 
-	net::tcp_connection tcp{tcp_addr};
-	if (!tcp.valid())
-		throw net::socket_error{"Could not open tcp socket"};
-	auto ans_strm = tcp.request(out_strm);
+	auto ans_strm = get_tcp_session(tcp_addr).request(out_strm);
 	net::field fld;
 	try {
 		fld = ans_strm.read(3, 3);
@@ -560,18 +540,9 @@ static void do_show_trials(net::stream<net::file_source>& msg, net::udp_connecti
 	std::cout << modifier << " trials (at " << fname << ", " << file.size() << " bytes):\n" << file << '\n';
 }
 
-// Implements the 'scoreboard' command by asking the game server to send the scoreboard by establishing a TCP session
-static void do_scoreboard(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr) {
-	if (!msg.no_more_fields())
-		throw net::syntax_error{"scoreboard takes no arguments"};
-
-	net::out_stream out_strm;
-	out_strm.write("SSB").prime();
-
-	net::tcp_connection tcp{tcp_addr};
-	if (!tcp.valid())
-		throw net::socket_error{"Could not open tcp socket"};
-	auto ans_strm = tcp.request(out_strm);
+// Reads a scoreboard reply (to a 'scoreboard' request or pushed to a subscriber),
+// saving and showing the scoreboard. Returns false if the server replied ERR
+static bool read_scoreboard(net::stream<net::tcp_source>& ans_strm) {
 	net::field fld;
 	try {
 		fld = ans_strm.read(3, 3);
@@ -579,7 +550,7 @@ static void do_scoreboard(net::stream<net::file_source>& msg, net::udp_connectio
 			if (fld == "ERR") {
 				ans_strm.check_strict_end();
 				std::cout << DEFAULT_ERR_MSG << '\n';
-				return;
+				return false;
 			}
 			throw net::bad_response{"Unknown reply"};
 		}
@@ -588,7 +559,7 @@ static void do_scoreboard(net::stream<net::file_source>& msg, net::udp_connectio
 		if (fld == "EMPTY") {
 			ans_strm.check_strict_end();
 			std::cout << "The scoreboard is empty\n";
-			return;
+			return true;
 		}
 	} catch (net::interaction_error& err) {
 		throw net::bad_response{"Bad server scoreboard response"};
@@ -605,4 +576,44 @@ static void do_scoreboard(net::stream<net::file_source>& msg, net::udp_connectio
 	}
 	write_file(fname, file);
 	std::cout << "Scoreboard (at " << fname << ", " << file.size() << " bytes):\n" << file << '\n';
+	return true;
+}
+
+// Implements the 'scoreboard' command by asking the game server to send the scoreboard by establishing a TCP session
+static void do_scoreboard(net::stream<net::file_source>& msg, net::udp_connection& udp, const net::self_address& tcp_addr) {
+	if (!msg.no_more_fields())
+		throw net::syntax_error{"scoreboard takes no arguments"};
+
+	net::out_stream out_strm = net::scoreboard_request::make();
+
+	auto ans_strm = get_tcp_session(tcp_addr).request(out_strm);
+	read_scoreboard(ans_strm);
+}
+
+// Implements the 'watch' command by subscribing to the scoreboard on a TCP
+// session of its own: the server sends the scoreboard right away and then
+// whenever it changes. Shows it and the next N changes, giving up after
+// WATCH_TIMEOUT seconds without one
+static void do_watch(net::stream<net::file_source>& msg, net::udp_connection&, const net::self_address& tcp_addr) {
+	auto fields = msg.read({{1, 2}});
+	if (!msg.no_more_fields())
+		throw net::syntax_error{"watch only takes N"};
+	if (fields[0].find_first_not_of("0123456789") != std::string::npos)
+		throw net::syntax_error{"Invalid number of changes"};
+	int changes = std::stoi(fields[0]);
+
+	net::tcp_connection subscription{tcp_addr};
+	if (!subscription.valid())
+		throw net::socket_error{"Could not open tcp socket"};
+	auto ans_strm = subscription.request(net::subscribe_request::make());
+	if (!read_scoreboard(ans_strm))
+		return;
+	for (int i = 0; i < changes; i++) {
+		if (!subscription.wait_readable(WATCH_TIMEOUT * 1000)) {
+			std::cout << "The scoreboard did not change in " << WATCH_TIMEOUT << " seconds\n";
+			return;
+		}
+		auto push_strm = subscription.to_stream();
+		read_scoreboard(push_strm);
+	}
 }
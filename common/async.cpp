@@ -0,0 +1,646 @@
+#include "async.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+
+using namespace net;
+
+static thread_local executor* current_executor = nullptr;
+static thread_local std::exception_ptr* current_job_error = nullptr;
+
+executor::executor(bool use_uring) {
+	if ((_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return;
+	if (!use_uring || !setup_uring()) {
+		if ((_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			close(_event_fd);
+			_event_fd = -1;
+			return;
+		}
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = _event_fd;
+		if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _event_fd, &ev) == -1) {
+			close(_epoll_fd);
+			close(_event_fd);
+			_epoll_fd = _event_fd = -1;
+			return;
+		}
+	}
+	_worker = std::thread{&executor::work, this};
+}
+
+bool executor::setup_uring() {
+	// completions are only handled by this thread, when it waits for them
+	auto ring = std::make_unique<uring>(URING_NET_ENTRIES,
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+	if (!ring->valid()) // before Linux 6.1
+		ring = std::make_unique<uring>(URING_NET_ENTRIES);
+	if (!ring->valid())
+		return false;
+	for (uint8_t opcode : {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,
+		IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_ACCEPT})
+		if (!ring->supports(opcode))
+			return false;
+	size_t buf_size = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + UDP_CONTROL_SIZE + UDP_MSG_SIZE;
+	if (!ring->provide_buffers(URING_RECV_BUFFERS, buf_size))
+		return false;
+	_ring = std::move(ring);
+	arm_event();
+	return true;
+}
+
+executor::~executor() {
+	if (_worker.joinable()) {
+		{
+			std::lock_guard<std::mutex> guard{_lock};
+			_exit_worker = true;
+		}
+		_has_jobs.notify_one();
+		_worker.join();
+	}
+	for (auto& [fd, acc] : _acceptors)
+		for (int client : acc.ready)
+			close(client);
+	if (_epoll_fd != -1)
+		close(_epoll_fd);
+	if (_event_fd != -1)
+		close(_event_fd);
+}
+
+bool executor::valid() const {
+	return _event_fd != -1;
+}
+
+bool executor::uses_uring() const {
+	return _ring != nullptr;
+}
+
+void executor::spawn(task<void>&& t) {
+	schedule(t.detach());
+}
+
+void executor::schedule(std::coroutine_handle<> h) {
+	_ready.push_back(h);
+}
+
+executor& executor::current() {
+	return *current_executor;
+}
+
+void executor::run() {
+	executor* previous = current_executor;
+	current_executor = this;
+	while (!_stop) {
+		while (!_ready.empty() && !_stop) {
+			auto h = _ready.front();
+			_ready.pop_front();
+			h.resume();
+		}
+		if (_stop)
+			break;
+
+		int timeout = -1;
+		if (!_ready.empty())
+			timeout = 0;
+		else if (!_timers.empty()) {
+			auto left = std::chrono::ceil<std::chrono::milliseconds>(_timers.begin()->first - clock::now());
+			timeout = left.count() < 0 ? 0 : static_cast<int>(left.count());
+		}
+		try {
+			if (_ring)
+				wait_uring(timeout);
+			else
+				wait_epoll(timeout);
+		} catch (...) {
+			current_executor = previous;
+			throw;
+		}
+		auto now = clock::now();
+		while (!_timers.empty() && _timers.begin()->first <= now)
+			wake(_timers.begin()->second, true);
+	}
+	current_executor = previous;
+}
+
+void executor::wait_epoll(int timeout) {
+	epoll_event events[64];
+	int n = epoll_wait(_epoll_fd, events, std::size(events), timeout);
+	if (n == -1) {
+		if (errno == EINTR)
+			return;
+		throw system_error{"Failed to wait for events"};
+	}
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if (fd == _event_fd) { // offloaded jobs finished
+			collect_done();
+			continue;
+		}
+		auto it = _fds.find(fd);
+		if (it == _fds.end())
+			continue;
+		uint32_t ev = events[i].events;
+		io_awaiter* reader = it->second.reader;
+		io_awaiter* writer = it->second.writer;
+		if (reader && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+			wake(reader, false);
+		if (writer && (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+			wake(writer, false);
+	}
+}
+
+void executor::wait_uring(int timeout) {
+	_ring->submit_and_wait(timeout);
+	_ring->for_each_completion([this](const io_uring_cqe& cqe) { complete(cqe); });
+}
+
+void executor::collect_done() {
+	uint64_t count;
+	while (read(_event_fd, &count, sizeof(count)) > 0)
+		continue;
+	std::lock_guard<std::mutex> guard{_lock};
+	for (auto h : _done)
+		_ready.push_back(h);
+	_done.clear();
+}
+
+void executor::on_batch_end(std::function<void()>&& hook) {
+	std::lock_guard<std::mutex> guard{_lock};
+	_batch_end = std::move(hook);
+}
+
+std::exception_ptr* executor::job_error() {
+	return current_job_error;
+}
+
+void executor::stop() {
+	_stop = true;
+	uint64_t one = 1;
+	if (write(_event_fd, &one, sizeof(one)) == -1)
+		return; // the counter is already set => the loop will wake up anyways
+}
+
+executor::io_awaiter executor::readable(int fd, int timeout) {
+	return io_awaiter{*this, fd, EPOLLIN | EPOLLRDHUP, timeout};
+}
+
+executor::io_awaiter executor::writable(int fd, int timeout) {
+	return io_awaiter{*this, fd, EPOLLOUT, timeout};
+}
+
+executor::io_awaiter executor::sleep(int ms) {
+	return io_awaiter{*this, -1, 0, ms};
+}
+
+void executor::io_awaiter::await_suspend(std::coroutine_handle<> h) {
+	_h = h;
+	_ex.watch(this);
+}
+
+bool executor::io_awaiter::await_resume() noexcept {
+	return !_timed_out;
+}
+
+void executor::watch(io_awaiter* aw) {
+	if (aw->_fd != -1 && _ring) {
+		aw->_poll = ++_next_id;
+		_polls[aw->_poll] = aw;
+		io_uring_sqe* sqe = get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = aw->_fd;
+		sqe->poll32_events = aw->_events; // the EPOLL* flags match the POLL* ones
+		sqe->user_data = tag(op::POLL, aw->_poll);
+	} else if (aw->_fd != -1) {
+		watched_fd& w = _fds[aw->_fd];
+		io_awaiter*& slot = (aw->_events & EPOLLOUT) ? w.writer : w.reader;
+		if (slot)
+			throw system_error{"Two coroutines waiting on the same fd"};
+		slot = aw;
+		rearm(aw->_fd);
+	}
+	if (aw->_timeout >= 0) {
+		auto when = clock::now() + std::chrono::milliseconds(aw->_timeout);
+		aw->_timer = _timers.insert({when, aw});
+	}
+}
+
+void executor::rearm(int fd) {
+	auto it = _fds.find(fd);
+	if (it == _fds.end())
+		return;
+	watched_fd& w = it->second;
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (w.reader)
+		ev.events |= w.reader->_events;
+	if (w.writer)
+		ev.events |= w.writer->_events;
+	if (ev.events == 0) {
+		if (w.registered)
+			epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+		_fds.erase(it);
+		return;
+	}
+	int op = w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(_epoll_fd, op, fd, &ev) == -1)
+		throw system_error{"Failed to watch file descriptor"};
+	w.registered = true;
+}
+
+void executor::wake(io_awaiter* aw, bool timed_out) {
+	aw->_timed_out = timed_out;
+	if (aw->_timeout >= 0)
+		_timers.erase(aw->_timer);
+	if (aw->_fd != -1 && _ring) {
+		if (_polls.erase(aw->_poll) != 0 && timed_out) { // still in flight => cancel it
+			io_uring_sqe* sqe = get_sqe();
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->addr = tag(op::POLL, aw->_poll);
+			sqe->user_data = tag(op::POLL_REMOVE, 0);
+		}
+	} else if (aw->_fd != -1) {
+		watched_fd& w = _fds[aw->_fd];
+		if (w.reader == aw)
+			w.reader = nullptr;
+		if (w.writer == aw)
+			w.writer = nullptr;
+		rearm(aw->_fd);
+	}
+	_ready.push_back(aw->_h);
+}
+
+void executor::submit(std::function<void()>&& run, std::coroutine_handle<> awaiting,
+	std::exception_ptr* error) {
+	{
+		std::lock_guard<std::mutex> guard{_lock};
+		_jobs.push_back({std::move(run), awaiting, error});
+	}
+	_has_jobs.notify_one();
+}
+
+void executor::work() {
+	std::deque<job> batch;
+	std::function<void()> batch_end;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard{_lock};
+			_has_jobs.wait(guard, [this]() { return _exit_worker || !_jobs.empty(); });
+			if (_jobs.empty()) // => exiting
+				return;
+			batch.swap(_jobs);
+			if (_batch_end)
+				batch_end = _batch_end;
+		}
+		for (auto& j : batch) {
+			current_job_error = j.error;
+			j.run();
+		}
+		current_job_error = nullptr;
+		if (batch_end) {
+			try {
+				batch_end();
+			} catch (...) { // fail the jobs that did not fail already
+				for (auto& j : batch)
+					if (j.error && !*j.error)
+						*j.error = std::current_exception();
+			}
+		}
+		{
+			std::lock_guard<std::mutex> guard{_lock};
+			for (auto& j : batch)
+				_done.push_back(j.awaiting);
+		}
+		batch.clear();
+		uint64_t one = 1;
+		if (write(_event_fd, &one, sizeof(one)) == -1)
+			continue; // the counter is already set => the loop will wake up anyways
+	}
+}
+
+uint64_t executor::tag(op kind, uint64_t value) {
+	return (static_cast<uint64_t>(kind) << 56) | value;
+}
+
+io_uring_sqe* executor::get_sqe() {
+	io_uring_sqe* sqe = _ring->get_sqe();
+	if (!sqe) { // full => make room
+		_ring->submit();
+		sqe = _ring->get_sqe();
+		if (!sqe)
+			throw system_error{"Failed to get an io_uring entry"};
+	}
+	return sqe;
+}
+
+void executor::arm_event() {
+	io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = _event_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = tag(op::EVENT, 0);
+}
+
+void executor::arm_receiver(int fd) {
+	receiver& r = _receivers[fd];
+	memset(&r.hdr, 0, sizeof(r.hdr));
+	r.hdr.msg_namelen = sizeof(sockaddr_in);
+	r.hdr.msg_controllen = UDP_CONTROL_SIZE;
+	io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(&r.hdr);
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = tag(op::RECEIVE, fd);
+	r.armed = true;
+}
+
+void executor::arm_acceptor(int fd) {
+	io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = tag(op::ACCEPT, fd);
+	_acceptors[fd].armed = true;
+}
+
+void executor::complete(const io_uring_cqe& cqe) {
+	op kind = static_cast<op>(cqe.user_data >> 56);
+	uint64_t value = cqe.user_data & ((uint64_t{1} << 56) - 1);
+	bool more = cqe.flags & IORING_CQE_F_MORE;
+	switch (kind) {
+	case op::POLL: {
+		auto it = _polls.find(value);
+		if (it != std::end(_polls)) // not timed out yet
+			wake(it->second, false);
+		break;
+	}
+	case op::POLL_REMOVE:
+		break;
+	case op::EVENT:
+		collect_done();
+		if (!more)
+			arm_event();
+		break;
+	case op::RECEIVE: {
+		int fd = static_cast<int>(value);
+		receiver& r = _receivers[fd];
+		r.armed = more;
+		if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+			uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			char* buf = _ring->buffer(bid);
+			io_uring_recvmsg_out out;
+			memcpy(&out, buf, sizeof(out));
+			char* name = buf + sizeof(out);
+			char* payload = name + r.hdr.msg_namelen + r.hdr.msg_controllen;
+			datagram d;
+			d.msg.assign(payload, std::min<size_t>(out.payloadlen, UDP_MSG_SIZE));
+			d.from.addrlen = std::min<socklen_t>(out.namelen, sizeof(d.from.addr));
+			memset(&d.from.addr, 0, sizeof(d.from.addr));
+			memcpy(&d.from.addr, name, d.from.addrlen);
+			msghdr control; // where receive_time() looks for the timestamp
+			memset(&control, 0, sizeof(control));
+			control.msg_control = name + r.hdr.msg_namelen;
+			control.msg_controllen = out.controllen;
+			d.received = receive_time(control);
+			r.ready.push_back(std::move(d));
+			_ring->recycle_buffer(bid);
+		} else if (cqe.res < 0 && cqe.res != -ENOBUFS) // ran out of buffers => just rearm
+			r.failed = true;
+		if (!r.armed && !r.failed)
+			arm_receiver(fd);
+		if (r.waiter && (!r.ready.empty() || r.failed)) {
+			schedule(r.waiter);
+			r.waiter = {};
+		}
+		break;
+	}
+	case op::ACCEPT: {
+		int fd = static_cast<int>(value);
+		acceptor& a = _acceptors[fd];
+		a.armed = more;
+		if (cqe.res >= 0)
+			a.ready.push_back(cqe.res);
+		else if (cqe.res != -ECONNABORTED && cqe.res != -EAGAIN)
+			a.failed = true;
+		if (!a.armed && !a.failed)
+			arm_acceptor(fd);
+		if (a.waiter && (!a.ready.empty() || a.failed)) {
+			schedule(a.waiter);
+			a.waiter = {};
+		}
+		break;
+	}
+	case op::SEND:
+		_sends.erase(value);
+		break;
+	}
+}
+
+task<void> executor::receive_from(int fd, std::string& msg, other_address& from, timespec* received) {
+	receiver& r = _receivers[fd];
+	if (!r.armed && !r.failed)
+		arm_receiver(fd);
+	co_await arrival_awaiter<receiver>{r};
+	if (r.ready.empty())
+		throw conn_error{"Failed to receive udp data"};
+	msg = std::move(r.ready.front().msg);
+	from = r.ready.front().from;
+	if (received)
+		*received = r.ready.front().received;
+	r.ready.pop_front();
+}
+
+void executor::send_to(int fd, const std::string_view& data, const other_address& to) {
+	auto out = std::make_unique<outgoing>();
+	out->data = data;
+	out->to = to.addr;
+	out->iov = {out->data.data(), out->data.size()};
+	memset(&out->hdr, 0, sizeof(out->hdr));
+	out->hdr.msg_name = &out->to;
+	out->hdr.msg_namelen = to.addrlen;
+	out->hdr.msg_iov = &out->iov;
+	out->hdr.msg_iovlen = 1;
+	uint64_t id = ++_next_id;
+	io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(&out->hdr);
+	sqe->len = 1;
+	sqe->user_data = tag(op::SEND, id);
+	_sends[id] = std::move(out);
+}
+
+task<int> executor::accept(int fd, other_address& from) {
+	acceptor& a = _acceptors[fd];
+	if (!a.armed && !a.failed)
+		arm_acceptor(fd);
+	co_await arrival_awaiter<acceptor>{a};
+	if (a.ready.empty())
+		throw socket_error{"Failed to accept a new client"};
+	int client = a.ready.front();
+	a.ready.pop_front();
+	from.addrlen = sizeof(from.addr);
+	if (getpeername(client, reinterpret_cast<sockaddr*>(&from.addr), &from.addrlen) == -1)
+		memset(&from.addr, 0, sizeof(from.addr)); // the client is already gone
+	co_return client;
+}
+
+tcp_buffer_source::tcp_buffer_source(const std::string_view& source) : string_source(source) {}
+tcp_buffer_source::tcp_buffer_source(std::string_view&& source) : string_source(std::move(source)) {}
+
+bool tcp_buffer_source::is_skippable(char c) const {
+	return c == DEFAULT_SEP;
+}
+
+async_tcp_connection::async_tcp_connection(executor& ex, tcp_connection&& conn)
+	: tcp_connection{std::move(conn)}, _ex{ex} {
+	if (_fd == -1)
+		return;
+	int flags = fcntl(_fd, F_GETFL);
+	if (flags == -1 || fcntl(_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		close(_fd);
+		_fd = -1;
+	}
+}
+
+bool async_tcp_connection::valid() const {
+	return tcp_connection::valid();
+}
+
+task<bool> async_tcp_connection::receive(std::string& msg, int timeout) {
+	char buf[MAX_TCP_REQUEST_SIZE];
+	size_t eom;
+	while ((eom = _pending.find(DEFAULT_EOM)) == std::string::npos) {
+		if (_pending.size() >= MAX_TCP_REQUEST_SIZE) { // give up on finding the EOM
+			msg = std::move(_pending);
+			_pending.clear();
+			co_return true;
+		}
+		ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+		if (n == 0)
+			co_return false; // peer closed
+		if (n > 0) {
+			_pending.append(buf, n);
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw conn_error{"Failed to receive tcp data"};
+		bool ready = co_await _ex.readable(_fd, timeout);
+		if (!ready)
+			co_return false; // timed out
+	}
+	msg.assign(_pending, 0, eom + 1);
+	_pending.erase(0, eom + 1);
+	co_return true;
+}
+
+task<void> async_tcp_connection::answer(const out_stream& out) {
+	auto view = out.view();
+	iovec iov{const_cast<char*>(view.data()), view.size()};
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	co_await send_all(msg);
+}
+
+task<void> async_tcp_connection::answer(const out_stream& header, const std::string_view& body) {
+	static char eom = DEFAULT_EOM;
+	auto view = header.view();
+	iovec iov[3] = {
+		{const_cast<char*>(view.data()), view.size()},
+		{const_cast<char*>(body.data()), body.size()},
+		{&eom, 1}
+	};
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	co_await send_all(msg);
+}
+
+task<void> async_tcp_connection::answer_file(const out_stream& header, int fd, size_t len) {
+	static char eom = DEFAULT_EOM;
+	auto view = header.view();
+	iovec iov{const_cast<char*>(view.data()), view.size()};
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	co_await send_all(msg, MSG_MORE);
+	off_t off = 0;
+	while (!send_file_some(fd, off, len)) {
+		bool ready = co_await _ex.writable(_fd, DEFAULT_TIMEOUT * 1000);
+		if (!ready)
+			throw conn_error{"Timed out sending file through tcp"};
+	}
+	iov = {&eom, 1};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	co_await send_all(msg);
+}
+
+void async_tcp_connection::set_keep_alive(bool keep_alive) {
+	_keep_alive = keep_alive;
+}
+
+bool async_tcp_connection::keep_alive() const {
+	return _keep_alive;
+}
+
+int async_tcp_connection::get_fildes() const {
+	return _fd;
+}
+
+task<void> async_tcp_connection::send_all(msghdr& msg, int flags) {
+	while (!send_some(msg, flags)) {
+		bool ready = co_await _ex.writable(_fd, DEFAULT_TIMEOUT * 1000);
+		if (!ready)
+			throw conn_error{"Timed out sending tcp data"};
+	}
+}
+
+async_udp_connection::async_udp_connection(executor& ex, udp_connection& conn)
+	: _ex{ex}, _conn{conn}, _fd{conn.get_fildes()} {}
+
+task<void> async_udp_connection::listen(std::string& msg, other_address& other, timespec* received) {
+	if (_ex.uses_uring()) {
+		co_await _ex.receive_from(_fd, msg, other, received);
+		co_return;
+	}
+	while (!_conn.try_listen(msg, other, received))
+		co_await _ex.readable(_fd);
+}
+
+void async_udp_connection::answer(const out_stream& msg, const other_address& other) const {
+	if (_ex.uses_uring())
+		return _ex.send_to(_fd, msg.view(), other);
+	_conn.answer(msg, other);
+}
+
+async_tcp_server::async_tcp_server(executor& ex, tcp_server& server)
+	: _ex{ex}, _server{server} {}
+
+task<tcp_connection> async_tcp_server::accept_client(other_address& other) {
+	if (_ex.uses_uring()) {
+		int fd = co_await _ex.accept(_server.get_fildes(), other);
+		co_return tcp_connection{fd};
+	}
+	while (true) {
+		tcp_connection conn = _server.try_accept_client(other);
+		if (conn.valid())
+			co_return conn;
+		co_await _ex.readable(_server.get_fildes());
+	}
+}
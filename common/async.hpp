@@ -0,0 +1,683 @@
+#ifndef _ASYNC_HPP_
+#define _ASYNC_HPP_
+
+#include "common.hpp"
+#include "uring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define MAX_TCP_REQUEST_SIZE 128
+#define URING_NET_ENTRIES 1024
+#define URING_RECV_BUFFERS 256 // datagrams received, but not yet copied out
+
+namespace net {
+template<typename T>
+struct task;
+
+namespace detail {
+/// State shared by the promises of every task<T>.
+struct promise_base {
+	/// Resumes whoever awaited the task (if anyone) or destroys
+	/// the coroutine if it was detached.
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template<typename PROMISE>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<PROMISE> h) noexcept {
+			promise_base& p = h.promise();
+			if (p.detached) {
+				if (p.error) // nobody is left to handle it
+					std::terminate();
+				h.destroy();
+				return std::noop_coroutine();
+			}
+			if (p.continuation)
+				return p.continuation;
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+
+	std::coroutine_handle<> continuation{};
+	std::exception_ptr error{};
+	bool detached{false};
+};
+
+template<typename T>
+struct promise : public promise_base {
+	task<T> get_return_object();
+
+	void return_value(T val) { value.emplace(std::move(val)); }
+
+	T result() {
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+
+	std::optional<T> value;
+};
+
+template<>
+struct promise<void> : public promise_base {
+	task<void> get_return_object();
+
+	void return_void() {}
+
+	void result() {
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+};
+
+/// A lazily started coroutine that produces a T.
+/// It starts running when it is co_await'ed (the awaiting coroutine
+/// is resumed when it finishes) or when it is spawned in an executor.
+/// Exceptions thrown inside the task are rethrown to whoever awaits it.
+template<typename T = void>
+struct [[nodiscard]] task {
+	using promise_type = detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	struct awaiter {
+		bool await_ready() const noexcept { return !_h || _h.done(); }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+			_h.promise().continuation = awaiting;
+			return _h;
+		}
+
+		T await_resume() { return _h.promise().result(); }
+
+		handle_type _h;
+	};
+
+	explicit task(handle_type h) : _h{h} {}
+
+	task(const task& other) = delete;
+
+	task& operator=(const task& other) = delete;
+
+	task(task&& other) noexcept : _h{other._h} {
+		other._h = nullptr;
+	}
+
+	task& operator=(task&& other) noexcept {
+		if (this == &other)
+			return *this;
+		if (_h)
+			_h.destroy();
+		_h = other._h;
+		other._h = nullptr;
+		return *this;
+	}
+
+	~task() {
+		if (_h)
+			_h.destroy();
+	}
+
+	awaiter operator co_await() && noexcept {
+		return awaiter{_h};
+	}
+
+	/// Gives up the ownership of the coroutine: it will destroy itself
+	/// when it finishes. It must not throw (the program terminates if it does).
+	handle_type detach() {
+		handle_type h = _h;
+		_h = nullptr;
+		h.promise().detached = true;
+		return h;
+	}
+private:
+	handle_type _h;
+};
+
+template<typename T>
+task<T> detail::promise<T>::get_return_object() {
+	return task<T>{task<T>::handle_type::from_promise(*this)};
+}
+
+inline task<void> detail::promise<void>::get_return_object() {
+	return task<void>{task<void>::handle_type::from_promise(*this)};
+}
+
+/// Single threaded event loop that runs coroutines.
+/// Coroutines suspend on socket readiness (epoll, or io_uring polls), on
+/// timers, or while a blocking operation (like file IO) runs on the
+/// executor's worker thread. The worker runs the offloaded operations one
+/// at a time, in the order they were submitted, so they never race with
+/// each other.
+/// In io_uring mode, datagrams and connections can also be received
+/// by multishot operations, and datagrams sent without a system call
+/// each (see receive_from, accept and send_to).
+struct executor {
+	using clock = std::chrono::steady_clock;
+
+	/// Runs on io_uring if 'use_uring' is set and the kernel supports it
+	/// (Linux 6.0 or later, check uses_uring()); otherwise runs on epoll.
+	executor(bool use_uring = false);
+
+	executor(const executor& other) = delete;
+
+	executor& operator=(const executor& other) = delete;
+
+	/// Coroutines still suspended at this point are leaked.
+	~executor();
+
+	/// Returns true if the executor is ready to use; false otherwise.
+	bool valid() const;
+
+	/// Returns true if the loop runs on io_uring; false if on epoll.
+	bool uses_uring() const;
+
+	/// Starts running 't' in the background (the executor owns it).
+	/// 't' must not throw.
+	void spawn(task<void>&& t);
+
+	/// Resumes 'h' on the next iteration of the loop.
+	void schedule(std::coroutine_handle<> h);
+
+	/// Runs the loop until stop() is called.
+	/// Throws system_error if waiting for events fails.
+	void run();
+
+	/// Makes run() return. Safe to call from a signal handler.
+	void stop();
+
+	/// Returns the executor that is running on the current thread.
+	static executor& current();
+
+	/// Sets a function for the worker to call after running each batch of
+	/// offloaded jobs, before their coroutines are resumed. Jobs may leave
+	/// work for it to finish (like disk writes that are submitted together),
+	/// which can still fail them through the slot given by job_error().
+	void on_batch_end(std::function<void()>&& hook);
+
+	/// Returns where the error of the job running on the calling thread
+	/// is stored (so it can be set after the job returns, but before the
+	/// batch ends); nullptr if the thread is not running a job.
+	static std::exception_ptr* job_error();
+
+	/// Awaitable that waits for a file descriptor to be ready.
+	/// co_await evaluates to false if the timeout expired first.
+	struct io_awaiter {
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h);
+		bool await_resume() noexcept;
+
+		executor& _ex;
+		int _fd;
+		uint32_t _events;
+		int _timeout;
+		std::coroutine_handle<> _h{};
+		bool _timed_out{false};
+		std::multimap<clock::time_point, io_awaiter*>::iterator _timer{};
+		uint64_t _poll{0}; // io_uring poll in flight
+	};
+
+	/// Waits up to 'timeout' milliseconds (-1 waits forever) until
+	/// 'fd' has data to read.
+	io_awaiter readable(int fd, int timeout = -1);
+
+	/// Waits up to 'timeout' milliseconds (-1 waits forever) until
+	/// 'fd' can be written to.
+	io_awaiter writable(int fd, int timeout = -1);
+
+	/// Suspends the coroutine for 'ms' milliseconds.
+	io_awaiter sleep(int ms);
+
+	/// Awaitable that runs a blocking function on the worker thread.
+	/// co_await evaluates to the result of the function (or rethrows
+	/// whatever it threw).
+	template<typename R>
+	struct offload_awaiter {
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h) {
+			_ex.submit([this]() {
+				try {
+					if constexpr (std::is_void_v<R>)
+						_func();
+					else
+						_value.emplace(_func());
+				} catch (...) {
+					_error = std::current_exception();
+				}
+			}, h, &_error);
+		}
+
+		R await_resume() {
+			if (_error)
+				std::rethrow_exception(_error);
+			if constexpr (!std::is_void_v<R>)
+				return std::move(*_value);
+		}
+
+		executor& _ex;
+		std::function<R()> _func;
+		std::exception_ptr _error{};
+		std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> _value{};
+	};
+
+	/// Runs 'func' on the worker thread, without blocking the loop.
+	/// Use it for file operations and any other blocking call.
+	template<typename FUNC>
+	offload_awaiter<std::invoke_result_t<FUNC>> offload(FUNC&& func) {
+		return {*this, std::forward<FUNC>(func)};
+	}
+
+	/// Receives the next datagram sent to the udp socket 'fd' (truncated
+	/// to UDP_MSG_SIZE bytes) into 'msg', and when the kernel received it
+	/// into 'received' (see udp_connection::try_listen).
+	/// A single multishot recvmsg, started by the first call, receives
+	/// every datagram into the ring's provided buffers.
+	/// Only one coroutine may receive from each socket.
+	/// Only available in io_uring mode.
+	/// Throws conn_error if receiving fails.
+	task<void> receive_from(int fd, std::string& msg, other_address& from, timespec* received = nullptr);
+
+	/// Sends 'data' to 'to' through the udp socket 'fd', without waiting:
+	/// the send (of a copy of 'data') goes with the next submission.
+	/// Failed sends are ignored, as any other lost datagram.
+	/// Only available in io_uring mode.
+	void send_to(int fd, const std::string_view& data, const other_address& to);
+
+	/// Accepts the next client of the listening socket 'fd'.
+	/// A single multishot accept, started by the first call, accepts
+	/// every client.
+	/// co_await evaluates to the (non-blocking) socket of the client.
+	/// Only one coroutine may accept from each socket.
+	/// Only available in io_uring mode.
+	/// Throws socket_error if accepting fails.
+	task<int> accept(int fd, other_address& from);
+private:
+	struct watched_fd {
+		io_awaiter* reader{nullptr};
+		io_awaiter* writer{nullptr};
+		bool registered{false};
+	};
+
+	/// What an io_uring completion is for (the top byte of its user_data).
+	enum class op : uint8_t {
+		POLL = 1,
+		POLL_REMOVE,
+		EVENT,
+		RECEIVE,
+		ACCEPT,
+		SEND
+	};
+
+	struct datagram {
+		std::string msg;
+		other_address from;
+		timespec received;
+	};
+
+	/// Datagrams received by the multishot recvmsg of a socket.
+	struct receiver {
+		std::deque<datagram> ready;
+		std::coroutine_handle<> waiter{};
+		msghdr hdr{};
+		bool armed{false};
+		bool failed{false};
+	};
+
+	/// Clients accepted by the multishot accept of a socket.
+	struct acceptor {
+		std::deque<int> ready;
+		std::coroutine_handle<> waiter{};
+		bool armed{false};
+		bool failed{false};
+	};
+
+	/// Suspends until a receiver/acceptor has something ready (or failed).
+	template<typename QUEUE>
+	struct arrival_awaiter {
+		bool await_ready() const noexcept { return !_queue.ready.empty() || _queue.failed; }
+		void await_suspend(std::coroutine_handle<> h) noexcept { _queue.waiter = h; }
+		void await_resume() const noexcept {}
+
+		QUEUE& _queue;
+	};
+
+	/// A datagram being sent through io_uring.
+	struct outgoing {
+		std::string data;
+		sockaddr_in to;
+		iovec iov;
+		msghdr hdr;
+	};
+
+	struct job {
+		std::function<void()> run;
+		std::coroutine_handle<> awaiting;
+		std::exception_ptr* error;
+	};
+
+	/// Registers the awaiter so it is resumed when ready (or when its
+	/// timeout expires).
+	void watch(io_awaiter* aw);
+
+	/// Updates the events epoll listens to on fd.
+	void rearm(int fd);
+
+	/// Resumes an awaiter that either became ready or timed out.
+	void wake(io_awaiter* aw, bool timed_out);
+
+	/// Queues a job on the worker thread. 'awaiting' is resumed in the
+	/// loop once the job (and the batch it ran in) is over.
+	void submit(std::function<void()>&& run, std::coroutine_handle<> awaiting,
+		std::exception_ptr* error);
+
+	/// Body of the worker thread.
+	void work();
+
+	/// Sets up the io_uring backend. Returns false if it is not supported.
+	bool setup_uring();
+
+	/// Waits up to 'timeout' milliseconds for epoll events and handles them.
+	void wait_epoll(int timeout);
+
+	/// Submits the queued io_uring entries, waits up to 'timeout'
+	/// milliseconds for completions and handles them.
+	void wait_uring(int timeout);
+
+	/// Handles an io_uring completion.
+	void complete(const io_uring_cqe& cqe);
+
+	/// Moves the coroutines whose offloaded jobs finished to the ready queue.
+	void collect_done();
+
+	/// Returns an empty io_uring submission entry (submitting the queued
+	/// ones if there is no room).
+	io_uring_sqe* get_sqe();
+
+	/// Starts waiting (in io_uring mode) for the worker to signal the eventfd.
+	void arm_event();
+
+	/// Starts the multishot recvmsg of 'fd'.
+	void arm_receiver(int fd);
+
+	/// Starts the multishot accept of 'fd'.
+	void arm_acceptor(int fd);
+
+	/// Builds the user_data of an io_uring entry.
+	static uint64_t tag(op kind, uint64_t value);
+
+	int _epoll_fd{-1};
+	int _event_fd{-1};
+	std::atomic<bool> _stop{false};
+	std::deque<std::coroutine_handle<>> _ready;
+	std::unordered_map<int, watched_fd> _fds;
+	std::multimap<clock::time_point, io_awaiter*> _timers;
+
+	std::unique_ptr<uring> _ring{}; // null => epoll
+	uint64_t _next_id{0};
+	std::unordered_map<uint64_t, io_awaiter*> _polls; // in flight
+	std::unordered_map<int, receiver> _receivers;
+	std::unordered_map<int, acceptor> _acceptors;
+	std::unordered_map<uint64_t, std::unique_ptr<outgoing>> _sends; // in flight
+
+	std::thread _worker;
+	std::mutex _lock; // protects the members below
+	std::condition_variable _has_jobs;
+	std::deque<job> _jobs; // waiting for the worker
+	std::vector<std::coroutine_handle<>> _done; // ran, waiting to be resumed
+	std::function<void()> _batch_end{};
+	bool _exit_worker{false};
+};
+
+/// Serializes the coroutines (of a single executor) that lock the
+/// same key, while letting the ones with different keys interleave.
+/// Waiters acquire the key in the order they asked for it.
+template<typename KEY>
+struct keyed_mutex {
+	/// Releases the key when destroyed.
+	struct guard {
+		guard(keyed_mutex* mtx, const KEY& key) : _mtx{mtx}, _key{key} {}
+
+		guard(const guard& other) = delete;
+
+		guard& operator=(const guard& other) = delete;
+
+		guard(guard&& other) : _mtx{other._mtx}, _key{std::move(other._key)} {
+			other._mtx = nullptr;
+		}
+
+		~guard() {
+			if (_mtx)
+				_mtx->unlock(_key);
+		}
+	private:
+		keyed_mutex* _mtx;
+		KEY _key;
+	};
+
+	struct lock_awaiter {
+		bool await_ready() {
+			return _mtx._waiters.try_emplace(_key).second; // free => taken
+		}
+
+		void await_suspend(std::coroutine_handle<> h) {
+			_mtx._waiters[_key].push_back(h);
+		}
+
+		guard await_resume() {
+			return guard{&_mtx, _key};
+		}
+
+		keyed_mutex& _mtx;
+		KEY _key;
+	};
+
+	/// co_await evaluates to a guard that holds the key.
+	lock_awaiter lock(const KEY& key) {
+		return lock_awaiter{*this, key};
+	}
+private:
+	/// Hands the key to the next waiter (or frees it).
+	void unlock(const KEY& key) {
+		auto it = _waiters.find(key);
+		if (it == _waiters.end())
+			return;
+		if (it->second.empty()) {
+			_waiters.erase(it);
+			return;
+		}
+		auto next = it->second.front();
+		it->second.pop_front();
+		executor::current().schedule(next);
+	}
+
+	/// Held keys, mapped to the coroutines waiting for them.
+	std::unordered_map<KEY, std::deque<std::coroutine_handle<>>> _waiters;
+};
+
+/// Lets any number of coroutines (of a single executor) wait for
+/// something to happen, and wakes them all at once when it does.
+/// Waiting costs no more than the waiter's own frame: no timer, no fd.
+struct notifier {
+	struct wait_awaiter {
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h) {
+			_ntf._waiters.push_back(h);
+		}
+
+		void await_resume() const noexcept {}
+
+		notifier& _ntf;
+	};
+
+	/// Suspends the coroutine until the next notify_all().
+	wait_awaiter wait() {
+		return wait_awaiter{*this};
+	}
+
+	/// Resumes (on the next iteration of the loop) every coroutine that
+	/// is waiting. The ones that wait again wait for the next call.
+	void notify_all() {
+		std::vector<std::coroutine_handle<>> waiting;
+		waiting.swap(_waiters);
+		for (auto h : waiting)
+			executor::current().schedule(h);
+	}
+private:
+	std::vector<std::coroutine_handle<>> _waiters;
+};
+
+/// Overloads is_skippable as to implement the semantics of reading
+/// from a tcp request that was already received into memory.
+struct tcp_buffer_source : public string_source {
+	tcp_buffer_source(const std::string_view& source);
+	tcp_buffer_source(std::string_view&& source);
+
+	/// Returns true if c is the DEFAULT_SEP; false otherwise.
+	bool is_skippable(char c) const;
+};
+
+/// Non-blocking tcp connection whose operations suspend the calling
+/// coroutine (on the executor it was created with) instead of blocking.
+struct async_tcp_connection : protected tcp_connection {
+	/// Takes over 'conn' and sets it to non-blocking mode.
+	async_tcp_connection(executor& ex, tcp_connection&& conn);
+
+	/// Returns true if the socket is ready to use; false otherwise.
+	bool valid() const;
+
+	/// Receives the next request (up to and including its DEFAULT_EOM)
+	/// into 'msg'. Bytes that follow it are kept for the next call, so
+	/// requests may be pipelined.
+	/// Gives up after MAX_TCP_REQUEST_SIZE bytes without an EOM
+	/// (returning what it has).
+	/// co_await evaluates to false if the peer closed the connection or
+	/// nothing arrived in 'timeout' milliseconds.
+	task<bool> receive(std::string& msg, int timeout);
+
+	/// See tcp_connection::answer.
+	/// Throws conn_error if the peer stops reading for DEFAULT_TIMEOUT seconds.
+	task<void> answer(const out_stream& msg);
+
+	/// See tcp_connection::answer.
+	task<void> answer(const out_stream& header, const std::string_view& body);
+
+	/// See tcp_connection::answer_file.
+	task<void> answer_file(const out_stream& header, int fd, size_t len);
+
+	/// Marks the connection as persistent (it may carry more requests).
+	void set_keep_alive(bool keep_alive);
+
+	/// Returns true if the connection is persistent; false otherwise.
+	bool keep_alive() const;
+
+	/// Returns the file descriptor of the socket.
+	int get_fildes() const;
+private:
+	/// Sends everything in 'msg', waiting for the socket when it is full.
+	task<void> send_all(msghdr& msg, int flags = 0);
+
+	executor& _ex;
+	std::string _pending; // received but not yet returned by receive()
+	bool _keep_alive{false};
+};
+
+/// Passive udp socket served by an executor: datagrams arrive through
+/// the multishot recvmsg (and answers leave through io_uring) in
+/// io_uring mode, or through readiness and recvfrom/sendto otherwise.
+struct async_udp_connection {
+	/// 'conn' must be non-blocking and outlive this object.
+	async_udp_connection(executor& ex, udp_connection& conn);
+
+	/// Receives the next datagram into 'msg' (see
+	/// udp_connection::try_listen for 'received').
+	/// Throws conn_error if receiving fails.
+	task<void> listen(std::string& msg, other_address& other, timespec* received = nullptr);
+
+	/// Sends 'msg' to 'other'.
+	/// Throws conn_error if sending fails (sends through io_uring
+	/// never do, a failure looks like any other lost datagram).
+	void answer(const out_stream& msg, const other_address& other) const;
+private:
+	executor& _ex;
+	udp_connection& _conn;
+	int _fd;
+};
+
+/// Passive tcp socket served by an executor: clients arrive through the
+/// multishot accept in io_uring mode, or through readiness otherwise.
+struct async_tcp_server {
+	/// 'server' must be non-blocking and outlive this object.
+	async_tcp_server(executor& ex, tcp_server& server);
+
+	/// Accepts the next client.
+	/// Throws socket_error if accepting fails.
+	task<tcp_connection> accept_client(other_address& other);
+private:
+	executor& _ex;
+	tcp_server& _server;
+};
+
+/// Maps keywords to coroutines (asynchronous actions).
+/// Coroutine equivalent of net::action_map.
+template<typename SOURCE, typename... ARGS>
+struct async_action_map {
+	using arg_stream = stream<SOURCE>;
+	using action = std::function<task<void>(arg_stream&, ARGS...)>;
+
+	/// Adds an action that's triggered by the keyword 'name'.
+	void add_action(const std::string_view& name, const action& action) {
+		_actions.insert({std::move(static_cast<std::string>(name)), action});
+	}
+
+	/// Adds an action triggered by each of the listed 'names'.
+	void add_action(std::initializer_list<const std::string_view> names, const action& action) {
+		for (auto name : names)
+			add_action(name, action);
+	}
+
+	/// Returns the action associated to the first keyword read
+	/// in the given stream (ready to be co_await'ed).
+	/// Throws syntax_error if there is none.
+	task<void> execute(arg_stream& strm, ARGS&&... args) const {
+		const action* act = find(strm);
+		if (!act)
+			throw syntax_error{"Unknown action"};
+		return (*act)(strm, std::forward<ARGS>(args)...);
+	}
+
+	/// Returns the action associated to the first keyword read in the
+	/// given stream; nullptr if there is none (or no keyword at all).
+	const action* find(arg_stream& strm) const {
+		expected<field> comm = strm.try_read(1, SIZE_MAX);
+		if (!comm)
+			return nullptr;
+		auto it = _actions.find(*comm);
+		if (it == _actions.end())
+			return nullptr;
+		return &it->second;
+	}
+private:
+	std::unordered_map<std::string, action> _actions;
+};
+};
+
+#endif
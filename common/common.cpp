@@ -1,4 +1,10 @@
 #include "common.hpp"
+#include "protocol.hpp"
+
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <algorithm>
+#include <chrono>
 
 using namespace net;
 
@@ -73,16 +79,27 @@ bool self_address::is_passive() const {
 	return _passive;
 }
 
-udp_connection::udp_connection(self_address&& self, size_t timeout) : _self{std::move(self)} {
+udp_connection::udp_connection(self_address&& self, size_t timeout, bool reuse_port) : _self{std::move(self)} {
 	if (!_self.valid() || _self.socket_type() != SOCK_DGRAM)
 		return;
 	if ((_fd = socket(_self.family(), _self.socket_type(), 0)) == -1)
 		return;
 	if (_self.is_passive()) { // bind if passive
-		if (bind(_fd, _self.unwrap()->ai_addr, _self.unwrap()->ai_addrlen) == -1) {
+		int reuse = 1;
+		if ((reuse_port && setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+			|| bind(_fd, _self.unwrap()->ai_addr, _self.unwrap()->ai_addrlen) == -1) {
 			close(_fd);
 			_fd = -1;
+			return;
 		}
+		int on = 1; // timestamps are optional => ignore failures
+		setsockopt(_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+		return;
+	}
+	// connect so that the kernel drops datagrams from any other peer
+	if (connect(_fd, _self.unwrap()->ai_addr, _self.unwrap()->ai_addrlen) == -1) {
+		close(_fd);
+		_fd = -1;
 		return;
 	}
 	if (timeout == 0)
@@ -99,7 +116,8 @@ udp_connection::udp_connection(self_address&& self, size_t timeout) : _self{std:
 }
 
 udp_connection::udp_connection(udp_connection&& other)
-	: _self{std::move(other._self)}, _fd{other._fd} {
+	: _self{std::move(other._self)}, _fd{other._fd},
+	_srtt{other._srtt}, _rttvar{other._rttvar}, _rto{other._rto} {
 	std::copy(other._buf, other._buf + UDP_MSG_SIZE, _buf);
 	other._fd = -1;
 }
@@ -111,6 +129,9 @@ udp_connection& udp_connection::operator=(udp_connection&& other) {
 		close(_fd);
 	_self = std::move(other._self);
 	_fd = other._fd;
+	_srtt = other._srtt;
+	_rttvar = other._rttvar;
+	_rto = other._rto;
 	std::copy(other._buf, other._buf + UDP_MSG_SIZE, _buf);
 	other._fd = -1;
 	return *this;
@@ -125,23 +146,69 @@ bool udp_connection::valid() const {
 	return _fd != -1;
 }
 
-stream<udp_source> udp_connection::request(const out_stream& msg, other_address& other) {
+stream<udp_source> udp_connection::request(const out_stream& msg, other_address& other,
+		bool (*answers)(std::string_view request, std::string_view reply)) {
+	using clock = std::chrono::steady_clock;
 	auto to_send = msg.view();
-	other.addrlen = sizeof(other.addr);
-	for (int retries = 0; retries < MAX_RESEND; retries++) {
-		int n = sendto(_fd, to_send.data(), to_send.size(), 0, _self.unwrap()->ai_addr, _self.unwrap()->ai_addrlen);
-		if (n == -1)
+	drain();
+	auto deadline = clock::now() + std::chrono::seconds(MAX_RESEND * DEFAULT_TIMEOUT);
+	bool resent = false;
+	while (true) {
+		auto sent_at = clock::now();
+		if (send(_fd, to_send.data(), to_send.size(), 0) == -1)
 			throw conn_error{"Failed to send udp data"};
-		n = recvfrom(_fd, _buf, UDP_MSG_SIZE, 0, (struct sockaddr*) &other.addr, &other.addrlen);
-		if (n >= 0)
-			return {std::string_view{_buf, static_cast<size_t>(n)}};
-		n = -1;
-		if (errno != EWOULDBLOCK && errno != EAGAIN)
-			throw conn_error{"Failed to receive udp data"};
+		auto resend_at = std::min(sent_at + std::chrono::microseconds(_rto), deadline);
+		while (true) {
+			auto now = clock::now();
+			if (now >= resend_at)
+				break;
+			auto left = std::chrono::ceil<std::chrono::milliseconds>(resend_at - now);
+			pollfd pfd{_fd, POLLIN, 0};
+			int n = poll(&pfd, 1, static_cast<int>(left.count()));
+			if (n == -1 && errno != EINTR)
+				throw conn_error{"Failed to wait for udp data"};
+			if (n <= 0)
+				continue;
+			other.addrlen = sizeof(other.addr);
+			n = recvfrom(_fd, _buf, UDP_MSG_SIZE, MSG_DONTWAIT, (struct sockaddr*) &other.addr, &other.addrlen);
+			if (n >= 0 && answers && !answers(to_send, {_buf, static_cast<size_t>(n)}))
+				continue; // (a late answer to a previous request)
+			if (n >= 0) {
+				if (!resent) // Karn's algorithm: ambiguous samples are not used
+					add_rtt_sample(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - sent_at).count());
+				return {std::string_view{_buf, static_cast<size_t>(n)}};
+			}
+			if (errno != EWOULDBLOCK && errno != EAGAIN && errno != ECONNREFUSED)
+				throw conn_error{"Failed to receive udp data"};
+		}
+		if (clock::now() >= deadline)
+			break;
+		_rto = std::min(_rto * 2, static_cast<long>(UDP_MAX_RTO) * 1000); // back off
+		resent = true;
 	}
 	throw socket_error{"UDP Connection timed out"};
 }
 
+void udp_connection::drain() {
+	while (recv(_fd, _buf, UDP_MSG_SIZE, MSG_DONTWAIT) >= 0 || errno == ECONNREFUSED)
+		continue;
+}
+
+void udp_connection::add_rtt_sample(long rtt) {
+	if (_srtt < 0) {
+		_srtt = rtt;
+		_rttvar = rtt / 2;
+	} else {
+		_rttvar = (3 * _rttvar + std::abs(_srtt - rtt)) / 4;
+		_srtt = (7 * _srtt + rtt) / 8;
+	}
+	_rto = std::clamp(
+		_srtt + 4 * _rttvar,
+		static_cast<long>(UDP_MIN_RTO) * 1000,
+		static_cast<long>(UDP_MAX_RTO) * 1000
+	);
+}
+
 void udp_connection::answer(const out_stream& msg, const other_address& other) const {
 	auto to_send = msg.view();
 	int n = sendto(_fd, to_send.data(), to_send.size(), 0, (struct sockaddr*) &other.addr, other.addrlen);
@@ -157,6 +224,43 @@ stream<udp_source> udp_connection::listen(other_address& other) {
 	return {std::string_view{_buf, static_cast<size_t>(n)}};
 }
 
+bool udp_connection::try_listen(std::string& msg, other_address& other, timespec* received) {
+	alignas(cmsghdr) char control[UDP_CONTROL_SIZE];
+	iovec iov{_buf, UDP_MSG_SIZE};
+	msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_name = &other.addr;
+	hdr.msg_namelen = sizeof(other.addr);
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	if (received) {
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+	}
+	int n = recvmsg(_fd, &hdr, MSG_DONTWAIT);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return false;
+		throw conn_error{"Failed to receive udp data"};
+	}
+	other.addrlen = hdr.msg_namelen;
+	msg.assign(_buf, n);
+	if (received)
+		*received = receive_time(hdr);
+	return true;
+}
+
+timespec net::receive_time(const msghdr& hdr) {
+	for (cmsghdr* c = CMSG_FIRSTHDR(&hdr); c; c = CMSG_NXTHDR(const_cast<msghdr*>(&hdr), c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+		timespec t;
+		memcpy(&t, CMSG_DATA(c), sizeof(t));
+		return t;
+	}
+	return {0, 0};
+}
+
 int udp_connection::get_fildes() {
 	return _fd;
 }
@@ -238,19 +342,99 @@ stream<tcp_source> tcp_connection::to_stream() const {
 }
 
 void tcp_connection::answer(const out_stream& out) const {
-	size_t done = 0;
 	auto view = out.view();
-	while (done < view.size()) {
-		int n = write(_fd, view.data() + done, view.size() - done);
+	iovec iov{const_cast<char*>(view.data()), view.size()};
+	send_all(&iov, 1);
+}
+
+bool tcp_connection::reusable() const {
+	if (_fd == -1)
+		return false;
+	pollfd pfd{_fd, POLLIN | POLLRDHUP, 0};
+	int n = poll(&pfd, 1, 0);
+	return n == 0; // nothing to read and the peer did not hang up
+}
+
+bool tcp_connection::wait_readable(int timeout) const {
+	pollfd pfd{_fd, POLLIN, 0};
+	int n = poll(&pfd, 1, timeout);
+	if (n == -1)
+		throw socket_error{"Failed to wait for tcp data"};
+	return n != 0;
+}
+
+void tcp_connection::answer(const out_stream& header, const std::string_view& body) const {
+	static char eom = DEFAULT_EOM;
+	auto view = header.view();
+	iovec iov[3] = {
+		{const_cast<char*>(view.data()), view.size()},
+		{const_cast<char*>(body.data()), body.size()},
+		{&eom, 1}
+	};
+	send_all(iov, 3);
+}
+
+void tcp_connection::answer_file(const out_stream& header, int fd, size_t len) const {
+	static char eom = DEFAULT_EOM;
+	auto view = header.view();
+	iovec iov{const_cast<char*>(view.data()), view.size()};
+	send_all(&iov, 1, MSG_MORE); // let the kernel coalesce it with the file
+	off_t off = 0;
+	if (!send_file_some(fd, off, len))
+		throw conn_error{"Timed out sending file through tcp"};
+	iov = {&eom, 1};
+	send_all(&iov, 1);
+}
+
+void tcp_connection::send_all(iovec* iov, size_t iovcnt, int flags) const {
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	if (!send_some(msg, flags))
+		throw conn_error{"Timed out sending tcp data"};
+}
+
+bool tcp_connection::send_some(msghdr& msg, int flags) const {
+	while (msg.msg_iovlen != 0) {
+		ssize_t n = sendmsg(_fd, &msg, flags | MSG_NOSIGNAL);
 		if (n == 0)
 			throw socket_closed_error{"Socket was closed midway"};
 		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
 			if (errno == EPIPE)
 				throw socket_closed_error{"Socket was closed midway"};
 			throw conn_error{"Failed to send tcp data"};
 		}
-		done += n;
+		size_t done = n;
+		while (msg.msg_iovlen != 0 && done >= msg.msg_iov->iov_len) { // skip sent buffers
+			done -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen != 0) { // partially sent buffer
+			msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + done;
+			msg.msg_iov->iov_len -= done;
+		}
 	}
+	return true;
+}
+
+bool tcp_connection::send_file_some(int fd, off_t& off, size_t len) const {
+	while (static_cast<size_t>(off) < len) {
+		ssize_t n = sendfile(_fd, fd, &off, len - off);
+		if (n == 0)
+			throw io_error{"File ended before the expected size"};
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			if (errno == EPIPE)
+				throw socket_closed_error{"Socket was closed midway"};
+			throw conn_error{"Failed to send file through tcp"};
+		}
+	}
+	return true;
 }
 
 tcp_server::tcp_server(const self_address& self, size_t sub_conns) : tcp_connection{self, 0} {
@@ -258,7 +442,9 @@ tcp_server::tcp_server(const self_address& self, size_t sub_conns) : tcp_connect
 		_fd = -1;
 		return;
 	}
-	if (bind(_fd, self.unwrap()->ai_addr, self.unwrap()->ai_addrlen) == -1
+	int reuse = 1; // do not wait for the connections of a previous server to time out
+	if (setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1
+		|| bind(_fd, self.unwrap()->ai_addr, self.unwrap()->ai_addrlen) == -1
 		|| listen(_fd, sub_conns) == -1) {
 		close(_fd);
 		_fd = -1;
@@ -277,6 +463,20 @@ tcp_connection tcp_server::accept_client(other_address& other) {
 	return new_conn;
 }
 
+tcp_connection tcp_server::try_accept_client(other_address& other) {
+	other.addrlen = sizeof(other.addr);
+	int new_fd = accept4(_fd, (sockaddr*) &other.addr, &other.addrlen, SOCK_NONBLOCK);
+	if (new_fd == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+			return {};
+		throw socket_error{"Failed to accept a new client"};
+	}
+	tcp_connection new_conn{new_fd};
+	if (!new_conn.valid())
+		throw socket_error{"Failed to create a new socket"};
+	return new_conn;
+}
+
 bool tcp_server::valid() const {
 	return tcp_connection::valid();
 }
@@ -304,15 +504,12 @@ bool file_source::is_skippable(char c) const {
 	return std::isspace(c) && c != DEFAULT_EOM;
 }
 
-void file_source::read_len(std::string& buf, size_t len, size_t& n, bool check_eom) {
+bool file_source::read_len(std::string& buf, size_t len, size_t& n, bool check_eom) {
 	n = 0;
 	if (len == 0)
-		return;
-	if (_finished) {
-		if (_found_eom)
-			return;
-		throw missing_eom{};
-	}
+		return true;
+	if (_finished)
+		return _found_eom;
 	char temp[len];
 	while (len != 0) {
 		int res = read(_fd, temp, len);
@@ -320,7 +517,7 @@ void file_source::read_len(std::string& buf, size_t len, size_t& n, bool check_e
 			throw net::io_error{"Failed to read from source"};
 		if (res == 0) { // EOF
 			_finished = true;
-			throw missing_eom{};
+			return false;
 		}
 		len -= res;
 		if (check_eom && temp[res - 1] == DEFAULT_EOM) {
@@ -332,6 +529,7 @@ void file_source::read_len(std::string& buf, size_t len, size_t& n, bool check_e
 		buf.append(temp, temp + res);
 		n += res;
 	}
+	return true;
 }
 
 tcp_source::tcp_source(int fd) : net::file_source{fd} {}
@@ -344,21 +542,18 @@ string_source::string_source(const std::string_view& source) : _source(source) {
 
 string_source::string_source(std::string_view&& source) : _source(std::move(source)) {}
 
-void string_source::read_len(std::string& buf, size_t len, size_t& n, bool check_eom) {
+bool string_source::read_len(std::string& buf, size_t len, size_t& n, bool check_eom) {
 	n = 0;
 	if (len == 0)
-		return;
-	if (_finished) {
-		if (_found_eom)
-			return;
-		throw missing_eom{};
-	}
+		return true;
+	if (_finished)
+		return _found_eom;
 	size_t end = _at + len;
 	if (end > _source.size()) {
 		end = _source.size();
 		_finished = true;
 		if (_source.back() != DEFAULT_EOM)
-			throw missing_eom{};
+			return false;
 	}
 	buf.append(std::begin(_source) + _at, std::begin(_source) + end);
 	n = end - _at;
@@ -369,12 +564,17 @@ void string_source::read_len(std::string& buf, size_t len, size_t& n, bool check
 		_found_eom = true;
 		_finished = true;
 	}
+	return true;
 }
 
 bool string_source::is_skippable(char c) const {
 	return std::isspace(c) && c != DEFAULT_EOM;
 }
 
+std::string_view string_source::view() const {
+	return _source;
+}
+
 udp_source::udp_source(const std::string_view& source) : string_source(source) {}
 udp_source::udp_source(std::string_view&& source) : string_source(std::move(source)) {}
 
@@ -382,7 +582,7 @@ bool udp_source::is_skippable(char c) const {
 	return c == DEFAULT_SEP;
 }
 
-out_stream& out_stream::write(const field& f) {
+out_stream& out_stream::write(std::string_view f) {
 	_buf.append(std::begin(f), std::end(f));
 	_buf.push_back(DEFAULT_SEP);
 	return *this;
@@ -394,7 +594,7 @@ out_stream& out_stream::write(char c) {
 	return *this;
 }
 
-out_stream& out_stream::write_and_fill(const field& f, size_t n, char fill) {
+out_stream& out_stream::write_and_fill(std::string_view f, size_t n, char fill) {
 	if (n > f.size())
 		_buf.insert(_buf.size(), n - f.size(), fill);
 	_buf.append(std::begin(f), std::end(f));
@@ -402,6 +602,11 @@ out_stream& out_stream::write_and_fill(const field& f, size_t n, char fill) {
 	return *this;
 }
 
+out_stream& out_stream::append(std::string_view bytes) {
+	_buf.append(std::begin(bytes), std::end(bytes));
+	return *this;
+}
+
 out_stream& out_stream::prime() {
 	if (!_buf.empty())
 		_buf.back() = DEFAULT_EOM;
@@ -415,49 +620,19 @@ const std::string_view out_stream::view() const {
 }
 
 bool net::is_valid_plid(const field& field) {
-	if (field.length() != PLID_SIZE) // PLID has 6 digits
-		return false;
-	for (char c : field)
-		if (c < '0' || c > '9')
-			return false;
-	return true;
+	return plid_field::valid(field);
 }
 
 bool net::is_valid_max_playtime(const field& field) {
-	if (field.length() > 3) // avoid out_of_range exception
-		return false;
-	for (auto c : field)
-		if (c < '0' || c > '9')
-			return false;
-	int max_playtime = -1;
-	try {
-		max_playtime = std::stoi(std::string(field));
-	} catch (const std::invalid_argument& err) { // cannot be read
-		return false;
-	} // out_of_range exception shouldn't be an issue
-	if (max_playtime < 0 || max_playtime > MAX_PLAYTIME)
-		return false;
-	return true;
+	return playtime_field::valid(field);
 }
 
 bool net::is_valid_color(const field& field) {
-	if (field.length() != 1)
-		return false;
-	for (auto col : VALID_COLORS)
-		if (field[0] == col)
-			return true;
-	return false;
+	return color_field::valid(field);
 }
 
 bool net::is_valid_fname(const field& field) {
-	if (field.length() >= MAX_FNAME_SIZE || field.length() < 4)
-		return false; // .txt
-	if (field.substr(field.length() - 4) != ".txt")
-		return false;
-	for (auto c : field)
-		if (!std::isalnum(c) && c != '.' && c != '-' && c != '_')
-			return false;
-	return true;
+	return fname_field::valid(field);
 }
 
 bool net::is_valid_fsize(size_t fsize) {
@@ -8,11 +8,15 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/uio.h>
 
 #include <unordered_map>
+#include <charconv>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <type_traits>
 #include <initializer_list>
 #include "except.hpp"
 
@@ -22,14 +26,20 @@
 #define MAX_PLAYTIME 600
 #define MAX_PLAYTIME_SIZE 3
 #define UDP_MSG_SIZE 128
-#define MAX_RESEND 3
+#define UDP_CONTROL_SIZE CMSG_SPACE(sizeof(timespec)) // room for a receive timestamp
+#define MAX_RESEND 3 // a udp request gives up after MAX_RESEND * DEFAULT_TIMEOUT seconds
 #define MAX_TRIALS '8'
 #define GUESS_SIZE 4
 #define DEFAULT_TIMEOUT 5
-#define DEFAULT_LISTEN_CONNS 5
+#define UDP_INITIAL_RTO 1000 // in ms, used until the first rtt sample
+#define UDP_MIN_RTO 10 // in ms
+#define UDP_MAX_RTO (DEFAULT_TIMEOUT * 1000) // in ms
+#define DEFAULT_LISTEN_CONNS 1024 // connections waiting to be accepted (subscribers come in bursts)
+#define DEFAULT_IDLE_TIMEOUT 30
 #define MAX_FSIZE 1024
 #define MAX_FSIZE_LEN 4
 #define MAX_FNAME_SIZE 24
+#define MAX_NUMBER_SIZE 20 // digits of the largest 64 bit number
 
 namespace net {
 static const std::string VALID_COLORS = "RGBYOP";
@@ -120,8 +130,10 @@ struct file_source : public source {
 	/// If check_eom is true, then everytime the underlying read call
 	/// returns it checks if it ends on EOM, returning early if it does.
 	///
-	/// Throws missing_eom if the EOF is reached before the EOM.
-	void read_len(std::string& buf, size_t len, size_t& n, bool check_eom);
+	/// Returns false if the EOF is reached before the EOM (a malformed
+	/// message, which is not worth an exception); true otherwise.
+	/// Throws io_error if reading fails.
+	bool read_len(std::string& buf, size_t len, size_t& n, bool check_eom);
 private:
 	int _fd;
 };
@@ -149,12 +161,15 @@ struct string_source : public source {
 	/// end of the underlying string (in the case the len overshoots
 	/// the size).
 	/// 
-	/// Throws missing_eom if the end of the string is reached before
-	/// the EOM is found.
-	void read_len(std::string& buf, size_t len, size_t& n, bool check_eom);
+	/// Returns false if the end of the string is reached before the EOM
+	/// is found; true otherwise.
+	bool read_len(std::string& buf, size_t len, size_t& n, bool check_eom);
 
 	/// Returns true if c is whitespace; false otherwise.
 	bool is_skippable(char c) const;
+
+	/// Returns the whole underlying string (read or not).
+	std::string_view view() const;
 private:
 	std::string_view _source;
 	size_t _at = 0;
@@ -193,9 +208,20 @@ struct stream {
 	/// of size 1 or 2 and then a field of length 1 into the returned
 	/// message.
 	message read(std::initializer_list<std::pair<size_t, size_t>> lens, bool check_eom = true) {
+		return try_read(lens, check_eom).value();
+	}
+
+	/// Same as read(lens, check_eom), but returns the failure of the
+	/// first field that could not be read instead of throwing it.
+	expected<message> try_read(std::initializer_list<std::pair<size_t, size_t>> lens, bool check_eom = true) {
 		message msg;
-		for (auto len : lens)
-			msg.push_back(read(len.first, len.second, check_eom));
+		msg.reserve(lens.size());
+		for (auto len : lens) {
+			expected<field> f = try_read(len.first, len.second, check_eom);
+			if (!f)
+				return f.error();
+			msg.push_back(std::move(*f));
+		}
 		return msg;
 	}
 
@@ -216,31 +242,42 @@ struct stream {
 	/// 2. missing_eom if the source finished but the eom was not found.
 	/// 3. io_error/socket_error depending on the underlying source.
 	field read(size_t min_len, size_t max_len, bool check_eom = true) {
+		return std::move(try_read(min_len, max_len, check_eom).value());
+	}
+
+	/// Same as read(min_len, max_len, check_eom), but returns a syntax
+	/// (or missing EOM) failure instead of throwing (the I/O errors of
+	/// the source are still thrown).
+	expected<field> try_read(size_t min_len, size_t max_len, bool check_eom = true) {
 		if (min_len > max_len || min_len == 0)
-			return "";
+			return field{};
 		if (_source.finished())
-			throw syntax_error{"Missing argument"};
+			return failure{failure::kind::SYNTAX, "Missing argument"};
 		field buf;
 		size_t bytes_read = 0;
 		size_t off = 0;
 		if (!_strict) { // if not strict, skip skippable characters
-			_source.read_len(buf, 1, bytes_read, true);
+			if (!_source.read_len(buf, 1, bytes_read, true))
+				return missing_eom_failure();
 			if (bytes_read == 0) // if ended early => fail
-				throw syntax_error{"Missing argument"};
+				return failure{failure::kind::SYNTAX, "Missing argument"};
 			while (_source.is_skippable(buf[0])) {
 				buf.clear();
-				_source.read_len(buf, 1, bytes_read, true);
+				if (!_source.read_len(buf, 1, bytes_read, true))
+					return missing_eom_failure();
 				if (bytes_read == 0)
-					throw syntax_error{"Missing argument"};
+					return failure{failure::kind::SYNTAX, "Missing argument"};
 			}
 			off = 1; // if this is reached then at least one
 			// non-skippable char has been read => only min_len - 1 to go
 		}
-		_source.read_len(buf, min_len - off, bytes_read, check_eom);
+		if (!_source.read_len(buf, min_len - off, bytes_read, check_eom))
+			return missing_eom_failure();
 		if (bytes_read < min_len - off) // did not even read minimum amount
-			throw syntax_error{"Illegal argument"};
+			return failure{failure::kind::SYNTAX, "Illegal argument"};
 		for (size_t i = min_len; i < max_len; i++) { // read until max_len or
-			_source.read_len(buf, 1, bytes_read, true); // a skippable char is found
+			if (!_source.read_len(buf, 1, bytes_read, true)) // a skippable char is found
+				return missing_eom_failure();
 			if (bytes_read == 0)
 				return buf;
 			if (_source.is_skippable(buf[i])) {
@@ -250,11 +287,12 @@ struct stream {
 		}
 
 		// checks if a field is separated like "abc def" (it eats the ' ')
-		_source.read_len(buf, 1, bytes_read, true);
+		if (!_source.read_len(buf, 1, bytes_read, true))
+			return missing_eom_failure();
 		if (bytes_read == 0) // did not read anything
 			return buf;
 		if (!_source.is_skippable(buf[max_len])) // did not read a separator
-			throw syntax_error{"Illegal argument"};
+			return failure{failure::kind::SYNTAX, "Illegal argument"};
 		buf.pop_back(); // ignore the separator
 		return buf;
 	}
@@ -270,7 +308,8 @@ struct stream {
 		field buf;
 		while (true) {
 			size_t bytes_read = 0;
-			_source.read_len(buf, 1, bytes_read, true);
+			if (!_source.read_len(buf, 1, bytes_read, true))
+				throw missing_eom{};
 			if (bytes_read == 0)
 				return true;
 			if (_source.is_skippable(buf[0])) {
@@ -288,7 +327,8 @@ struct stream {
 		while (!_source.finished()) {
 			field buf;
 			size_t bytes_read = 0;
-			_source.read_len(buf, 1, bytes_read, true);
+			if (!_source.read_len(buf, 1, bytes_read, true))
+				break; // (finished without the EOM)
 		}
 		if (!_source.found_eom())
 			throw missing_eom{};
@@ -320,20 +360,98 @@ struct stream {
 		}
 		throw formatting_error{"End wasn't 'strict'"};
 	}
+
+	/// Returns true if check_strict_end() would return; false if it
+	/// would throw.
+	bool at_strict_end() const {
+		return _source.finished() && _source.found_eom();
+	}
+
+	/// Returns the whole message (read or not) the source holds, to be
+	/// parsed at once (see protocol.hpp). Only for string sources.
+	std::string_view text() const {
+		return _source.view();
+	}
 private:
+	static failure missing_eom_failure() {
+		return {failure::kind::MISSING_EOM, "Missing EOM"};
+	}
+
 	SOURCE _source;
 	bool _strict;
 };
 
+/// Text put together in a fixed size buffer of N characters, without
+/// allocating (numbers are formatted with std::to_chars).
+/// Putting more than N characters throws std::length_error.
+template<size_t N>
+struct format_buffer {
+	/// Puts 'text' at the end.
+	format_buffer& put(std::string_view text) {
+		if (text.size() > N - _size)
+			throw std::length_error{"Formatted text does not fit"};
+		std::memcpy(_buf + _size, text.data(), text.size());
+		_size += text.size();
+		return *this;
+	}
+
+	/// Puts 'c' at the end.
+	format_buffer& put(char c) {
+		return put(std::string_view{&c, 1});
+	}
+
+	/// Puts 'number' at the end, in decimal (unsigned chars are numbers
+	/// too, chars are not).
+	template<typename INT>
+	requires std::is_integral_v<INT> && (!std::is_same_v<INT, char>)
+	format_buffer& put(INT number) {
+		auto [end, err] = std::to_chars(_buf + _size, _buf + N, number);
+		if (err != std::errc{})
+			throw std::length_error{"Formatted text does not fit"};
+		_size = end - _buf;
+		return *this;
+	}
+
+	/// Returns what was put so far.
+	std::string_view view() const {
+		return {_buf, _size};
+	}
+
+	/// Returns what was put so far, as a string (which allocates if it's
+	/// too long to fit in the string itself).
+	std::string str() const {
+		return std::string{_buf, _size};
+	}
+
+	/// Forgets what was put so far.
+	void clear() {
+		_size = 0;
+	}
+private:
+	char _buf[N];
+	size_t _size{0};
+};
+
+/// Formats 'number' in decimal, without allocating.
+template<typename INT>
+format_buffer<MAX_NUMBER_SIZE> decimal(INT number) {
+	format_buffer<MAX_NUMBER_SIZE> res;
+	res.put(number);
+	return res;
+}
+
 /// Buffers the writes into an underlying buffer.
 /// Automatically separates each write with a DEFAULT_SEP.
 struct out_stream {
-	out_stream& write(const field& f);
+	out_stream& write(std::string_view f);
 	out_stream& write(char c);
 
 	/// If the length of f is smaller than n, fills it with the 'fill'
 	/// on the left until a length of n is reached.
-	out_stream& write_and_fill(const field& f, size_t n, char fill);
+	out_stream& write_and_fill(std::string_view f, size_t n, char fill);
+
+	/// Appends 'bytes' as they are, without a separator (e.g. a binary frame).
+	out_stream& append(std::string_view bytes);
 
 	/// Prepares the message to be sent (adds a DEFAULT_EOM at the end).
 	out_stream& prime();
@@ -344,9 +462,16 @@ private:
 	std::string _buf;
 };
 
+/// Returns when the datagram received with the control messages of 'hdr'
+/// got to the kernel (see SO_TIMESTAMPNS), or zero if it's not there.
+timespec receive_time(const msghdr& hdr);
+
 /// Encapsulates a udp socket.
+/// Passive sockets have the kernel timestamp every datagram they receive.
 struct udp_connection {
-	udp_connection(self_address&& self, size_t timeout = DEFAULT_TIMEOUT);
+	/// If 'reuse_port' is true, a passive socket joins the SO_REUSEPORT
+	/// group of the other sockets bound to the same port.
+	udp_connection(self_address&& self, size_t timeout = DEFAULT_TIMEOUT, bool reuse_port = false);
 
 	udp_connection(const udp_connection& other) = delete;
 
@@ -364,9 +489,16 @@ struct udp_connection {
 	/// Sends 'msg' through UDP and waits for a response.
 	/// On return, other is set to the address of the peer that answered.
 	/// Returns a udp stream with the received message.
-	/// Implements timeout.
+	/// The message is retransmitted whenever the retransmission timeout
+	/// (estimated from the measured round trip times, as in TCP) expires,
+	/// doubling it each time. Gives up (throws socket_error) after
+	/// MAX_RESEND * DEFAULT_TIMEOUT seconds without an answer.
+	/// Late answers to previous requests are discarded beforehand, and so
+	/// are the datagrams that 'answers' (if given) says do not answer 'msg'
+	/// (late answers that arrive while waiting).
 	/// Limited to a maximum size of UDP_MSG_SIZE byte datagrans.
-	stream<udp_source> request(const out_stream& msg, other_address& other);
+	stream<udp_source> request(const out_stream& msg, other_address& other,
+		bool (*answers)(std::string_view request, std::string_view reply) = nullptr);
 
 	/// Sends 'msg' to other.
 	void answer(const out_stream& msg, const other_address& other) const;
@@ -374,12 +506,29 @@ struct udp_connection {
 	/// Waits for a message (only use if the socket is passive).
 	stream<udp_source> listen(other_address& other);
 
+	/// Receives a message into 'msg' if one is already waiting
+	/// (only use if the socket is passive).
+	/// If 'received' is set, it's set to when the kernel received the
+	/// message (CLOCK_REALTIME), or to zero if that is unknown.
+	/// Returns false if there was no message; true otherwise.
+	bool try_listen(std::string& msg, other_address& other, timespec* received = nullptr);
+
 	/// Returns the underlying file descriptor.
 	/// CLosing the returned file descriptor is undefined behaviour.
 	int get_fildes();
 private:
+	/// Discards every datagram waiting in the socket.
+	void drain();
+
+	/// Updates the rtt estimation with a new sample (in microseconds)
+	/// and recomputes the retransmission timeout (RFC 6298).
+	void add_rtt_sample(long rtt);
+
 	self_address _self;
 	int _fd{-1};
+	long _srtt{-1}; // smoothed rtt (in us), -1 if there are no samples
+	long _rttvar{0}; // rtt variation (in us)
+	long _rto{UDP_INITIAL_RTO * 1000}; // retransmission timeout (in us)
 	char _buf[UDP_MSG_SIZE];
 };
 
@@ -413,7 +562,42 @@ struct tcp_connection {
 
 	/// Sends 'msg' to the tcp peer.
 	void answer(const out_stream& msg) const;
+
+	/// Returns true if the connection is still open and has no unread
+	/// data pending (i.e. it can carry a new request); false otherwise.
+	bool reusable() const;
+
+	/// Waits up to 'timeout' milliseconds for something to read (or for
+	/// the peer to hang up).
+	/// Returns true if there is; false if the timeout expired first.
+	/// Throws socket_error if waiting fails.
+	bool wait_readable(int timeout) const;
+
+	/// Sends 'header' (an unprimed out_stream) followed by 'body' and
+	/// a DEFAULT_EOM in a single gathered write, without copying
+	/// 'body' into the header's buffer.
+	void answer(const out_stream& header, const std::string_view& body) const;
+
+	/// Sends 'header' (an unprimed out_stream) followed by the first
+	/// 'len' bytes of the file 'fd' and a DEFAULT_EOM. The file contents
+	/// are copied by the kernel (sendfile), never through userspace.
+	/// Does NOT close 'fd'.
+	/// Throws io_error if the file holds less than 'len' bytes.
+	void answer_file(const out_stream& header, int fd, size_t len) const;
 protected:
+	/// Writes all the buffers in 'iov' (which is consumed in the process).
+	void send_all(iovec* iov, size_t iovcnt, int flags = 0) const;
+
+	/// Sends as much of 'msg' as the socket takes, advancing its iovecs.
+	/// Returns true once everything was sent; false if the socket is full.
+	bool send_some(msghdr& msg, int flags) const;
+
+	/// Sends as much of the file 'fd' (from 'off' up to 'len') as the
+	/// socket takes, advancing 'off'.
+	/// Returns true once everything was sent; false if the socket is full.
+	/// Throws io_error if the file holds less than 'len' bytes.
+	bool send_file_some(int fd, off_t& off, size_t len) const;
+
 	int _fd{-1};
 };
 
@@ -425,6 +609,11 @@ struct tcp_server : protected tcp_connection {
 	/// for it.
 	tcp_connection accept_client(other_address& other);
 
+	/// Accepts a new connection if a client is already waiting (the
+	/// socket must have been set to non-blocking mode).
+	/// Returns an invalid tcp_connection if there was none.
+	tcp_connection try_accept_client(other_address& other);
+
 	/// Returns true if the socket is ready to use; false otherwise.
 	bool valid() const;
 
@@ -434,6 +623,7 @@ struct tcp_server : protected tcp_connection {
 };
 
 /// Returns true if the plid is valid; false otherwise.
+/// (These check a field as declared in protocol.hpp.)
 bool is_valid_plid(const field& field);
 
 /// Returns true if the duration is valid; false otherwise.
@@ -37,3 +37,19 @@ conn_error::conn_error(const std::string& what)
 
 socket_closed_error::socket_closed_error(const std::string& what)
 	: socket_error{what} {}
+
+void net::raise(const failure& f) {
+	switch (f.type) {
+	case failure::kind::SYNTAX:
+		throw syntax_error{f.what};
+	case failure::kind::FORMATTING:
+		throw formatting_error{f.what};
+	case failure::kind::MISSING_EOM:
+		throw missing_eom{};
+	case failure::kind::GAME:
+		throw game_error{f.what};
+	default:
+		throw std::logic_error{"Raised a failure that is not one"};
+	}
+}
+
@@ -2,6 +2,7 @@
 #define _EXCEPTIONS_H_
 
 #include <stdexcept>
+#include <utility>
 
 namespace net {
 /// Represents a system call fail or similar.
@@ -65,6 +66,77 @@ struct conn_error : public socket_error {
 struct socket_closed_error : public socket_error {
 	socket_closed_error(const std::string& what);
 };
+
+/// An error that is expected on the hot paths (e.g. a malformed request, or
+/// a player without a game), returned instead of thrown: unwinding the
+/// stack costs far more than handling it.
+/// Each kind stands for the exception raise() throws for it.
+struct failure {
+	enum class kind : char {
+		NONE,
+		SYNTAX, // syntax_error
+		FORMATTING, // formatting_error
+		MISSING_EOM, // missing_eom
+		GAME // game_error
+	};
+
+	kind type{kind::NONE};
+	const char* what{""};
+};
+
+/// Throws the exception 'f' stands for (see failure::kind).
+[[noreturn]] void raise(const failure& f);
+
+/// Either a T or the failure that kept it from being one (like C++23's
+/// std::expected). Errors that are not expected (e.g. io_error) are
+/// still thrown.
+template<typename T>
+struct expected {
+	expected(const T& value) : _value(value) {}
+	expected(T&& value) : _value(std::move(value)) {}
+	expected(failure error) : _error(error) {}
+
+	/// Returns true if there is a value; false if there is a failure.
+	bool has_value() const {
+		return _error.type == failure::kind::NONE;
+	}
+
+	explicit operator bool() const {
+		return has_value();
+	}
+
+	/// Returns the value (there must be one).
+	T& operator*() {
+		return _value;
+	}
+
+	const T& operator*() const {
+		return _value;
+	}
+
+	T* operator->() {
+		return &_value;
+	}
+
+	const T* operator->() const {
+		return &_value;
+	}
+
+	/// Returns the value, or throws the failure (see raise).
+	T& value() {
+		if (!has_value())
+			raise(_error);
+		return _value;
+	}
+
+	/// Returns the failure (if there is no value).
+	const failure& error() const {
+		return _error;
+	}
+private:
+	T _value{};
+	failure _error{};
+};
 };
 
 #endif
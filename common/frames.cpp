@@ -0,0 +1,420 @@
+#include "frames.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <initializer_list>
+
+using namespace net;
+
+// Bit offsets of the fields in the payload of a binary frame (see binary_frame)
+static constexpr int COLOR_BITS = 3;
+static constexpr int REQUEST_PLID = 0;
+static constexpr int REQUEST_PLAYTIME = 20;
+static constexpr int REQUEST_CODE = 30;
+static constexpr int REQUEST_TRIAL = 42;
+static constexpr int REPLY_STATUS = 0;
+static constexpr int REPLY_TRIAL = 4;
+static constexpr int REPLY_NB = 8;
+static constexpr int REPLY_NW = 11;
+static constexpr int REPLY_KEY = 14;
+
+static constexpr const char* STATUS_NAMES[] = {"OK", "NOK", "ERR", "DUP", "INV", "ENT", "ETM"};
+static constexpr const char* OP_NAMES[] = {"unknown", "start", "try", "quit", "debug"};
+
+/// Returns the 'n' bits of 'word' starting at bit 'at'.
+static uint64_t bits_of(uint64_t word, int at, int n) {
+	return (word >> at) & ((uint64_t{1} << n) - 1);
+}
+
+/// Returns a mask of the 'n' bits starting at bit 'at'.
+static uint64_t mask_of(int at, int n) {
+	return ((uint64_t{1} << n) - 1) << at;
+}
+
+static uint64_t load_payload(const binary_frame& frame) {
+	uint64_t res = 0;
+	for (size_t i = sizeof(frame.payload); i > 0; i--)
+		res = (res << 8) | frame.payload[i - 1];
+	return res;
+}
+
+static void store_payload(binary_frame& frame, uint64_t word) {
+	for (size_t i = 0; i < sizeof(frame.payload); i++, word >>= 8)
+		frame.payload[i] = static_cast<uint8_t>(word);
+}
+
+/// Returns the colors of 'code' packed COLOR_BITS each (see binary_frame).
+static uint64_t pack_colors(const char code[GUESS_SIZE]) {
+	uint64_t res = 0;
+	for (int i = GUESS_SIZE - 1; i >= 0; i--)
+		res = (res << COLOR_BITS) | (VALID_COLORS.find(code[i]) & mask_of(0, COLOR_BITS));
+	return res;
+}
+
+/// Unpacks the colors of 'packed' into 'code'.
+/// Returns false if one of them is not a color; true otherwise.
+static bool unpack_colors(uint64_t packed, char code[GUESS_SIZE]) {
+	for (int i = 0; i < GUESS_SIZE; i++, packed >>= COLOR_BITS) {
+		uint64_t color = bits_of(packed, 0, COLOR_BITS);
+		if (color >= VALID_COLORS.size())
+			return false;
+		code[i] = VALID_COLORS[color];
+	}
+	return true;
+}
+
+static bool is_one_of(game_status status, std::initializer_list<game_status> statuses) {
+	for (game_status s : statuses)
+		if (s == status)
+			return true;
+	return false;
+}
+
+/// Returns true if a reply to 'op' may have 'status'; false otherwise.
+static bool has_status(game_op op, game_status status) {
+	switch (op) {
+	case game_op::NONE:
+		return status == game_status::ERR;
+	case game_op::START:
+	case game_op::QUIT:
+	case game_op::DEBUG:
+		return is_one_of(status, {game_status::OK, game_status::NOK, game_status::ERR});
+	case game_op::TRY:
+		return status <= game_status::ETM;
+	}
+	return false;
+}
+
+/// Reads the status named 'name', which must be one of 'allowed', into 'status'.
+/// Returns false if it is not; true otherwise.
+static bool read_status(std::string_view name, std::initializer_list<game_status> allowed, game_status& status) {
+	for (size_t i = 0; i < std::size(STATUS_NAMES); i++) {
+		if (name == STATUS_NAMES[i]) {
+			status = static_cast<game_status>(i);
+			return is_one_of(status, allowed);
+		}
+	}
+	return false;
+}
+
+/// Copies the color of each of the GUESS_SIZE 'fields' into 'code'.
+static void copy_colors(const std::string_view* fields, char code[GUESS_SIZE]) {
+	for (int i = 0; i < GUESS_SIZE; i++)
+		code[i] = fields[i][0];
+}
+
+static const char* status_name(game_status status) {
+	return STATUS_NAMES[static_cast<size_t>(status)];
+}
+
+/// Returns the number in a (valid) playtime field.
+static uint16_t to_playtime(std::string_view valid_playtime) {
+	uint16_t res = 0;
+	std::from_chars(valid_playtime.data(), valid_playtime.data() + valid_playtime.size(), res);
+	return res;
+}
+
+static std::string_view plid_view(const game_request& req) {
+	return {req.plid, PLID_SIZE};
+}
+
+/// Returns 'frame' as a message, ready to be sent.
+static out_stream to_stream(const binary_frame& frame) {
+	out_stream out;
+	out.append({reinterpret_cast<const char*>(&frame), sizeof(frame)});
+	return out;
+}
+
+bool net::is_binary(std::string_view datagram) {
+	return !datagram.empty() && static_cast<uint8_t>(datagram[0]) == BINARY_MAGIC;
+}
+
+game_op net::binary_op(std::string_view frame) {
+	if (frame.size() < 2 || !is_binary(frame))
+		return game_op::NONE;
+	uint8_t op = static_cast<uint8_t>(frame[1]);
+	if (op > static_cast<uint8_t>(game_op::DEBUG))
+		return game_op::NONE;
+	return static_cast<game_op>(op);
+}
+
+game_op net::text_op(std::string_view text) {
+	static constexpr std::pair<std::string_view, game_op> KEYWORDS[] = {
+		{"SNG", game_op::START}, {"TRY", game_op::TRY}, {"QUT", game_op::QUIT}, {"DBG", game_op::DEBUG}
+	};
+	if (text.size() < 4 || (text[3] != DEFAULT_SEP && text[3] != DEFAULT_EOM))
+		return game_op::NONE;
+	for (auto& [keyword, op] : KEYWORDS)
+		if (text.starts_with(keyword))
+			return op;
+	return game_op::NONE;
+}
+
+bool net::answers(std::string_view request, std::string_view reply) {
+	static constexpr std::pair<std::string_view, game_op> KEYWORDS[] = {
+		{"RSG", game_op::START}, {"RTR", game_op::TRY}, {"RQT", game_op::QUIT}, {"RDB", game_op::DEBUG},
+		{"ERR", game_op::NONE}
+	};
+	game_op op = is_binary(request) ? binary_op(request) : text_op(request);
+	game_op answered = game_op::NONE;
+	if (is_binary(reply))
+		answered = binary_op(reply);
+	else if (reply.size() < 4 || (reply[3] != DEFAULT_SEP && reply[3] != DEFAULT_EOM))
+		return true; // (not a reply at all => bad, but it's up to the caller)
+	else {
+		auto found = std::find_if(std::begin(KEYWORDS), std::end(KEYWORDS),
+			[&reply](const auto& keyword) { return reply.starts_with(keyword.first); });
+		if (found == std::end(KEYWORDS))
+			return true;
+		answered = found->second;
+	}
+	if (answered == game_op::NONE)
+		return true;
+	if (answered != op)
+		return false;
+	if (op != game_op::TRY)
+		return true;
+	// an accepted try says which trial it was (e.g. not the one resent before)
+	expected<game_request> req = is_binary(request) ? decode_request(request) : parse_request(op, request);
+	expected<game_reply> rep = is_binary(reply) ? decode_reply(reply) : parse_reply(op, reply);
+	return !req || !rep || rep->status != game_status::OK || rep->trial == req->trial;
+}
+
+const char* net::op_name(game_op op) {
+	return OP_NAMES[static_cast<size_t>(op)];
+}
+
+expected<game_request> net::parse_request(game_op op, std::string_view text) {
+	game_request req{op};
+	std::string_view plid;
+	switch (op) {
+	case game_op::START: {
+		auto fields = start_request::parse(text);
+		if (!fields)
+			return fields.error();
+		plid = (*fields)[0];
+		req.playtime = to_playtime((*fields)[1]);
+		break;
+	}
+	case game_op::TRY: {
+		auto fields = try_request::parse(text);
+		if (!fields)
+			return fields.error();
+		plid = (*fields)[0];
+		for (int i = 0; i < GUESS_SIZE; i++)
+			req.code[i] = (*fields)[1 + i][0];
+		req.trial = (*fields)[1 + GUESS_SIZE][0];
+		break;
+	}
+	case game_op::QUIT: {
+		auto fields = quit_request::parse(text);
+		if (!fields)
+			return fields.error();
+		plid = (*fields)[0];
+		break;
+	}
+	case game_op::DEBUG: {
+		auto fields = debug_request::parse(text);
+		if (!fields)
+			return fields.error();
+		plid = (*fields)[0];
+		req.playtime = to_playtime((*fields)[1]);
+		for (int i = 0; i < GUESS_SIZE; i++)
+			req.code[i] = (*fields)[2 + i][0];
+		break;
+	}
+	case game_op::NONE:
+		return failure{failure::kind::SYNTAX, "Unknown request"};
+	}
+	std::memcpy(req.plid, plid.data(), PLID_SIZE);
+	return req;
+}
+
+out_stream net::make_request(const game_request& req) {
+	char playtime[MAX_NUMBER_SIZE];
+	std::string_view playtime_text{playtime, static_cast<size_t>(
+		std::to_chars(playtime, playtime + sizeof(playtime), req.playtime).ptr - playtime)};
+	const char* code = req.code;
+	switch (req.op) {
+	case game_op::START:
+		return start_request::make(plid_view(req), playtime_text);
+	case game_op::TRY:
+		return try_request::make(plid_view(req), code[0], code[1], code[2], code[3], req.trial);
+	case game_op::QUIT:
+		return quit_request::make(plid_view(req));
+	case game_op::DEBUG:
+		return debug_request::make(plid_view(req), playtime_text, code[0], code[1], code[2], code[3]);
+	case game_op::NONE:
+		break;
+	}
+	return error_reply::make();
+}
+
+expected<game_reply> net::parse_reply(game_op op, std::string_view text) {
+	if (error_reply::parse(text))
+		return game_reply{game_op::NONE, game_status::ERR};
+	game_reply rep{op, game_status::ERR};
+	switch (op) {
+	case game_op::START:
+	case game_op::DEBUG: {
+		auto fields = op == game_op::START ? start_reply::parse(text) : debug_reply::parse(text);
+		if (!fields)
+			return fields.error();
+		if (!read_status((*fields)[0], {game_status::OK, game_status::NOK, game_status::ERR}, rep.status))
+			return failure{failure::kind::SYNTAX, "Unknown status"};
+		return rep;
+	}
+	case game_op::QUIT: {
+		if (auto fields = quit_reply::parse(text)) {
+			if (!read_status((*fields)[0], {game_status::NOK, game_status::ERR}, rep.status))
+				return failure{failure::kind::SYNTAX, "Unknown status"};
+			return rep;
+		}
+		auto fields = quit_key_reply::parse(text);
+		if (!fields)
+			return fields.error();
+		rep.status = game_status::OK;
+		copy_colors(fields->data(), rep.key);
+		return rep;
+	}
+	case game_op::TRY: {
+		if (auto fields = try_reply::parse(text)) {
+			if (!read_status((*fields)[0], {game_status::DUP, game_status::INV, game_status::NOK, game_status::ERR}, rep.status))
+				return failure{failure::kind::SYNTAX, "Unknown status"};
+			return rep;
+		}
+		if (auto fields = try_key_reply::parse(text)) {
+			if (!read_status((*fields)[0], {game_status::ENT, game_status::ETM}, rep.status))
+				return failure{failure::kind::SYNTAX, "Unknown status"};
+			copy_colors(fields->data() + 1, rep.key);
+			return rep;
+		}
+		auto fields = try_result_reply::parse(text);
+		if (!fields)
+			return fields.error();
+		rep.status = game_status::OK;
+		rep.trial = (*fields)[0][0];
+		rep.nB = static_cast<uint8_t>((*fields)[1][0] - '0');
+		rep.nW = static_cast<uint8_t>((*fields)[2][0] - '0');
+		return rep;
+	}
+	case game_op::NONE:
+		break;
+	}
+	return failure{failure::kind::SYNTAX, "Unknown request"};
+}
+
+out_stream net::make_reply(const game_reply& rep) {
+	const char* status = status_name(rep.status);
+	const char* key = rep.key;
+	switch (rep.op) {
+	case game_op::START:
+		return start_reply::make(status);
+	case game_op::DEBUG:
+		return debug_reply::make(status);
+	case game_op::QUIT:
+		if (rep.status == game_status::OK)
+			return quit_key_reply::make(key[0], key[1], key[2], key[3]);
+		return quit_reply::make(status);
+	case game_op::TRY:
+		if (rep.status == game_status::OK) {
+			return try_result_reply::make(rep.trial,
+				static_cast<char>('0' + rep.nB), static_cast<char>('0' + rep.nW));
+		}
+		if (rep.status == game_status::ENT || rep.status == game_status::ETM)
+			return try_key_reply::make(status, key[0], key[1], key[2], key[3]);
+		return try_reply::make(status);
+	case game_op::NONE:
+		break;
+	}
+	return error_reply::make();
+}
+
+expected<game_request> net::decode_request(std::string_view frame) {
+	game_op op = binary_op(frame);
+	if (op == game_op::NONE)
+		return failure{failure::kind::SYNTAX, "Unknown request"};
+	if (frame.size() != BINARY_FRAME_SIZE)
+		return failure{failure::kind::FORMATTING, "Wrong frame size"};
+	binary_frame raw;
+	std::memcpy(&raw, frame.data(), sizeof(raw));
+	uint64_t payload = load_payload(raw);
+
+	uint64_t used = mask_of(REQUEST_PLID, 20);
+	if (op == game_op::START || op == game_op::DEBUG)
+		used |= mask_of(REQUEST_PLAYTIME, 10);
+	if (op == game_op::TRY || op == game_op::DEBUG)
+		used |= mask_of(REQUEST_CODE, GUESS_SIZE * COLOR_BITS);
+	if (op == game_op::TRY)
+		used |= mask_of(REQUEST_TRIAL, 4);
+	if (payload & ~used)
+		return failure{failure::kind::FORMATTING, "Unused bits were set"};
+
+	game_request req{op};
+	uint64_t plid = bits_of(payload, REQUEST_PLID, 20);
+	req.playtime = static_cast<uint16_t>(bits_of(payload, REQUEST_PLAYTIME, 10));
+	if (plid >= 1000000 || req.playtime > MAX_PLAYTIME)
+		return failure{failure::kind::SYNTAX, "Illegal argument"};
+	for (int i = PLID_SIZE - 1; i >= 0; i--, plid /= 10)
+		req.plid[i] = static_cast<char>('0' + plid % 10);
+	if ((op == game_op::TRY || op == game_op::DEBUG)
+		&& !unpack_colors(bits_of(payload, REQUEST_CODE, GUESS_SIZE * COLOR_BITS), req.code))
+		return failure{failure::kind::SYNTAX, "Illegal argument"};
+	if (op == game_op::TRY)
+		req.trial = static_cast<char>('0' + bits_of(payload, REQUEST_TRIAL, 4));
+	return req;
+}
+
+out_stream net::encode_request(const game_request& req) {
+	uint64_t plid = 0;
+	for (int i = 0; i < PLID_SIZE; i++)
+		plid = plid * 10 + (req.plid[i] - '0');
+	uint64_t payload = plid << REQUEST_PLID;
+	if (req.op == game_op::START || req.op == game_op::DEBUG)
+		payload |= uint64_t{req.playtime} << REQUEST_PLAYTIME;
+	if (req.op == game_op::TRY || req.op == game_op::DEBUG)
+		payload |= pack_colors(req.code) << REQUEST_CODE;
+	if (req.op == game_op::TRY)
+		payload |= bits_of(req.trial - '0', 0, 4) << REQUEST_TRIAL;
+	binary_frame frame{BINARY_MAGIC, static_cast<uint8_t>(req.op), {}};
+	store_payload(frame, payload);
+	return to_stream(frame);
+}
+
+expected<game_reply> net::decode_reply(std::string_view frame) {
+	if (frame.size() != BINARY_FRAME_SIZE || !is_binary(frame))
+		return failure{failure::kind::FORMATTING, "Wrong frame size"};
+	binary_frame raw;
+	std::memcpy(&raw, frame.data(), sizeof(raw));
+	if (raw.op > static_cast<uint8_t>(game_op::DEBUG))
+		return failure{failure::kind::SYNTAX, "Unknown request"};
+	uint64_t payload = load_payload(raw);
+	game_reply rep{static_cast<game_op>(raw.op), static_cast<game_status>(bits_of(payload, REPLY_STATUS, 4))};
+	if (!has_status(rep.op, rep.status))
+		return failure{failure::kind::SYNTAX, "Unknown status"};
+	bool has_key = (rep.op == game_op::QUIT && rep.status == game_status::OK)
+		|| (rep.op == game_op::TRY && (rep.status == game_status::ENT || rep.status == game_status::ETM));
+	if (has_key && !unpack_colors(bits_of(payload, REPLY_KEY, GUESS_SIZE * COLOR_BITS), rep.key))
+		return failure{failure::kind::SYNTAX, "Illegal argument"};
+	if (rep.op == game_op::TRY && rep.status == game_status::OK) {
+		rep.trial = static_cast<char>('0' + bits_of(payload, REPLY_TRIAL, 4));
+		rep.nB = static_cast<uint8_t>(bits_of(payload, REPLY_NB, 3));
+		rep.nW = static_cast<uint8_t>(bits_of(payload, REPLY_NW, 3));
+	}
+	return rep;
+}
+
+out_stream net::encode_reply(const game_reply& rep) {
+	uint64_t payload = uint64_t{static_cast<uint8_t>(rep.status)} << REPLY_STATUS;
+	if (rep.op == game_op::TRY && rep.status == game_status::OK) {
+		payload |= bits_of(rep.trial - '0', 0, 4) << REPLY_TRIAL;
+		payload |= bits_of(rep.nB, 0, 3) << REPLY_NB;
+		payload |= bits_of(rep.nW, 0, 3) << REPLY_NW;
+	}
+	if ((rep.op == game_op::QUIT && rep.status == game_status::OK)
+		|| (rep.op == game_op::TRY && (rep.status == game_status::ENT || rep.status == game_status::ETM)))
+		payload |= pack_colors(rep.key) << REPLY_KEY;
+	binary_frame frame{BINARY_MAGIC, static_cast<uint8_t>(rep.op), {}};
+	store_payload(frame, payload);
+	return to_stream(frame);
+}
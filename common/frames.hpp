@@ -0,0 +1,119 @@
+#ifndef _FRAMES_HPP_
+#define _FRAMES_HPP_
+
+#include <cstdint>
+#include <string_view>
+#include "common.hpp"
+
+#define BINARY_MAGIC 0xB1 // leads every binary frame (text messages start with a letter)
+#define BINARY_FRAME_SIZE 8
+
+/// The UDP requests and their replies as plain structs, and the two ways
+/// of framing them in a datagram: the text protocol (the default, see
+/// protocol.hpp) and a compact binary one, for clients that ask for it.
+/// A datagram is binary if (and only if) it starts with BINARY_MAGIC, so
+/// both share the port; the server answers each request in its framing.
+namespace net {
+/// The UDP requests (and so their replies). NONE is only found in replies:
+/// it answers a request that was not understood at all (a bare "ERR").
+enum class game_op : uint8_t {
+	NONE,
+	START,
+	TRY,
+	QUIT,
+	DEBUG
+};
+
+enum class game_status : uint8_t {
+	OK,
+	NOK,
+	ERR,
+	DUP,
+	INV,
+	ENT,
+	ETM
+};
+
+/// A UDP request, whichever framing it came in.
+struct game_request {
+	game_op op;
+	char plid[PLID_SIZE]{};
+	uint16_t playtime = 0; // START/DEBUG
+	char code[GUESS_SIZE]{}; // the guess of a TRY or the secret key of a DEBUG
+	char trial = '0'; // TRY
+};
+
+/// A reply to a UDP request, whichever framing it goes in.
+struct game_reply {
+	game_op op;
+	game_status status;
+	char trial = '0'; // of an accepted TRY (OK)
+	uint8_t nB = 0; // of an accepted TRY (OK)
+	uint8_t nW = 0;
+	char key[GUESS_SIZE]{}; // revealed by QUIT (OK) and by a TRY that ends the game (ENT/ETM)
+};
+
+/// The fixed layout of every binary frame, requests and replies alike.
+/// The fields are packed into 'payload', a 48 bit little endian word
+/// (colors take 3 bits each: their index in VALID_COLORS, the first
+/// color in the lowest bits):
+/// 1. requests: plid (bits 0-19), playtime (20-29), code (30-41) and trial
+/// number (42-45), each zero if the request has no such field.
+/// 2. replies: status (bits 0-3), trial number (4-7), nB (8-10), nW (11-13)
+/// and key (14-25).
+struct binary_frame {
+	uint8_t magic;
+	uint8_t op;
+	uint8_t payload[6];
+};
+
+static_assert(sizeof(binary_frame) == BINARY_FRAME_SIZE, "Frames have a fixed layout");
+
+/// Returns true if 'datagram' is a binary frame; false otherwise.
+bool is_binary(std::string_view datagram);
+
+/// Returns the request of the binary 'frame'; NONE if it has none.
+game_op binary_op(std::string_view frame);
+
+/// Returns the request whose keyword starts 'text'; NONE if there is none.
+game_op text_op(std::string_view text);
+
+/// Returns false if the datagram 'reply' is the reply to another kind of
+/// request than the datagram 'request' (e.g. a late RSG while waiting for
+/// a RTR), or accepts another trial than the try 'request' (e.g. a late
+/// "RTR OK 1 ..." while waiting for the answer to trial 2); true otherwise
+/// (bare ERRs and unknown replies included).
+/// Replies that don't say which trial they answer (e.g. "RTR DUP") can't
+/// be told apart.
+bool answers(std::string_view request, std::string_view reply);
+
+/// Returns the name of 'op' as the server reports it (e.g. "start").
+const char* op_name(game_op op);
+
+/// Parses and validates the 'op' request 'text' (see protocol.hpp).
+expected<game_request> parse_request(game_op op, std::string_view text);
+
+/// Returns 'req' as a text message, ready to be sent.
+out_stream make_request(const game_request& req);
+
+/// Parses and validates the text reply to an 'op' request.
+/// A bare "ERR" gives a NONE reply.
+expected<game_reply> parse_reply(game_op op, std::string_view text);
+
+/// Returns 'rep' as a text message, ready to be sent.
+out_stream make_reply(const game_reply& rep);
+
+/// Decodes and validates the binary request 'frame'.
+expected<game_request> decode_request(std::string_view frame);
+
+/// Returns 'req' as a binary frame, ready to be sent.
+out_stream encode_request(const game_request& req);
+
+/// Decodes and validates the binary reply 'frame'.
+expected<game_reply> decode_reply(std::string_view frame);
+
+/// Returns 'rep' as a binary frame, ready to be sent.
+out_stream encode_reply(const game_reply& rep);
+};
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef _PROTOCOL_HPP_
+#define _PROTOCOL_HPP_
+
+#include <array>
+#include <string_view>
+#include "common.hpp"
+#include "scan.hpp"
+
+/// The messages of the protocol, each declared once (as a keyword and the
+/// fields that follow it) and shared by the client and the server.
+/// A declaration gives both a parser, that tokenizes and validates the
+/// message in a single pass over it (without allocating), and a serializer.
+namespace net {
+/// Text usable as a template argument (e.g. the keyword of a message).
+template<size_t N>
+struct keyword {
+	constexpr keyword(const char (&text)[N]) {
+		for (size_t i = 0; i < N; i++)
+			chars[i] = text[i];
+	}
+
+	constexpr std::string_view view() const {
+		return {chars, N - 1};
+	}
+
+	char chars[N];
+};
+
+constexpr bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+constexpr bool is_upper(char c) {
+	return c >= 'A' && c <= 'Z';
+}
+
+constexpr bool is_color(char c) {
+	return c == 'R' || c == 'G' || c == 'B' || c == 'Y' || c == 'O' || c == 'P';
+}
+
+constexpr bool is_fname_char(char c) {
+	return is_digit(c) || is_upper(c) || (c >= 'a' && c <= 'z') || c == '.' || c == '-' || c == '_';
+}
+
+/// Any character but the EOM (a trial number is checked against the game).
+constexpr bool is_not_eom(char c) {
+	return c != DEFAULT_EOM;
+}
+
+/// Returns true if every character of 'value' is accepted by CHAR_OK
+/// (a word at a time for the classes that have a kernel, see scan.hpp).
+template<bool (*CHAR_OK)(char)>
+bool all_chars(std::string_view value) {
+	if constexpr (CHAR_OK == is_digit)
+		return all_digits(value);
+	else if constexpr (CHAR_OK == is_color)
+		return all_colors(value);
+	else if constexpr (CHAR_OK == is_fname_char)
+		return all_fname_chars(value);
+	else {
+		for (char c : value)
+			if (!CHAR_OK(c))
+				return false;
+		return true;
+	}
+}
+
+constexpr bool is_valid_playtime_value(std::string_view value) {
+	size_t playtime = 0;
+	for (char c : value)
+		playtime = playtime * 10 + (c - '0');
+	return playtime <= MAX_PLAYTIME;
+}
+
+constexpr bool is_valid_fname_value(std::string_view value) {
+	return value.ends_with(".txt");
+}
+
+/// A field of MIN to MAX characters, each accepted by CHAR_OK, whose value
+/// (if VALUE_OK is given) is also accepted by VALUE_OK.
+/// If FILL is given, serialized values are filled on the left with it up
+/// to MAX characters (e.g. a playtime of 60 is sent as 060).
+template<size_t MIN, size_t MAX, bool (*CHAR_OK)(char),
+		bool (*VALUE_OK)(std::string_view) = nullptr, char FILL = '\0'>
+struct field_spec {
+	static_assert(MIN != 0 && MIN <= MAX, "Fields have at least one character");
+
+	static constexpr size_t max_size = MAX;
+
+	/// Returns true if 'value' is a valid field; false otherwise.
+	static bool valid(std::string_view value) {
+		if (value.size() < MIN || value.size() > MAX || !all_chars<CHAR_OK>(value))
+			return false;
+		if constexpr (VALUE_OK != nullptr)
+			return VALUE_OK(value);
+		return true;
+	}
+
+	/// Reads the field that starts at text[at] into 'value', validating it
+	/// as it goes, and moves 'at' past it (onto what follows the field).
+	/// Like stream::read(MIN, MAX), the first MIN characters are taken as
+	/// they are, and the field ends early only at a separator or the EOM.
+	/// Returns false if the field is invalid (leaving 'at' somewhere in it).
+	static constexpr bool scan(std::string_view text, size_t& at, std::string_view& value) {
+		size_t begin = at;
+		for (; at < begin + MIN; at++)
+			if (at == text.size() || !CHAR_OK(text[at]))
+				return false;
+		for (; at < begin + MAX && at < text.size(); at++) {
+			if (text[at] == DEFAULT_SEP || text[at] == DEFAULT_EOM)
+				break;
+			if (!CHAR_OK(text[at]))
+				return false;
+		}
+		value = text.substr(begin, at - begin);
+		if constexpr (VALUE_OK != nullptr)
+			return VALUE_OK(value);
+		return true;
+	}
+
+	/// Writes 'value' into 'out' (it is not validated).
+	static void put(out_stream& out, std::string_view value) {
+		if constexpr (FILL != '\0')
+			out.write_and_fill(value, MAX, FILL);
+		else
+			out.write(value);
+	}
+
+	static void put(out_stream& out, char value) {
+		out.write(value);
+	}
+};
+
+using plid_field = field_spec<PLID_SIZE, PLID_SIZE, is_digit>;
+using playtime_field = field_spec<1, MAX_PLAYTIME_SIZE, is_digit, is_valid_playtime_value, '0'>;
+using color_field = field_spec<1, 1, is_color>;
+using trial_field = field_spec<1, 1, is_not_eom>;
+using count_field = field_spec<1, 1, is_digit>; // of blacks/whites
+using status_field = field_spec<2, 5, is_upper>; // OK, NOK, ..., EMPTY
+using fname_field = field_spec<4, MAX_FNAME_SIZE - 1, is_fname_char, is_valid_fname_value>;
+using fsize_field = field_spec<1, MAX_FSIZE_LEN, is_digit>;
+
+/// A message: KEY followed by FIELDS (each after a DEFAULT_SEP) and the
+/// DEFAULT_EOM. KEY may hold more than one word (e.g. "RTR OK" is the
+/// reply to a try that also carries the trial and the counts).
+template<keyword KEY, typename... FIELDS>
+struct message_spec {
+	using fields = std::array<std::string_view, sizeof...(FIELDS)>;
+
+	/// The size of the longest message (EOM included).
+	static constexpr size_t max_size = KEY.view().size() + (0 + ... + (1 + FIELDS::max_size)) + 1;
+
+	/// Parses and validates the whole message 'text' (keyword included)
+	/// in a single pass. The fields returned are views into 'text'.
+	/// Whatever follows the EOM is ignored (as stream::read does).
+	/// Returns a SYNTAX failure if the keyword or a field is wrong, a
+	/// FORMATTING one if the fields don't end with the EOM and a
+	/// MISSING_EOM one if the text ends before it.
+	static expected<fields> parse(std::string_view text) {
+		if (!text.starts_with(KEY.view()))
+			return failure{failure::kind::SYNTAX, "Unexpected keyword"};
+		fields res;
+		size_t at = KEY.view().size();
+		size_t i = 0;
+		bool ok = true;
+		((ok = ok && at < text.size() && text[at++] == DEFAULT_SEP
+			&& FIELDS::scan(text, at, res[i++])), ...);
+		if (!ok) {
+			if (at >= text.size())
+				return failure{failure::kind::MISSING_EOM, "Missing EOM"};
+			return failure{failure::kind::SYNTAX, "Illegal argument"};
+		}
+		if (at == text.size())
+			return failure{failure::kind::MISSING_EOM, "Missing EOM"};
+		if (text[at] != DEFAULT_EOM)
+			return failure{failure::kind::FORMATTING, "End wasn't 'strict'"};
+		return res;
+	}
+
+	/// Returns the message with the given 'values' (one per field, either
+	/// text or a single char), ready to be sent. They are not validated.
+	template<typename... VALUES>
+	static out_stream make(const VALUES&... values) {
+		out_stream out = header(values...);
+		out.prime();
+		return out;
+	}
+
+	/// Same as make, but without the EOM: the message goes on with a body
+	/// (as the header of a file).
+	template<typename... VALUES>
+	static out_stream header(const VALUES&... values) {
+		static_assert(sizeof...(VALUES) == sizeof...(FIELDS), "One value per field");
+		out_stream out;
+		out.write(KEY.view());
+		(FIELDS::put(out, values), ...);
+		return out;
+	}
+};
+
+static_assert(GUESS_SIZE == 4, "The messages below carry 4 colors");
+
+// Requests
+using start_request = message_spec<"SNG", plid_field, playtime_field>;
+using try_request = message_spec<"TRY", plid_field,
+	color_field, color_field, color_field, color_field, trial_field>;
+using quit_request = message_spec<"QUT", plid_field>;
+using debug_request = message_spec<"DBG", plid_field, playtime_field,
+	color_field, color_field, color_field, color_field>;
+using trials_request = message_spec<"STR", plid_field>;
+using scoreboard_request = message_spec<"SSB">;
+using keep_alive_request = message_spec<"KAL">;
+using subscribe_request = message_spec<"SUB">; // answered with a scoreboard reply per change
+
+static_assert(debug_request::max_size <= UDP_MSG_SIZE, "Requests fit a datagram");
+
+// Replies
+using error_reply = message_spec<"ERR">;
+using start_reply = message_spec<"RSG", status_field>;
+using debug_reply = message_spec<"RDB", status_field>;
+using quit_reply = message_spec<"RQT", status_field>; // NOK/ERR
+using quit_key_reply = message_spec<"RQT OK",
+	color_field, color_field, color_field, color_field>;
+using try_reply = message_spec<"RTR", status_field>; // DUP/INV/NOK/ERR
+using try_result_reply = message_spec<"RTR OK", trial_field, count_field, count_field>;
+using try_key_reply = message_spec<"RTR", status_field, // ENT/ETM
+	color_field, color_field, color_field, color_field>;
+using trials_reply = message_spec<"RST", status_field>; // NOK
+using trials_file_reply = message_spec<"RST", status_field, fname_field, fsize_field>; // ACT/FIN
+using scoreboard_reply = message_spec<"RSS", status_field>; // EMPTY
+using scoreboard_file_reply = message_spec<"RSS OK", fname_field, fsize_field>;
+using keep_alive_reply = message_spec<"RKA", status_field>;
+};
+
+#endif
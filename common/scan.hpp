@@ -0,0 +1,187 @@
+#ifndef _SCAN_HPP_
+#define _SCAN_HPP_
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include "common.hpp"
+
+/// Kernels that tokenize and validate text held in memory 8 bytes at a
+/// time, as the bytes of a 64 bit word (SIMD within a register), instead of
+/// a character at a time. They are plain C++ (no intrinsics), so they need
+/// no special build flags and run the same on any 64 bit machine.
+/// A byte "matches" when its high bit is set in the mask a kernel returns
+/// (the other bits are always clear). Only ASCII bytes (< 0x80) ever match.
+namespace net {
+using scan_word = uint64_t;
+
+static constexpr size_t SCAN_WORD_SIZE = sizeof(scan_word);
+static constexpr scan_word SCAN_ONES = 0x0101010101010101;
+static constexpr scan_word SCAN_HIGHS = 0x8080808080808080;
+
+/// Returns a word with every byte set to 'byte'.
+constexpr scan_word scan_repeat(uint8_t byte) {
+	return SCAN_ONES * byte;
+}
+
+/// Loads 'n' (up to SCAN_WORD_SIZE) bytes from 'p' into the first 'n'
+/// bytes of a word (the others are zero).
+inline scan_word scan_load(const char* p, size_t n = SCAN_WORD_SIZE) {
+	scan_word res = 0;
+	std::memcpy(&res, p, n);
+	return res;
+}
+
+/// Returns the mask of the first 'n' bytes of a word (in memory order).
+constexpr scan_word scan_prefix(size_t n) {
+	if (n >= SCAN_WORD_SIZE)
+		return SCAN_HIGHS;
+	if constexpr (std::endian::native == std::endian::little)
+		return SCAN_HIGHS & ((scan_word{1} << (8 * n)) - 1);
+	else
+		return SCAN_HIGHS & ~(~scan_word{0} >> (8 * n));
+}
+
+/// Returns the index (in memory order) of the first byte that matches in
+/// 'mask', which must not be zero.
+constexpr size_t scan_first(scan_word mask) {
+	if constexpr (std::endian::native == std::endian::little)
+		return std::countr_zero(mask) / 8;
+	else
+		return std::countl_zero(mask) / 8;
+}
+
+/// Matches the bytes of 'x' within ['lo', 'hi'] (both below 0x80).
+/// The high bit of each byte is set aside first, so no byte ever carries
+/// into the next.
+constexpr scan_word scan_in_range(scan_word x, uint8_t lo, uint8_t hi) {
+	scan_word low = x & ~SCAN_HIGHS;
+	scan_word at_least_lo = low + scan_repeat(0x80 - lo);
+	scan_word above_hi = low + scan_repeat(0x7F - hi);
+	return at_least_lo & ~above_hi & ~x & SCAN_HIGHS;
+}
+
+/// Matches the bytes of 'x' equal to 'c' (below 0x80).
+constexpr scan_word scan_equal(scan_word x, uint8_t c) {
+	return scan_in_range(x, c, c);
+}
+
+/// Matches the DEFAULT_SEP and DEFAULT_EOM bytes of 'x'.
+constexpr scan_word delimiter_bytes(scan_word x) {
+	return scan_equal(x, DEFAULT_SEP) | scan_equal(x, DEFAULT_EOM);
+}
+
+constexpr scan_word digit_bytes(scan_word x) {
+	return scan_in_range(x, '0', '9');
+}
+
+/// Matches the bytes of 'x' that are one of VALID_COLORS.
+constexpr scan_word color_bytes(scan_word x) {
+	return scan_equal(x, 'R') | scan_equal(x, 'G') | scan_equal(x, 'B')
+		| scan_equal(x, 'Y') | scan_equal(x, 'O') | scan_equal(x, 'P');
+}
+
+/// Matches the bytes of 'x' allowed in a file name (see is_valid_fname).
+constexpr scan_word fname_bytes(scan_word x) {
+	return digit_bytes(x) | scan_in_range(x, 'A', 'Z') | scan_in_range(x, 'a', 'z')
+		| scan_equal(x, '.') | scan_equal(x, '-') | scan_equal(x, '_');
+}
+
+/// Returns true if every byte of 'text' matches 'bytes' (a kernel as
+/// the ones above); false otherwise.
+template<typename KERNEL>
+bool all_bytes(std::string_view text, KERNEL bytes) {
+	size_t i = 0;
+	for (; i + SCAN_WORD_SIZE <= text.size(); i += SCAN_WORD_SIZE)
+		if (bytes(scan_load(text.data() + i)) != SCAN_HIGHS)
+			return false;
+	if (i == text.size())
+		return true;
+	size_t n = text.size() - i;
+	return (bytes(scan_load(text.data() + i, n)) & scan_prefix(n)) == scan_prefix(n);
+}
+
+inline bool all_digits(std::string_view text) {
+	return all_bytes(text, digit_bytes);
+}
+
+inline bool all_colors(std::string_view text) {
+	return all_bytes(text, color_bytes);
+}
+
+inline bool all_fname_chars(std::string_view text) {
+	return all_bytes(text, fname_bytes);
+}
+
+/// Returns the index of the first DEFAULT_SEP or DEFAULT_EOM of 'text' at
+/// or after 'from'; text.size() if there is none.
+/// Looks at two words (16 bytes) per iteration.
+inline size_t find_delimiter(std::string_view text, size_t from) {
+	size_t i = from;
+	for (; i + 2 * SCAN_WORD_SIZE <= text.size(); i += 2 * SCAN_WORD_SIZE) {
+		scan_word first = delimiter_bytes(scan_load(text.data() + i));
+		scan_word second = delimiter_bytes(scan_load(text.data() + i + SCAN_WORD_SIZE));
+		if ((first | second) == 0)
+			continue;
+		if (first != 0)
+			return i + scan_first(first);
+		return i + SCAN_WORD_SIZE + scan_first(second);
+	}
+	for (; i < text.size(); i += SCAN_WORD_SIZE) {
+		size_t n = std::min(SCAN_WORD_SIZE, text.size() - i);
+		scan_word found = delimiter_bytes(scan_load(text.data() + i, n)) & scan_prefix(n);
+		if (found != 0)
+			return i + scan_first(found);
+	}
+	return text.size();
+}
+
+/// Reads the fields of text held in memory (e.g. a whole file) in the
+/// format the server writes its files: fields separated by exactly one
+/// DEFAULT_SEP, in lines ended by a DEFAULT_EOM.
+/// It does NOT own the text: destroying it mid-use is undefined behaviour.
+struct text_scanner {
+	explicit text_scanner(std::string_view text) : _text(text) {}
+
+	/// Reads the next field of the line into 'field'.
+	/// Returns false if there is none or if it does not have 'min' to
+	/// 'max' characters.
+	bool field(std::string_view& field, size_t min, size_t max) {
+		if (!_line_start) {
+			if (_at == _text.size() || _text[_at] != DEFAULT_SEP)
+				return false;
+			_at++;
+		}
+		size_t end = find_delimiter(_text, _at);
+		if (end == _text.size() || end - _at < min || end - _at > max)
+			return false;
+		field = _text.substr(_at, end - _at);
+		_at = end;
+		_line_start = false;
+		return true;
+	}
+
+	/// Moves on to the next line.
+	/// Returns false if the line has more fields (or no DEFAULT_EOM).
+	bool end_line() {
+		if (_at == _text.size() || _text[_at] != DEFAULT_EOM)
+			return false;
+		_at++;
+		_line_start = true;
+		return true;
+	}
+
+	/// Returns true if the whole text was read; false otherwise.
+	bool finished() const {
+		return _at == _text.size();
+	}
+private:
+	std::string_view _text;
+	size_t _at = 0;
+	bool _line_start = true;
+};
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include "uring.hpp"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+using namespace net;
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params* params) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+	void* arg = nullptr, size_t arg_size = 0) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+uring::uring(unsigned entries, unsigned flags) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = flags;
+	if ((_fd = sys_io_uring_setup(entries, &params)) == -1)
+		return; // not supported (or not allowed)
+	_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (_cq_ring_size > _sq_ring_size)
+			_sq_ring_size = _cq_ring_size;
+		_cq_ring_size = _sq_ring_size;
+	}
+	_sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+	if (_sq_ring == MAP_FAILED) {
+		_sq_ring = nullptr;
+		close(_fd);
+		_fd = -1;
+		return;
+	}
+	if (single_mmap)
+		_cq_ring = _sq_ring;
+	else {
+		_cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+		if (_cq_ring == MAP_FAILED) {
+			_cq_ring = nullptr;
+			munmap(_sq_ring, _sq_ring_size);
+			_sq_ring = nullptr;
+			close(_fd);
+			_fd = -1;
+			return;
+		}
+	}
+	_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (!single_mmap)
+			munmap(_cq_ring, _cq_ring_size);
+		munmap(_sq_ring, _sq_ring_size);
+		_sq_ring = _cq_ring = nullptr;
+		close(_fd);
+		_fd = -1;
+		return;
+	}
+	_sqes = static_cast<io_uring_sqe*>(sqes);
+	char* sq = static_cast<char*>(_sq_ring);
+	char* cq = static_cast<char*>(_cq_ring);
+	_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	_entries = params.sq_entries;
+	_ext_arg = params.features & IORING_FEAT_EXT_ARG;
+}
+
+uring::~uring() {
+	if (_fd == -1)
+		return;
+	if (_buf_ring)
+		munmap(_buf_ring, _buf_ring_size);
+	munmap(_sqes, _sqes_size);
+	if (_cq_ring != _sq_ring)
+		munmap(_cq_ring, _cq_ring_size);
+	munmap(_sq_ring, _sq_ring_size);
+	close(_fd);
+}
+
+bool uring::valid() const {
+	return _fd != -1;
+}
+
+int uring::get_fildes() const {
+	return _fd;
+}
+
+io_uring_sqe* uring::get_sqe() {
+	if (free_sqes() == 0)
+		return nullptr;
+	unsigned tail = *_sq_tail + _queued;
+	unsigned index = tail & *_sq_mask;
+	_sq_array[index] = index;
+	io_uring_sqe* sqe = &_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	_queued++;
+	return sqe;
+}
+
+unsigned uring::free_sqes() const {
+	unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+	return _entries - (*_sq_tail + _queued - head);
+}
+
+unsigned uring::submit(unsigned wait_nr) {
+	unsigned to_submit = _queued;
+	if (to_submit != 0) { // publish the new entries to the kernel
+		__atomic_store_n(_sq_tail, *_sq_tail + to_submit, __ATOMIC_RELEASE);
+		_queued = 0;
+	}
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+	unsigned flags = wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0;
+	unsigned submitted = 0;
+	while (true) {
+		int n = sys_io_uring_enter(_fd, to_submit - submitted, wait_nr, flags);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw system_error{"Failed to submit io_uring entries"};
+		}
+		submitted += n;
+		if (submitted >= to_submit || n == 0)
+			return submitted;
+	}
+}
+
+void uring::submit_and_wait(int timeout) {
+	unsigned to_submit = _queued;
+	if (to_submit != 0) {
+		__atomic_store_n(_sq_tail, *_sq_tail + to_submit, __ATOMIC_RELEASE);
+		_queued = 0;
+	}
+	unsigned wait_nr = timeout == 0 ? 0 : 1;
+	if (timeout < 0 || !_ext_arg) { // (always GETEVENTS, so deferred completions get posted)
+		while (true) {
+			int n = sys_io_uring_enter(_fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				throw system_error{"Failed to submit io_uring entries"};
+			}
+			to_submit -= std::min(to_submit, static_cast<unsigned>(n));
+			if (to_submit == 0)
+				return;
+			wait_nr = 0;
+		}
+	}
+	__kernel_timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uintptr_t>(&ts);
+	unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	while (true) {
+		int n = sys_io_uring_enter(_fd, to_submit, wait_nr, flags, &arg, sizeof(arg));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ETIME) // timed out (the entries were still submitted)
+				return;
+			throw system_error{"Failed to submit io_uring entries"};
+		}
+		to_submit -= std::min(to_submit, static_cast<unsigned>(n));
+		if (to_submit == 0)
+			return;
+		wait_nr = 0; // something was submitted => just submit the rest
+	}
+}
+
+bool uring::supports(uint8_t opcode) const {
+	size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::vector<char> buf(size, 0);
+	io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+	if (sys_io_uring_register(_fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+		return false;
+	if (opcode > probe->last_op)
+		return false;
+	return probe->ops[opcode].flags & IO_URING_OP_SUPPORTED;
+}
+
+bool uring::register_file_slots(unsigned count) {
+	io_uring_rsrc_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = count;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (sys_io_uring_register(_fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0)
+		return true;
+	std::vector<int> slots(count, -1); // older kernels: a table of unused slots
+	return sys_io_uring_register(_fd, IORING_REGISTER_FILES, slots.data(), count) == 0;
+}
+
+bool uring::provide_buffers(unsigned count, size_t size) {
+	if (_buf_ring || count == 0 || (count & (count - 1)) != 0)
+		return false;
+	_buf_ring_size = count * sizeof(io_uring_buf);
+	void* ring = mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0); // must be page aligned
+	if (ring == MAP_FAILED)
+		return false;
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uintptr_t>(ring);
+	reg.ring_entries = count;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (sys_io_uring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(ring, _buf_ring_size);
+		return false;
+	}
+	_buf_ring = static_cast<io_uring_buf_ring*>(ring);
+	_buf_count = count;
+	_buf_size = size;
+	_bufs.resize(count * size);
+	for (unsigned bid = 0; bid < count; bid++)
+		recycle_buffer(static_cast<uint16_t>(bid));
+	return true;
+}
+
+char* uring::buffer(uint16_t bid) {
+	return _bufs.data() + bid * _buf_size;
+}
+
+void uring::recycle_buffer(uint16_t bid) {
+	unsigned short tail = _buf_ring->tail;
+	// not _buf_ring->bufs: in C++, the header's flexible array does not start at offset 0
+	io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(_buf_ring)[tail & (_buf_count - 1)];
+	buf.addr = reinterpret_cast<uintptr_t>(buffer(bid));
+	buf.len = static_cast<uint32_t>(_buf_size);
+	buf.bid = bid;
+	__atomic_store_n(&_buf_ring->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
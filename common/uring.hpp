@@ -0,0 +1,120 @@
+#ifndef _URING_HPP_
+#define _URING_HPP_
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "except.hpp"
+
+#define URING_BUFFER_GROUP 0 // group of the buffers given by provide_buffers()
+
+namespace net {
+/// Minimal wrapper around a Linux io_uring instance (talks to the kernel
+/// through the raw system calls, so it does not depend on liburing).
+/// Not thread safe: a ring must be used by a single thread at a time.
+struct uring {
+	/// Sets up a ring with room for 'entries' submissions, created with
+	/// the IORING_SETUP_* 'flags'.
+	/// Check valid() to know if the kernel supports io_uring (and 'flags').
+	explicit uring(unsigned entries, unsigned flags = 0);
+
+	uring(const uring& other) = delete;
+
+	uring& operator=(const uring& other) = delete;
+
+	~uring();
+
+	/// Returns true if the ring is ready to use; false otherwise.
+	bool valid() const;
+
+	/// Returns the file descriptor of the ring.
+	int get_fildes() const;
+
+	/// Returns a zeroed submission queue entry, to be filled in by the
+	/// caller and submitted by the next call to submit().
+	/// Returns nullptr if the submission queue is full.
+	io_uring_sqe* get_sqe();
+
+	/// Returns the number of free entries in the submission queue.
+	unsigned free_sqes() const;
+
+	/// Submits every queued entry and waits until at least 'wait_nr'
+	/// completions are available.
+	/// Returns the number of entries submitted.
+	/// Throws:
+	/// 1. system_error if the kernel refuses the submission.
+	unsigned submit(unsigned wait_nr = 0);
+
+	/// Submits every queued entry and waits up to 'timeout' milliseconds
+	/// (-1 waits forever) for a completion.
+	/// Always asks for completions, so it also posts the ones deferred by
+	/// IORING_SETUP_DEFER_TASKRUN.
+	/// Throws:
+	/// 1. system_error if the kernel refuses the submission.
+	void submit_and_wait(int timeout);
+
+	/// Calls func(const io_uring_cqe&) for every available completion,
+	/// consuming them.
+	/// Returns the number of completions consumed.
+	template<typename FUNC>
+	unsigned for_each_completion(FUNC&& func) {
+		unsigned head = *_cq_head;
+		unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		for (; head != tail; head++, count++)
+			func(_cqes[head & *_cq_mask]);
+		__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	/// Returns true if the kernel supports the operation 'opcode'
+	/// (one of IORING_OP_*); false otherwise.
+	bool supports(uint8_t opcode) const;
+
+	/// Registers 'count' empty slots for fixed (direct) files, so that
+	/// an operation can use the file opened by a previous (linked) one.
+	/// Returns true on success; false if the kernel does not support it.
+	bool register_file_slots(unsigned count);
+
+	/// Registers a ring of 'count' (a power of 2) buffers of 'size' bytes,
+	/// that the kernel picks from when an operation is submitted with
+	/// IOSQE_BUFFER_SELECT (and buf_group set to URING_BUFFER_GROUP).
+	/// Returns true on success; false if the kernel does not support it.
+	bool provide_buffers(unsigned count, size_t size);
+
+	/// Returns the provided buffer with id 'bid' (found in the flags
+	/// of the completion that used it).
+	char* buffer(uint16_t bid);
+
+	/// Gives the buffer with id 'bid' back to the kernel.
+	void recycle_buffer(uint16_t bid);
+private:
+	int _fd{-1};
+	void* _sq_ring{nullptr};
+	void* _cq_ring{nullptr};
+	size_t _sq_ring_size{0};
+	size_t _cq_ring_size{0};
+	io_uring_sqe* _sqes{nullptr};
+	size_t _sqes_size{0};
+	unsigned* _sq_head{nullptr};
+	unsigned* _sq_tail{nullptr};
+	unsigned* _sq_mask{nullptr};
+	unsigned* _sq_array{nullptr};
+	unsigned* _cq_head{nullptr};
+	unsigned* _cq_tail{nullptr};
+	unsigned* _cq_mask{nullptr};
+	io_uring_cqe* _cqes{nullptr};
+	unsigned _entries{0};
+	unsigned _queued{0}; // filled in, but not yet submitted
+	bool _ext_arg{false}; // the kernel can wait with a timeout
+	io_uring_buf_ring* _buf_ring{nullptr};
+	size_t _buf_ring_size{0};
+	unsigned _buf_count{0};
+	size_t _buf_size{0};
+	std::vector<char> _bufs;
+};
+};
+
+#endif
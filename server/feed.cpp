@@ -0,0 +1,90 @@
+#include "feed.hpp"
+#include "../common/protocol.hpp"
+
+#include <cerrno>
+#include <exception>
+#include <sys/socket.h>
+
+void scoreboard_feed::publish(uint64_t version, const std::string& name, std::string&& sb) {
+	if (_latest && version <= _version)
+		return;
+	_version = version;
+	if (sb.empty())
+		_latest = std::make_shared<const update>(++_seq, net::scoreboard_reply::make("EMPTY"), "");
+	else {
+		net::out_stream header = net::scoreboard_file_reply::header(
+			"SB_" + name + ".txt",
+			net::decimal(sb.size()).view()
+		);
+		_latest = std::make_shared<const update>(++_seq, std::move(header), std::move(sb));
+	}
+	_published.notify_all();
+}
+
+uint64_t scoreboard_feed::version() const {
+	return _version;
+}
+
+net::task<void> scoreboard_feed::serve(net::async_tcp_connection& conn) {
+	net::executor& ex = net::executor::current();
+	int fd = conn.get_fildes();
+	_subscribers++;
+	std::exception_ptr error;
+	try {
+		uint64_t sent = 0; // seq of the last update pushed
+		clock::time_point last = clock::now() - std::chrono::milliseconds{FEED_MIN_INTERVAL};
+		while (true) {
+			while (_latest->seq == sent && !departed(fd))
+				co_await _published.wait();
+			if (departed(fd))
+				break;
+			auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+				last + std::chrono::milliseconds{FEED_MIN_INTERVAL} - clock::now());
+			if (wait.count() > 0)
+				co_await ex.sleep(static_cast<int>(wait.count()));
+			std::shared_ptr<const update> upd = _latest; // (the latest, once awake)
+			if (sent != 0)
+				_coalesced += upd->seq - sent - 1;
+			if (upd->body.empty())
+				co_await conn.answer(upd->header);
+			else
+				co_await conn.answer(upd->header, upd->body);
+			sent = upd->seq;
+			last = clock::now();
+			_pushes++;
+		}
+	} catch (...) {
+		error = std::current_exception();
+	}
+	_subscribers--;
+	if (error)
+		std::rethrow_exception(error);
+}
+
+net::task<void> scoreboard_feed::sweep() {
+	net::executor& ex = net::executor::current();
+	while (true) {
+		co_await ex.sleep(FEED_SWEEP_INTERVAL);
+		_published.notify_all();
+	}
+}
+
+size_t scoreboard_feed::subscribers() const {
+	return _subscribers;
+}
+
+uint64_t scoreboard_feed::pushes() const {
+	return _pushes;
+}
+
+uint64_t scoreboard_feed::coalesced() const {
+	return _coalesced;
+}
+
+bool scoreboard_feed::departed(int fd) {
+	char c;
+	ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n >= 0) // closed (0) or sent something
+		return true;
+	return errno != EAGAIN && errno != EWOULDBLOCK;
+}
@@ -0,0 +1,79 @@
+#ifndef _FEED_HPP_
+#define _FEED_HPP_
+
+#include "../common/async.hpp"
+#include "../common/common.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#define FEED_MIN_INTERVAL 250 // ms between two pushes to the same subscriber
+#define FEED_SWEEP_INTERVAL (DEFAULT_IDLE_TIMEOUT * 1000) // ms between looks for subscribers that left
+
+/// Pushes the scoreboard to its subscribers: clients that sent a single
+/// subscribe request ("SUB") and keep the connection open to be sent,
+/// right away and then every time the top list changes, the scoreboard
+/// as the reply to a show scoreboard request ("RSS OK ..." or "RSS EMPTY").
+/// Every subscriber is a coroutine waiting on a notifier (no timers, no
+/// polls), so a single event loop serves thousands of them.
+/// Updates are coalesced: each one is serialized once and shared, and a
+/// subscriber is never pushed more than once every FEED_MIN_INTERVAL
+/// (nor more than one push at a time, when it reads slowly). Whatever
+/// is published meanwhile is skipped over for the latest scoreboard.
+/// A subscription ends when the client closes the connection (or sends
+/// anything on it).
+struct scoreboard_feed {
+	using clock = std::chrono::steady_clock;
+
+	/// Makes 'sb', the scoreboard named 'name' (as scoreboard::to_string
+	/// returns it; empty if no game was won yet), the latest one and wakes
+	/// the subscribers. Ignored unless 'version' is newer than the version
+	/// published last.
+	void publish(uint64_t version, const std::string& name, std::string&& sb);
+
+	/// Returns the version published last (0 if none was).
+	uint64_t version() const;
+
+	/// Serves the subscriber of 'conn' until it leaves (see above).
+	/// There must be a published scoreboard.
+	/// Throws conn_error if the subscriber stops reading for DEFAULT_TIMEOUT
+	/// seconds.
+	net::task<void> serve(net::async_tcp_connection& conn);
+
+	/// Wakes the subscribers every FEED_SWEEP_INTERVAL, so that the ones
+	/// that left (while nothing was published) let go of their connection.
+	/// Never returns.
+	net::task<void> sweep();
+
+	/// Returns the number of subscribers.
+	size_t subscribers() const;
+
+	/// Returns the number of scoreboards pushed so far.
+	uint64_t pushes() const;
+
+	/// Returns the number of scoreboards skipped over for a newer one.
+	uint64_t coalesced() const;
+private:
+	/// A published scoreboard, ready to be sent.
+	struct update {
+		uint64_t seq; // of the publish
+		net::out_stream header; // the whole message if 'body' is empty
+		std::string body;
+	};
+
+	/// Returns true if the client of 'fd' left (or sent something);
+	/// false otherwise. Doesn't block.
+	static bool departed(int fd);
+
+	std::shared_ptr<const update> _latest{};
+	uint64_t _version{0};
+	uint64_t _seq{0};
+	net::notifier _published{};
+	size_t _subscribers{0};
+	uint64_t _pushes{0};
+	uint64_t _coalesced{0};
+};
+
+#endif
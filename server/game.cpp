@@ -1,11 +1,260 @@
 #include "game.hpp"
+#include "layout.hpp"
+#include "shard.hpp"
+#include "../common/scan.hpp"
 
+#include <charconv>
 #include <filesystem>
 #include <fcntl.h>
-#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <type_traits>
+#include <unordered_map>
+
+#define SNAPSHOT_MAGIC "MMSNAP2\n"
+#define SNAPSHOT_BUFFER_SIZE (1 << 20) // bytes written at a time
+#define MAX_PLIDS 1000000 // (6 digits)
+#define RESIDENT_GAME_OVERHEAD 128 // bytes a game in memory takes besides itself (plid, table and list nodes)
+#define SCORE_LINE_SIZE (PLID_SIZE + GUESS_SIZE + 8) // a record ("100 123456 RGBY 8\n")
+#define GAME_HEADER_SIZE (PLID_SIZE + GUESS_SIZE + MAX_PLAYTIME_SIZE + MAX_NUMBER_SIZE + 6)
+#define GAME_END_SIZE (MAX_NUMBER_SIZE + 3) // the termination reason and time
+#define MAX_PATH_SIZE 64 // of the files written (the directories are short)
+#define GAME_FILE_SIZE (GAME_HEADER_SIZE + (MAX_TRIALS - '0') * TRIAL_RECORD_SIZE + GAME_END_SIZE) // at most
+#define SCORE_FILE_SIZE (MAX_TOP_SCORES * SCORE_LINE_SIZE) // at most
 
 static scoreboard board;
+static uint64_t board_version = 1; // bumped whenever add_record changes the top list
+static storage* disk = nullptr;
+static std::string score_dir{DEFAULT_SCORE_DIR}; // of this shard
+static std::string snapshot_path{DEFAULT_SNAPSHOT_DIR "/server"}; // of this shard
+/// An active game kept in memory.
+struct resident_game {
+	game gm;
+	std::list<std::string>::iterator used; // its place in 'resident_used'
+};
+
+static std::unordered_map<std::string, resident_game> resident; // active games, by plid
+static std::list<std::string> resident_used; // their plids, the most recently used first
+static size_t max_resident = SIZE_MAX; // games in memory (resident and restored)
+static resident_stats resident_counts{0, 0, 0, 0};
+static std::unordered_map<std::string, std::shared_ptr<const std::string>> finished_transcripts; // by plid
+static std::unordered_map<std::string, game> restored; // from the snapshot, until checked against their files
+static timespec restored_at{0, 0}; // when that snapshot was taken
+static std::vector<bool> has_active(MAX_PLIDS); // false => the plid has no active game
+static std::vector<bool> has_any(MAX_PLIDS); // false => the plid has no game at all
+static bool presence_known = false; // has_active and has_any are set (see setup)
+static session_table sessions(MAX_PLIDS); // every active game known (in memory or not)
+
+static_assert(std::is_trivially_copyable_v<game>, "games are snapshot as they are in memory");
+static_assert(std::is_trivially_copyable_v<scoreboard::record>, "records are snapshot as they are in memory");
+
+/// Reads and writes snapshot files (see snapshot()), which hold:
+/// 1. SNAPSHOT_MAGIC and the size of a game (snapshots of other builds are ignored);
+/// 2. when it was taken;
+/// 3. the number of scoreboard records, followed by the records;
+/// 4. the number of active games, followed by the games;
+/// 5. has_active and has_any, MAX_PLIDS bits each (8 per byte).
+/// Records and games are saved as they are in memory.
+struct snapshot_file {
+	/// Writes the snapshot to 'path' (replacing it atomically through
+	/// 'temp_path'), SNAPSHOT_BUFFER_SIZE bytes at a time through 'buf'.
+	/// It only copies memory and makes system calls (open, write,
+	/// fdatasync, close, rename, unlink): no allocations, no locks, so it
+	/// may run in the child forked from the multithreaded server (the
+	/// buffer and the paths are set up before the fork).
+	/// Returns true on success; false otherwise.
+	static bool write(const char* path, const char* temp_path, const timespec& taken, char* buf);
+
+	/// Loads the snapshot at 'path' (if there is one) into 'restored' and,
+	/// if the scores directory did not change since it was taken, 'board'.
+	/// If no bucket of the game directory changed either (and they're not
+	/// known yet), it also loads has_active and has_any.
+	/// Returns true if 'board' was loaded; false otherwise.
+	/// Throws:
+	/// 1. io_error if the snapshot exists but could not be read.
+	/// 2. corruption_error if it's corrupted.
+	static bool load(const std::string& path);
+};
+
+/// Returns true if the file at 'path' is gone or was modified at or after
+/// 'when'; false otherwise.
+static bool changed_since(const std::string& path, const timespec& when) {
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1)
+		return true;
+	return st.st_mtim.tv_sec > when.tv_sec
+		|| (st.st_mtim.tv_sec == when.tv_sec && st.st_mtim.tv_nsec >= when.tv_nsec);
+}
+
+/// Reads the whole file 'fd' into 'buf' (of 'size' bytes) or, if it does
+/// not fit, into 'spill'. Returns what was read.
+/// Throws io_error if reading fails.
+static std::string_view read_whole(int fd, char* buf, size_t size, std::string& spill) {
+	size_t len = 0;
+	while (true) {
+		ssize_t res = read(fd, buf + len, size - len);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1)
+			throw net::io_error{"Failed to read file"};
+		if (res == 0)
+			break;
+		len += res;
+		if (len < size)
+			continue;
+		spill.append(buf, len); // (bigger than expected, but read it all)
+		len = 0;
+	}
+	if (spill.empty())
+		return {buf, len};
+	spill.append(buf, len);
+	return spill;
+}
+
+/// Reads the decimal 'text' into 'number'.
+/// Returns false if it's not all digits or if it does not fit.
+template<typename INT>
+static bool to_number(std::string_view text, INT& number) {
+	if (!net::all_digits(text))
+		return false;
+	auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), number);
+	return err == std::errc{} && end == text.data() + text.size();
+}
+
+/// Returns the index of 'valid_plid' in the presence bitmaps.
+static size_t presence_index(const char valid_plid[PLID_SIZE]) {
+	size_t res = 0;
+	for (int i = 0; i < PLID_SIZE; i++)
+		res = res * 10 + (valid_plid[i] - '0');
+	return res;
+}
+
+/// Rebuilds the presence bitmaps from the files in the game directory,
+/// for the players of shard 'shard' (out of 'shards'; -1 if the server
+/// is not sharded).
+/// Throws std::filesystem::filesystem_error if it could not be read.
+static void scan_presence(int shard, int shards) {
+	for (const std::string& dir : bucket_dirs()) {
+		for (const auto& entry : std::filesystem::directory_iterator{dir}) {
+			std::string name = entry.path().filename().string();
+			bool active = name.compare(0, 6, "STATE_") == 0 && name.size() >= 6 + PLID_SIZE;
+			std::string plid = active ? name.substr(6, PLID_SIZE) : name; // (finished games: <plid>/)
+			if (plid.size() != PLID_SIZE || !net::is_valid_plid(plid))
+				continue;
+			if (shard >= 0 && shard_of(plid.c_str(), shards) != shard)
+				continue;
+			if (active)
+				has_active[presence_index(plid.c_str())] = true;
+			has_any[presence_index(plid.c_str())] = true;
+		}
+	}
+	presence_known = true;
+}
+
+/// Returns true if a bucket of the game directory changed (an entry was
+/// added, removed or renamed, as every change of the presence bitmaps
+/// does) at or after 'when'; false otherwise.
+/// Throws std::filesystem::filesystem_error if it could not be read.
+static bool buckets_changed_since(const timespec& when) {
+	for (const std::string& dir : bucket_dirs())
+		if (changed_since(dir, when))
+			return true;
+	return false;
+}
+
+/// Returns the plid of the game file (or finished games directory) at
+/// 'path', setting 'active' if it's an active game file; an empty view if
+/// it's not in the game directory.
+static std::string_view plid_of_path(std::string_view path, bool& active) {
+	if (path.compare(0, sizeof(DEFAULT_GAME_DIR), DEFAULT_GAME_DIR "/") != 0)
+		return {};
+	size_t slash = path.rfind('/');
+	std::string_view name = path.substr(slash + 1);
+	active = name.size() == 6 + PLID_SIZE + 4 && name.compare(0, 6, "STATE_") == 0;
+	if (active)
+		name = name.substr(6, PLID_SIZE);
+	else if (name.size() != PLID_SIZE) { // not <plid>/ => maybe <plid>/<end time>
+		size_t parent = path.rfind('/', slash - 1);
+		name = path.substr(parent + 1, slash - parent - 1);
+	}
+	if (name.size() != PLID_SIZE || !net::all_digits(name))
+		return {};
+	return name;
+}
+
+/// Drops games (the ones left from the snapshot, which were not used
+/// since the server started, then the ones used the longest ago) until
+/// there's room for one more.
+static void make_room() {
+	while (resident.size() + restored.size() >= max_resident && resident.size() + restored.size() != 0) {
+		resident_counts.evictions++;
+		if (!restored.empty()) {
+			restored.erase(std::begin(restored));
+			continue;
+		}
+		resident.erase(resident_used.back());
+		resident_used.pop_back();
+	}
+}
+
+/// Keeps 'gm' in memory as the game of 'plid' (the most recently used).
+static void keep_resident(const std::string& plid, const game& gm) {
+	auto it = resident.find(plid);
+	if (it != std::end(resident)) {
+		it->second.gm = gm;
+		resident_used.splice(std::begin(resident_used), resident_used, it->second.used);
+		return;
+	}
+	make_room();
+	resident_used.push_front(plid);
+	resident.insert({plid, {gm, std::begin(resident_used)}});
+}
+
+/// Returns the game of 'plid' kept in memory (now the most recently used);
+/// nullptr if it's not there.
+static const game* find_resident(const std::string& plid) {
+	auto it = resident.find(plid);
+	if (it == std::end(resident))
+		return nullptr;
+	resident_used.splice(std::begin(resident_used), resident_used, it->second.used);
+	return &it->second.gm;
+}
+
+/// Stops keeping the game of 'plid' in memory.
+static void forget_resident(const std::string& plid) {
+	auto it = resident.find(plid);
+	if (it == std::end(resident))
+		return;
+	resident_used.erase(it->second.used);
+	resident.erase(it);
+}
+
+/// Keeps 'text' as the transcript of the latest finished game of 'plid'
+/// (dropping any other one if there are too many).
+static void keep_finished(const std::string& plid, std::shared_ptr<const std::string> text) {
+	if (finished_transcripts.size() >= MAX_FINISHED_TRANSCRIPTS && finished_transcripts.count(plid) == 0)
+		finished_transcripts.erase(std::begin(finished_transcripts));
+	finished_transcripts.insert_or_assign(plid, std::move(text));
+}
+
+/// Moves the game of 'plid' from the snapshot to the resident games, if
+/// its file at 'path' did not change after the snapshot was taken (if it
+/// did, it must be read again).
+/// Returns true if it did; false otherwise.
+static bool restore(const std::string& plid, const std::string& path) {
+	auto it = restored.find(plid);
+	if (it == std::end(restored))
+		return false;
+	game gm = it->second;
+	restored.erase(it);
+	if (changed_since(path, restored_at)) // (gone => the game is over)
+		return false;
+	keep_resident(plid, gm);
+	return true;
+}
 
 scoreboard::record::record(uint8_t scr, const char id[PLID_SIZE],
 	const char key[GUESS_SIZE], char ntries) : tries{ntries}, score{scr} {
@@ -39,8 +288,10 @@ bool scoreboard::add_temp_record(record&& record) {
 }
 
 void scoreboard::add_record(record&& record) {
-	if (add_temp_record(std::move(record)))
-		return materialize(); // write if record was not discarded
+	if (!add_temp_record(std::move(record)))
+		return; // discarded
+	board_version++;
+	materialize();
 }
 
 bool scoreboard::empty() const {
@@ -48,12 +299,12 @@ bool scoreboard::empty() const {
 }
 
 std::string scoreboard::to_string() const {
-	std::ostringstream out;
+	net::format_buffer<MAX_TOP_SCORES * SCORE_LINE_SIZE> out;
 	for (const record& rec : _records) {
-		out << std::to_string(rec.score) << ' ';
-		out << std::string_view{rec.plid, PLID_SIZE} << ' ';
-		out << std::string_view{rec.code, GUESS_SIZE} << ' ';
-		out << rec.tries << '\n';
+		out.put(rec.score).put(' ');
+		out.put(std::string_view{rec.plid, PLID_SIZE}).put(' ');
+		out.put(std::string_view{rec.code, GUESS_SIZE}).put(' ');
+		out.put(rec.tries).put('\n');
 	}
 	return out.str();
 }
@@ -63,20 +314,17 @@ const std::string& scoreboard::start_time() const {
 }
 
 void scoreboard::materialize() {
-	std::fstream out{
-		DEFAULT_SCORE_DIR + ('/' + _start),
-		std::ios::out | std::ios::trunc
-	};
-	if (!out)
-		throw net::io_error{"Failed to materialize scoreboard"};
+	net::format_buffer<MAX_PATH_SIZE> path, temp_path;
+	path.put(score_dir).put('/').put(_start);
+	temp_path.put(score_dir).put("/.").put(_start); // not a valid time => ignored
+	net::format_buffer<MAX_TOP_SCORES * SCORE_LINE_SIZE> out;
 	for (const record& rec : _records) {
-		out << std::to_string(rec.score) << DEFAULT_SEP;
-		out << std::string_view{rec.plid, PLID_SIZE} << DEFAULT_SEP;
-		out << std::string_view{rec.code, GUESS_SIZE} << DEFAULT_SEP;
-		out << rec.tries << DEFAULT_EOM;
+		out.put(rec.score).put(DEFAULT_SEP);
+		out.put(std::string_view{rec.plid, PLID_SIZE}).put(DEFAULT_SEP);
+		out.put(std::string_view{rec.code, GUESS_SIZE}).put(DEFAULT_SEP);
+		out.put(rec.tries).put(DEFAULT_EOM);
 	}
-	if (!out)
-		throw net::io_error{"Failed to materialize scoreboard"};
+	disk->replace(path.str(), temp_path.str(), out.str());
 }
 
 static std::string get_latest_file(const std::string& dirp) {
@@ -118,40 +366,78 @@ static std::string get_latest_file(const std::string& dirp) {
 	return path;
 }
 
-scoreboard scoreboard::get_latest(bool keep_name) {
-	std::string fname = get_latest_file(DEFAULT_SCORE_DIR);
+scoreboard scoreboard::get_latest(bool keep_name, const std::string& latest) {
+	return read_latest(score_dir, keep_name, latest);
+}
+
+scoreboard scoreboard::read_latest(const std::string& dir, bool keep_name, const std::string& latest) {
+	std::string fname = latest.empty() ? get_latest_file(dir) : latest;
 	if (fname.empty())
 		return {}; // no files
-	std::string fullpath = DEFAULT_SCORE_DIR + ('/' + fname);
+	std::string fullpath = dir + ('/' + fname);
 	int fd = open(fullpath.c_str(), O_RDONLY);
 	if (fd == -1)
 		throw net::io_error{"Failed to open latest scoreboard file"};
 	scoreboard sb;
 	if (keep_name)
 		sb._start = std::move(fname);
+	char buf[SCORE_FILE_SIZE + 1];
+	std::string spill;
+	try {
+		if (!sb.scan(read_whole(fd, buf, sizeof(buf), spill))) { // not as written
+			sb._records.clear();
+			if (lseek(fd, 0, SEEK_SET) == -1)
+				throw net::io_error{"Failed to read scoreboard file"};
+			sb.parse(fd);
+		}
+	} catch (std::runtime_error& err) {
+		close(fd);
+		throw; // (as it is, not sliced)
+	}
+	if (close(fd) == -1)
+		throw net::io_error{"Failed to close scoreboard file"};
+	return sb;
+}
+
+bool scoreboard::scan(std::string_view text) {
+	net::text_scanner in{text};
+	std::string_view score, plid, code, tries;
+	while (!in.finished()) {
+		if (!in.field(score, 1, 3) || !in.field(plid, PLID_SIZE, PLID_SIZE)
+			|| !in.field(code, GUESS_SIZE, GUESS_SIZE) || !in.field(tries, 1, 1) || !in.end_line())
+			return false;
+		unsigned long value = 0;
+		if (!to_number(score, value) || !net::all_digits(plid) || !net::all_colors(code)
+			|| tries[0] < '1' || tries[0] > MAX_TRIALS)
+			return false;
+		add_temp_record({static_cast<uint8_t>(value), plid.data(), code.data(), tries[0]});
+	}
+	return true;
+}
+
+void scoreboard::parse(int fd) {
 	net::stream<net::file_source> in{{fd}};
 	while (true) {
-		net::message fields;
 		uint8_t score = 255;
+		net::expected<net::message> parsed = in.try_read({
+			{1, 3}, // score
+			{PLID_SIZE, PLID_SIZE}, // plid
+			{GUESS_SIZE, GUESS_SIZE}, // code
+			{1, 1}, // tries
+		});
+		if (!parsed && parsed.error().type == net::failure::kind::MISSING_EOM)
+			break; // reached the end
+		if (!parsed)
+			throw net::corruption_error{"Corrupted scoreboard file"};
+		const net::message& fields = *parsed;
 		try {
-			fields = in.read({
-				{1, 3}, // score
-				{PLID_SIZE, PLID_SIZE}, // plid
-				{GUESS_SIZE, GUESS_SIZE}, // code
-				{1, 1}, // tries
-			});
 			score = static_cast<uint8_t>(std::stoul(fields[0]));
 		} catch (std::out_of_range& err) {
 			throw net::corruption_error{"Corrupted score in scoreboard file"};
 		} catch (std::invalid_argument& err) {
 			throw net::corruption_error{"Corrupted score in scoreboard file"};
-		} catch (net::missing_eom& err) {
-			break; // reached the end
-		} catch (net::interaction_error& err) {
-			close(fd);
-			throw net::corruption_error{"Corrupted scoreboard file"};
 		}
-		sb.add_temp_record({
+		add_temp_record({
 			score,
 			fields[1].c_str(),
 			fields[2].c_str(),
@@ -159,9 +445,82 @@ scoreboard scoreboard::get_latest(bool keep_name) {
 		});
 		in.reset(); // reset input stream
 	}
-	if (close(fd) == -1)
-		throw net::io_error{"Failed to close scoreboard file"};
-	return sb;
+}
+
+int scoreboard::open_latest(std::string& name, size_t& size) {
+	std::string fname = get_latest_file(score_dir);
+	if (fname.empty())
+		return -1; // no files
+	std::string fullpath = score_dir + ('/' + fname);
+	int fd = open(fullpath.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw net::io_error{"Failed to open latest scoreboard file"};
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		throw net::io_error{"Failed to stat latest scoreboard file"};
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return -1; // empty scoreboard
+	}
+	name = std::move(fname);
+	size = static_cast<size_t>(st.st_size);
+	return fd;
+}
+
+std::string scoreboard::merged(std::string& name) {
+	std::vector<std::string> dirs{DEFAULT_SCORE_DIR};
+	try {
+		for (const auto& entry : std::filesystem::directory_iterator{DEFAULT_SCORE_DIR})
+			if (entry.is_directory())
+				dirs.push_back(entry.path().string());
+	} catch (std::exception& err) {
+		throw net::io_error{"Failed to list the shards' scoreboards"};
+	}
+	scoreboard all;
+	size_t latest = 0;
+	for (const std::string& dir : dirs) {
+		scoreboard sb = read_latest(dir, true);
+		if (sb.empty())
+			continue;
+		for (record& rec : sb._records)
+			all.add_temp_record(std::move(rec));
+		size_t start = std::stoul(sb._start); // a valid time (see get_latest_file)
+		if (start > latest) {
+			latest = start;
+			name = std::move(sb._start);
+		}
+	}
+	return all.to_string();
+}
+
+bool scoreboard::changed_since(uint64_t& version, std::string& name, std::string& sb) {
+	if (version == board_version)
+		return false;
+	version = board_version;
+	name = board._start;
+	sb = board.to_string();
+	return true;
+}
+
+bool scoreboard::merged_since(uint64_t& version, std::string& name, std::string& sb) {
+	static std::string last{}; // the merged scoreboard of 'last_version'
+	static std::string last_name{};
+	static uint64_t last_version = 0;
+	std::string latest_name;
+	std::string latest = merged(latest_name);
+	if (last_version == 0 || latest != last) {
+		last = std::move(latest);
+		last_name = std::move(latest_name);
+		last_version++;
+	}
+	if (version == last_version)
+		return false;
+	version = last_version;
+	name = last_name;
+	sb = last;
+	return true;
 }
 
 uint8_t game::score() const {
@@ -191,11 +550,13 @@ game::result game::guess(char play[GUESS_SIZE]) {
 	_trials[_curr_trial - '0'].nB = nB;
 	_trials[_curr_trial - '0'].nW = nW;
 	_trials[_curr_trial - '0'].when = static_cast<uint16_t>(std::difftime(std::time(nullptr), _start));
-	std::fstream out{get_active_path(_plid), std::ios::out | std::ios::app};
-	if (!out)
-		throw net::io_error{"Could not write guess to disk"};
+	render_trial(_curr_trial - '0');
+	net::format_buffer<TRIAL_RECORD_SIZE> out;
 	write_trial(_curr_trial - '0', out);
+	disk->append(get_active_path(_plid), out.str());
 	_curr_trial++;
+	keep_resident(std::string{_plid, PLID_SIZE}, *this);
+	track();
 	return has_ended();
 }
 
@@ -240,12 +601,12 @@ game::result game::has_ended() {
 	_end = std::time(nullptr);
 	if (_end > _start + _duration) // cap the time
 		_end = _start + _duration;
-	std::fstream out{get_active_path(_plid), std::ios::out | std::ios::app};
-	if (!out) {
+	try {
+		terminate(); // write game to disk
+	} catch (net::io_error& err) {
 		_ended = result::ONGOING;
-		throw net::io_error{"Could not write game to disk"};
+		throw;
 	}
-	terminate(out); // write game to disk
 	return _ended;
 }
 
@@ -258,12 +619,12 @@ void game::quit() {
 	_end = std::time(nullptr);
 	if (_end > _start + _duration) // cap the time just in case
 		_end = _start + _duration;
-	std::fstream out{get_active_path(_plid), std::ios::out | std::ios::app};
-	if (!out) {
+	try {
+		terminate(); // write game to disk
+	} catch (net::io_error& err) {
 		_ended = result::ONGOING;
-		throw net::io_error{"Could not write game to disk"};
+		throw;
 	}
-	return terminate(out); // write game to disk
 }
 
 const char* game::secret_key() const {
@@ -308,92 +669,179 @@ size_t game::time_elapsed() const {
 	return diff;
 }
 
-std::string game::to_string() const {
-	std::ostringstream out;
-	for (int i = 0; i < _curr_trial - '0'; i++) {
-		for (int j = 0; j < GUESS_SIZE; j++)
-			out << _trials[i].trial[j] << ' ';
-		out << static_cast<char>(_trials[i].nB + '0') << ' ';
-		out << static_cast<char>(_trials[i].nW + '0') << '\n';
+void game::render_trial(uint8_t trial) {
+	char* line = _transcript + trial * TRIAL_LINE_SIZE;
+	for (int j = 0; j < GUESS_SIZE; j++) {
+		*line++ = _trials[trial].trial[j];
+		*line++ = ' ';
 	}
+	*line++ = static_cast<char>(_trials[trial].nB + '0');
+	*line++ = ' ';
+	*line++ = static_cast<char>(_trials[trial].nW + '0');
+	*line = '\n';
+}
+
+std::string game::to_string() const {
+	std::string out{_transcript, static_cast<size_t>(_curr_trial - '0') * TRIAL_LINE_SIZE};
 	if (_curr_trial == '0')
-		out << "No trials found\n";
+		out += "No trials found\n";
 	if (_ended == result::ONGOING) { // write seconds left
-		out << std::to_string(time_left());
-		out << "s\n";
+		out += net::decimal(time_left()).view();
+		out += "s\n";
 	}
-	return out.str();
+	return out;
+}
+
+bool game::operator==(const game& other) const {
+	if (memcmp(_plid, other._plid, PLID_SIZE) != 0 || _mode != other._mode
+		|| memcmp(_secret_key, other._secret_key, GUESS_SIZE) != 0 || _duration != other._duration
+		|| _start != other._start || _curr_trial != other._curr_trial || _ended != other._ended
+		|| (_ended != result::ONGOING && _end != other._end)) // (an ongoing game has no end yet)
+		return false;
+	for (int i = 0; i < _curr_trial - '0'; i++) {
+		const trial_record& mine = _trials[i];
+		const trial_record& theirs = other._trials[i];
+		if (memcmp(mine.trial, theirs.trial, GUESS_SIZE) != 0 || mine.nB != theirs.nB
+			|| mine.nW != theirs.nW || mine.when != theirs.when)
+			return false;
+	}
+	return memcmp(_transcript, other._transcript, (_curr_trial - '0') * TRIAL_LINE_SIZE) == 0;
 }
 
 std::string game::get_active_path(const char valid_plid[PLID_SIZE]) {
-	return DEFAULT_GAME_DIR + ("/STATE_" + std::string{valid_plid, PLID_SIZE}) + ".txt";
+	net::format_buffer<MAX_PATH_SIZE> path;
+	path.put(bucket_of(valid_plid)).put("STATE_").put(std::string_view{valid_plid, PLID_SIZE}).put(".txt");
+	return path.str();
 }
 
 std::string game::get_final_path(const char valid_plid[PLID_SIZE]) {
-	return DEFAULT_GAME_DIR + ('/' + std::string{valid_plid, PLID_SIZE});
+	net::format_buffer<MAX_PATH_SIZE> path;
+	path.put(bucket_of(valid_plid)).put(std::string_view{valid_plid, PLID_SIZE});
+	return path.str();
 }
 
 game game::create(const char valid_plid[PLID_SIZE], uint16_t duration) {
+	return try_create(valid_plid, duration).value();
+}
+
+game game::create(const char valid_plid[PLID_SIZE], uint16_t duration, const char secret_key[GUESS_SIZE]) {
+	return try_create(valid_plid, duration, secret_key).value();
+}
+
+net::expected<game> game::try_create(const char valid_plid[PLID_SIZE], uint16_t duration) {
 	game gm{valid_plid, duration};
-	gm.create();
+	net::failure failed = gm.create();
+	if (failed.type != net::failure::kind::NONE)
+		return failed;
 	return gm;
 }
 
-game game::create(const char valid_plid[PLID_SIZE], uint16_t duration, const char secret_key[GUESS_SIZE]) {
+net::expected<game> game::try_create(const char valid_plid[PLID_SIZE], uint16_t duration,
+									const char secret_key[GUESS_SIZE]) {
 	game gm{valid_plid, duration, secret_key};
-	gm.create();
+	net::failure failed = gm.create();
+	if (failed.type != net::failure::kind::NONE)
+		return failed;
 	return gm;
 }
 
-void game::create() {
-	std::string path = DEFAULT_GAME_DIR + ("/STATE_" + std::string{_plid, PLID_SIZE}) + ".txt";
+net::failure game::create() {
+	std::string path = get_active_path(_plid);
 	bool exists = false;
 	try {
-		exists = std::filesystem::exists(path);
+		exists = has_active[presence_index(_plid)]
+			&& (resident.count(std::string{_plid, PLID_SIZE}) != 0 || std::filesystem::exists(path));
 	} catch (std::exception& err) {
 		throw net::io_error{"Failed while checking if game existed"};
 	}
 	if (exists) {
-		result existing_res = result::QUIT;
-		try { // move game if it ended
-			existing_res = find_active(_plid).has_ended();
-		} catch (net::game_error& err) {} // ignore "No active games"
-		if (existing_res == result::ONGOING)
-			throw net::game_error{"Ongoing game"};
-	}
-	std::fstream out{path, std::ios::out};
-	if (!out)
-		throw net::io_error{"Failed to open game file"};
-	out << std::string_view{_plid, PLID_SIZE} << DEFAULT_SEP << _mode;
-	out << DEFAULT_SEP << std::string_view{_secret_key, GUESS_SIZE} << DEFAULT_SEP << _duration << DEFAULT_SEP;
-	out << _start << DEFAULT_EOM << std::flush; /// write header to disk
-	if (!out)
-		throw net::io_error{"Failed to write header to disk"};
+		net::expected<game> existing = try_find_active(_plid); // (which ends it, if it's over)
+		if (existing && existing->has_ended() == result::ONGOING)
+			return {net::failure::kind::GAME, "Ongoing game"};
+	}
+	net::format_buffer<GAME_HEADER_SIZE> out;
+	out.put(std::string_view{_plid, PLID_SIZE}).put(DEFAULT_SEP).put(_mode);
+	out.put(DEFAULT_SEP).put(std::string_view{_secret_key, GUESS_SIZE}).put(DEFAULT_SEP).put(_duration).put(DEFAULT_SEP);
+	out.put(_start).put(DEFAULT_EOM);
+	for (const std::string& dir : bucket_chain(_plid)) // (see layout.hpp)
+		disk->make_dir(dir);
+	disk->write(std::move(path), out.str()); /// write header to disk
+	has_active[presence_index(_plid)] = true;
+	has_any[presence_index(_plid)] = true;
+	restored.erase(std::string{_plid, PLID_SIZE}); // (an older game)
+	keep_resident(std::string{_plid, PLID_SIZE}, *this);
+	track();
+	return {};
+}
+
+void game::track() const {
+	sessions.update(static_cast<uint32_t>(presence_index(_plid)), _start, _duration, _curr_trial - '0', _mode);
 }
 
 game game::find_active(const char valid_plid[PLID_SIZE]) {
+	return try_find_active(valid_plid).value();
+}
+
+net::expected<game> game::try_find_active(const char valid_plid[PLID_SIZE]) {
+	if (!has_active[presence_index(valid_plid)])
+		return net::failure{net::failure::kind::GAME, "No active games"};
+	std::string plid{valid_plid, PLID_SIZE};
 	std::string path = get_active_path(valid_plid);
+	const game* kept = find_resident(plid);
+	if (!kept && restore(plid, path))
+		kept = find_resident(plid);
+	if (kept) {
+		resident_counts.hits++;
+		game res = *kept;
+		res.has_ended(); // may end the game
+		return res;
+	}
+	net::expected<game> res = try_read(path);
+	if (!res)
+		return res;
+	resident_counts.misses++;
+	keep_resident(plid, *res);
+	res->track();
+	res->has_ended(); // may end the game
+	return res;
+}
+
+game game::read(const std::string& path) {
+	return try_read(path).value();
+}
+
+net::expected<game> game::try_read(const std::string& path) {
 	int fd = open(path.c_str(), O_RDONLY);
 	if (fd == -1) {
 		if (errno == ENOENT) // NO ENTRY errno
-			throw net::game_error{"No active games"};
+			return net::failure{net::failure::kind::GAME, "No active games"};
 		throw net::io_error{"Failed to open game file"};
 	}
-	net::stream<net::file_source> in{{fd}};
 	game res;
 	try {
-		res = parse(in);
+		res = parse(fd);
 	} catch (std::runtime_error& err) {
 		close(fd);
-		throw err;
+		throw; // (as it is, not sliced)
 	}
 	if (close(fd) == -1)
 		throw net::io_error{"Failed to close game file"};
-	res.has_ended(); // may end the game
 	return res;
 }
 
+bool game::recover(game gm, const timespec& read_at) {
+	std::string plid{gm._plid, PLID_SIZE};
+	if (resident.count(plid) != 0 || changed_since(get_active_path(gm._plid), read_at))
+		return false; // (if it changed, it's read again when needed)
+	restored.erase(plid);
+	keep_resident(plid, gm);
+	gm.track();
+	return gm.has_ended() != result::ONGOING; // (if so, it's finished and forgotten)
+}
+
 game game::find_any(const char valid_plid[PLID_SIZE]) {
+	if (!has_any[presence_index(valid_plid)])
+		throw net::game_error{"No recorded games"};
 	game res;
 	try {
 		return find_active(valid_plid);
@@ -408,18 +856,92 @@ game game::find_any(const char valid_plid[PLID_SIZE]) {
 			throw net::game_error{"No recorded games"};
 		throw net::io_error{"Failed to open game file"};
 	}
-	net::stream<net::file_source> in{{fd}};
 	try {
-		res = parse(in);
+		res = parse(fd);
 	} catch (std::runtime_error& err) {
 		close(fd);
-		throw err;
+		throw; // (as it is, not sliced)
 	}
 	if (close(fd) == -1)
 		throw net::io_error{"Failed to close game file"};
 	return res;
 }
 
+std::shared_ptr<const std::string> game::transcript(const char valid_plid[PLID_SIZE], bool& finished) {
+	std::string plid{valid_plid, PLID_SIZE};
+	if (!has_active[presence_index(valid_plid)]) {
+		auto it = finished_transcripts.find(plid);
+		if (it != std::end(finished_transcripts)) {
+			finished = true;
+			return it->second;
+		}
+	}
+	game gm = find_any(valid_plid);
+	finished = gm.has_ended() != result::ONGOING;
+	auto res = std::make_shared<const std::string>(gm.to_string());
+	if (finished)
+		keep_finished(plid, res);
+	return res;
+}
+
+game game::parse(int fd) {
+	char buf[GAME_FILE_SIZE + 1];
+	std::string spill;
+	game res;
+	if (scan(read_whole(fd, buf, sizeof(buf), spill), res))
+		return res;
+	if (lseek(fd, 0, SEEK_SET) == -1) // not as written
+		throw net::io_error{"Failed to read game file"};
+	net::stream<net::file_source> in{{fd}};
+	return parse(in);
+}
+
+bool game::scan(std::string_view text, game& gm) {
+	net::text_scanner in{text};
+	std::string_view plid, mode, key, duration, start;
+	if (!in.field(plid, PLID_SIZE, PLID_SIZE) || !in.field(mode, 1, 1)
+		|| !in.field(key, GUESS_SIZE, GUESS_SIZE) || !in.field(duration, 1, MAX_PLAYTIME_SIZE)
+		|| !in.field(start, 1, MAX_NUMBER_SIZE) || !in.end_line())
+		return false;
+	if (!net::all_digits(plid) || (mode[0] != 'P' && mode[0] != 'D') || !net::all_colors(key)
+		|| !to_number(duration, gm._duration) || !to_number(start, gm._start))
+		return false;
+	std::copy(std::begin(plid), std::end(plid), gm._plid);
+	gm._mode = mode[0];
+	std::copy(std::begin(key), std::end(key), gm._secret_key);
+	std::string_view number, guess, nB, nW, when, end;
+	while (!in.finished()) {
+		if (!in.field(number, 1, 1))
+			return false;
+		if (number[0] != gm._curr_trial + 1 || gm._curr_trial == MAX_TRIALS)
+			break; // (not the next trial => the termination reason)
+		trial_record& trial = gm._trials[gm._curr_trial - '0'];
+		if (!in.field(guess, GUESS_SIZE, GUESS_SIZE) || !in.field(nB, 1, 1) || !in.field(nW, 1, 1)
+			|| !in.field(when, 1, MAX_PLAYTIME_SIZE) || !in.end_line())
+			return false;
+		if (!net::all_colors(guess) || !net::all_digits(nB) || !net::all_digits(nW) || !to_number(when, trial.when))
+			return false;
+		std::copy(std::begin(guess), std::end(guess), trial.trial);
+		trial.nB = nB[0] - '0';
+		trial.nW = nW[0] - '0';
+		gm.render_trial(gm._curr_trial - '0');
+		gm._curr_trial++;
+	}
+	if (in.finished())
+		return true; // ongoing
+	switch (number[0]) {
+	case static_cast<char>(result::LOST_TRIES):
+	case static_cast<char>(result::LOST_TIME):
+	case static_cast<char>(result::WON):
+	case static_cast<char>(result::QUIT):
+		gm._ended = static_cast<result>(number[0]);
+		break;
+	default:
+		return false;
+	}
+	return in.field(end, 1, MAX_NUMBER_SIZE) && in.end_line() && in.finished() && to_number(end, gm._end);
+}
+
 game game::parse(net::stream<net::file_source>& in) {
 	net::message r;
 	try {
@@ -449,13 +971,10 @@ game game::parse(net::stream<net::file_source>& in) {
 	bool finished = false;
 	std::string trial_number;
 	for (int i = 0; i < MAX_TRIALS - '0' + 1; i++) {
-		try {
-			trial_number = in.read(1, 1);
-		} catch (net::missing_eom& err) {
+		net::expected<net::field> number = in.try_read(1, 1);
+		if (!number && number.error().type == net::failure::kind::MISSING_EOM)
 			break; // reached end of trials
-		} catch (net::corruption_error& err) {
-			throw net::corruption_error{"Corrupted game file"};
-		}
+		trial_number = std::move(number.value());
 		if (trial_number[0] < '1' || trial_number[0] > MAX_TRIALS) {
 			finished = true; // reached the termination reason
 			break;
@@ -482,6 +1001,7 @@ game game::parse(net::stream<net::file_source>& in) {
 		} catch (std::out_of_range& err) {
 			throw net::corruption_error{"Read bad trial time"};
 		}
+		gm.render_trial(i);
 		gm._curr_trial++;
 		in.reset(); // reset stream state
 	}
@@ -513,11 +1033,72 @@ game game::parse(net::stream<net::file_source>& in) {
 	return gm;
 }
 
-int setup() {
+void limit_resident(size_t bytes) {
+	max_resident = std::max<size_t>(1, bytes / (sizeof(resident_game) + RESIDENT_GAME_OVERHEAD));
+}
+
+resident_stats get_resident_stats() {
+	resident_stats res = resident_counts;
+	res.games = resident.size() + restored.size();
+	return res;
+}
+
+size_t expire_games() {
+	std::vector<uint32_t> expired;
+	sessions.expired(std::time(nullptr), expired);
+	size_t ended = 0;
+	for (uint32_t index : expired) {
+		char plid[PLID_SIZE];
+		for (uint32_t i = PLID_SIZE, left = index; i-- > 0; left /= 10)
+			plid[i] = static_cast<char>('0' + left % 10);
+		try {
+			if (game::find_active(plid).has_ended() != game::result::ONGOING) // (ends it)
+				ended++;
+		} catch (net::game_error& err) { // its file is gone
+			sessions.erase(index);
+		} catch (std::exception& err) {} // tried again by the next sweep
+	}
+	return ended;
+}
+
+session_stats get_session_stats() {
+	return sessions.stats();
+}
+
+void track_replicated(storage::kind type, const std::string& file, const std::string& other) {
+	bool active = false;
+	std::string_view plid = plid_of_path(file, active);
+	if (!plid.empty()) {
+		size_t index = presence_index(plid.data());
+		has_any[index] = true;
+		if (active)
+			has_active[index] = type != storage::kind::RENAME; // (renamed => finished)
+	}
+	if (type == storage::kind::RENAME) {
+		plid = plid_of_path(other, active);
+		if (!plid.empty())
+			has_any[presence_index(plid.data())] = true;
+	}
+	presence_known = true;
+}
+
+int setup(storage& engine, int shard, int shards, const std::string& latest_board) {
+	disk = &engine;
+	if (shard >= 0) {
+		net::format_buffer<MAX_PATH_SIZE> path;
+		score_dir = path.put(DEFAULT_SCORE_DIR "/").put(shard).str();
+		path.clear();
+		snapshot_path = path.put(DEFAULT_SNAPSHOT_DIR "/").put(shard).put("_of_").put(shards).str();
+	}
 	try {
 		std::filesystem::create_directory(DEFAULT_GAME_DIR);
 		std::filesystem::create_directory(DEFAULT_SCORE_DIR);
-		board = scoreboard::get_latest(false);
+		std::filesystem::create_directory(score_dir);
+		std::filesystem::create_directory(DEFAULT_SNAPSHOT_DIR);
+		if (!snapshot_file::load(snapshot_path))
+			board = scoreboard::get_latest(false, latest_board);
+		if (!presence_known)
+			scan_presence(shard, shards);
 	} catch (std::exception& err){
 		std::cout << "Setup error: " << err.what() << '\n';
 		return 1;
@@ -525,40 +1106,184 @@ int setup() {
 	return 0;
 }
 
-void game::write_trial(uint8_t trial, std::ostream& out) const {
-	out << static_cast<char>(trial + '1') << DEFAULT_SEP;
-	out << std::string_view{_trials[trial].trial, GUESS_SIZE} << DEFAULT_SEP;
-	out << std::to_string(_trials[trial].nB) << DEFAULT_SEP;
-	out << std::to_string(_trials[trial].nW) << DEFAULT_SEP;
-	out << std::to_string(time_elapsed()) << DEFAULT_EOM << std::flush;
-	if (!out)
-		throw net::io_error{"Failed to write trial"};
+void game::write_trial(uint8_t trial, net::format_buffer<TRIAL_RECORD_SIZE>& out) const {
+	out.put(static_cast<char>(trial + '1')).put(DEFAULT_SEP);
+	out.put(std::string_view{_trials[trial].trial, GUESS_SIZE}).put(DEFAULT_SEP);
+	out.put(_trials[trial].nB).put(DEFAULT_SEP);
+	out.put(_trials[trial].nW).put(DEFAULT_SEP);
+	out.put(time_elapsed()).put(DEFAULT_EOM);
 }
 
-void game::terminate(std::ostream& out) {
+void game::terminate() {
 	if (_ended == result::ONGOING)
 		throw net::game_error{"Tried to ilegally terminate an ongoing game"};
-	out << static_cast<char>(_ended) << DEFAULT_SEP;
-	out << _end << DEFAULT_EOM << std::flush;
-	if (!out)
-		throw net::io_error{"Failed to write termination reason"};
-	bool failed = false;
-	try { // move to final directory
-		std::stringstream path;
-		std::string final_dir = get_final_path(_plid);
-		std::filesystem::create_directory(final_dir);
-		path << final_dir << '/';
-		path << static_cast<size_t>(_end);
-		if (!path)
-			failed = true;
-		else
-			std::filesystem::rename(get_active_path(_plid), path.str());
-	} catch (std::exception& err) {
-		throw net::io_error{"Failed to terminate game in disk"};
-	}
-	if (failed)
-		throw net::io_error{"Failed to write end time"};
+	net::format_buffer<GAME_END_SIZE> out;
+	out.put(static_cast<char>(_ended)).put(DEFAULT_SEP);
+	out.put(_end).put(DEFAULT_EOM);
+	std::string active_path = get_active_path(_plid);
+	std::string final_dir = get_final_path(_plid);
+	net::format_buffer<MAX_PATH_SIZE> final_path;
+	final_path.put(final_dir).put('/').put(static_cast<size_t>(_end));
+	disk->append(active_path, out.str());
+	disk->make_dir(std::move(final_dir)); // move to final directory
+	disk->rename(std::move(active_path), final_path.str());
+	forget_resident(std::string{_plid, PLID_SIZE});
+	keep_finished(std::string{_plid, PLID_SIZE}, std::make_shared<const std::string>(to_string()));
+	sessions.erase(static_cast<uint32_t>(presence_index(_plid)));
+	has_active[presence_index(_plid)] = false;
 	if (_ended != result::WON)
 		return; // do not add to scoreboard if not a win
 	board.add_record({score(), _plid, _secret_key, _curr_trial});
 }
+
+bool snapshot(bool background) {
+	timespec taken;
+	if (!background) { // (nothing changes after it => a tick later, the changes before it are older)
+		clock_getres(CLOCK_REALTIME_COARSE, &taken);
+		nanosleep(&taken, nullptr);
+	}
+	clock_gettime(CLOCK_REALTIME_COARSE, &taken); // (the clock of file times => changes after it are never older)
+	std::string temp_path = snapshot_path + ".tmp";
+	std::unique_ptr<char[]> buf{new char[SNAPSHOT_BUFFER_SIZE]}; // (the child must not allocate)
+	if (!background)
+		return snapshot_file::write(snapshot_path.c_str(), temp_path.c_str(), taken, buf.get());
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid != -1; // (SIGCHLD is ignored => no zombies)
+	_exit(snapshot_file::write(snapshot_path.c_str(), temp_path.c_str(), taken, buf.get()) ? 0 : 1);
+}
+
+bool snapshot_file::write(const char* path, const char* temp_path, const timespec& taken, char* buf) {
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return false;
+	size_t used = 0;
+	bool ok = true;
+	auto flush = [&]() {
+		size_t done = 0;
+		while (ok && done < used) {
+			ssize_t n = ::write(fd, buf + done, used - done);
+			if (n == -1 && errno != EINTR)
+				ok = false;
+			else if (n > 0)
+				done += n;
+		}
+		used = 0;
+	};
+	auto put = [&](const void* data, size_t size) { // (every piece fits the buffer)
+		if (used + size > SNAPSHOT_BUFFER_SIZE)
+			flush();
+		memcpy(buf + used, data, size);
+		used += size;
+	};
+	uint64_t game_size = sizeof(game);
+	put(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+	put(&game_size, sizeof(game_size));
+	put(&taken, sizeof(taken));
+	uint64_t count = board._records.size();
+	put(&count, sizeof(count));
+	for (const scoreboard::record& rec : board._records)
+		put(&rec, sizeof(rec));
+	count = resident.size() + restored.size();
+	put(&count, sizeof(count));
+	for (const auto& [plid, kept] : resident)
+		put(&kept.gm, sizeof(kept.gm));
+	for (const auto& [plid, gm] : restored)
+		put(&gm, sizeof(gm));
+	for (const std::vector<bool>* bits : {&has_active, &has_any}) {
+		for (size_t i = 0; i < MAX_PLIDS; i += 8) {
+			uint8_t byte = 0;
+			for (size_t j = i; j < i + 8 && j < MAX_PLIDS; j++)
+				byte |= (*bits)[j] << (j - i);
+			put(&byte, sizeof(byte));
+		}
+	}
+	flush();
+	if (ok && fdatasync(fd) == -1)
+		ok = false;
+	if (close(fd) == -1 || !ok || ::rename(temp_path, path) == -1) {
+		unlink(temp_path);
+		return false;
+	}
+	return true;
+}
+
+bool snapshot_file::load(const std::string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return false; // no snapshot yet
+		throw net::io_error{"Failed to open snapshot"};
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		throw net::io_error{"Failed to read snapshot"};
+	}
+	std::string data(st.st_size, '\0');
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = read(fd, data.data() + done, data.size() - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			close(fd);
+			throw net::io_error{"Failed to read snapshot"};
+		}
+		done += n;
+	}
+	close(fd);
+	const char* at = data.data();
+	const char* end = at + data.size();
+	auto get = [&](void* out, size_t size) {
+		if (static_cast<size_t>(end - at) < size)
+			throw net::corruption_error{"Truncated snapshot"};
+		memcpy(out, at, size);
+		at += size;
+	};
+	char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+	uint64_t game_size;
+	get(magic, sizeof(magic));
+	get(&game_size, sizeof(game_size));
+	if (memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 || game_size != sizeof(game))
+		return false; // not ours => ignore it
+	timespec taken;
+	get(&taken, sizeof(taken));
+	uint64_t count;
+	get(&count, sizeof(count));
+	scoreboard sb;
+	for (uint64_t i = 0; i < count; i++) {
+		scoreboard::record rec{0, "000000", "RRRR", '0'};
+		get(&rec, sizeof(rec));
+		sb.add_temp_record(std::move(rec));
+	}
+	get(&count, sizeof(count));
+	restored.clear();
+	restored.reserve(std::min<uint64_t>(count, max_resident));
+	for (uint64_t i = 0; i < count; i++) {
+		game gm;
+		get(&gm, sizeof(gm));
+		std::string plid{gm._plid, PLID_SIZE};
+		if (!net::is_valid_plid(plid))
+			throw net::corruption_error{"Read bad plid in snapshot"};
+		if (restored.size() < max_resident) // (the others are read when needed)
+			restored.insert_or_assign(plid, gm);
+		gm.track();
+	}
+	restored_at = taken;
+	if (static_cast<size_t>(end - at) != 2 * ((MAX_PLIDS + 7) / 8))
+		throw net::corruption_error{"Bad presence bitmaps in snapshot"};
+	if (!presence_known && !buckets_changed_since(taken)) {
+		for (std::vector<bool>* bits : {&has_active, &has_any}) {
+			for (size_t i = 0; i < MAX_PLIDS; i++)
+				(*bits)[i] = (at[i / 8] >> (i % 8)) & 1;
+			at += (MAX_PLIDS + 7) / 8;
+		}
+		presence_known = true;
+	}
+	// the scores directory changes (its mtime) whenever a scoreboard is saved
+	if (changed_since(score_dir, taken))
+		return false; // saved after the snapshot => read it
+	board = std::move(sb);
+	return true;
+}
@@ -2,12 +2,19 @@
 #define _GAME_HPP_
 
 #include "../common/common.hpp"
+#include "sessions.hpp"
+#include "storage.hpp"
 
 #include <ctime>
+#include <memory>
 
 #define DEFAULT_GAME_DIR "GAMES"
 #define DEFAULT_SCORE_DIR "SCORES"
+#define DEFAULT_SNAPSHOT_DIR "SNAPSHOTS"
 #define MAX_TOP_SCORES 10
+#define TRIAL_RECORD_SIZE (GUESS_SIZE + MAX_PLAYTIME_SIZE + 8) // a trial in a game file ("1 RGBY 2 0 123\n")
+#define TRIAL_LINE_SIZE (2 * GUESS_SIZE + 4) // a trial in a transcript ("R G B Y 1 2\n")
+#define MAX_FINISHED_TRANSCRIPTS 16384 // kept rendered (see game::transcript)
 
 /// Sets up the game and score directories and intializes the scoreboard.
 /// Note that the scoreboard keeps track of the top scores that were played
@@ -15,7 +22,74 @@
 /// For instance, if the server initially had n scores stored in its
 /// scoreboard and was then shut down, it would remember those n scores
 /// the next time it ran, provided the file was correctly saved.
-int setup();
+/// Every file is then written through 'disk'.
+/// Shard 'shard' of a sharded server (see shard.hpp) keeps its scoreboard
+/// in its own subdirectory of the score directory.
+/// If the name of the latest scoreboard file is already known (e.g. by a
+/// standby, see replica.hpp), 'latest_board' saves looking for it.
+/// If there is a snapshot (see snapshot()), the active games and the
+/// scoreboard are loaded from it instead.
+/// It also knows which players have an active game, and which have any
+/// game at all, so that looking for the games of the others never touches
+/// the disk (see find_active and find_any): from what a standby applied
+/// (see track_replicated), or else from the snapshot (if no bucket of the
+/// game directory changed since it was taken), or else by listing the game
+/// directory (for the shard's players only).
+int setup(storage& disk, int shard = -1, int shards = 1, const std::string& latest_board = "");
+
+/// Keeps track of the players that have an active game, and of the ones
+/// that have any game, from an operation of type 'type' on 'file' (and
+/// 'other') that a standby applied for its primary (see replica.hpp), so
+/// that it takes over (see setup) without listing the game directory.
+void track_replicated(storage::kind type, const std::string& file, const std::string& other);
+
+/// How the active games kept in memory were used (see limit_resident).
+struct resident_stats {
+	uint64_t hits; // games found in memory
+	uint64_t misses; // games read from their files
+	uint64_t evictions; // games dropped to make room
+	size_t games; // in memory now
+};
+
+/// Keeps at most about 'bytes' worth of active games in memory (they're
+/// kept once read, see game::find_active). Past that, the game used the
+/// longest ago is dropped, and read again from its file if it's needed.
+/// Must be called before setup() (which may load a snapshot of them).
+void limit_resident(size_t bytes);
+
+/// Returns how the active games kept in memory were used.
+resident_stats get_resident_stats();
+
+/// Ends every active game whose time ran out (which writes it to disk),
+/// found by a scan of the session table (see sessions.hpp), instead of
+/// waiting for its player to use it again.
+/// The table holds the games created, used, recovered or loaded from a
+/// snapshot since the server started (the others still end when used).
+/// Must run where the games are used (the executor's worker).
+/// Returns the number of games ended.
+size_t expire_games();
+
+/// Returns what the active games in the session table add up to.
+session_stats get_session_stats();
+
+/// Saves the active games (which are kept in memory once read), the
+/// scoreboard and which players have games (see setup) to a single
+/// snapshot file, which setup() loads the next
+/// time the server starts.
+/// Games whose file changed after the snapshot was taken are read again
+/// (from their file) the first time they're needed, and games created
+/// after it are found in their files as usual, so an old snapshot is
+/// never wrong, just less useful.
+/// In the 'background', a forked child writes the snapshot from its
+/// (copy-on-write) view of memory while the server goes on; otherwise
+/// (once the server stopped changing files), it's written before
+/// returning. The child only copies memory into a
+/// buffer allocated before the fork and makes system calls (it never
+/// allocates nor locks, as a child of a multithreaded process must not).
+/// Must run where the games are used (the executor's worker).
+/// Returns false if it could not fork (or, in the foreground, write the
+/// snapshot); true otherwise.
+bool snapshot(bool background = true);
 
 /// Stores the top MAX_TOP_SCORES scores of all games, ordered by
 /// number of trials needed to win the game.
@@ -52,8 +126,56 @@ struct scoreboard {
 	/// If keep_name is enabled, the 'start_time' of the current
 	/// scoreboard will be the same as the one read in from disk.
 	/// Otherwise, it's initialized to the current time.
-	static scoreboard get_latest(bool keep_name = true);
+	/// If 'latest' is set, it's the name of the latest file (so there is
+	/// no need to look for it).
+	static scoreboard get_latest(bool keep_name = true, const std::string& latest = "");
+
+	/// Opens the latest scoreboard file of the scores directory, so
+	/// that it can be sent as is (the file is already in the format
+	/// returned by to_string()).
+	/// On success, 'name' is set to the scoreboard's start time and
+	/// 'size' to the size of the file. The caller must close the file.
+	/// Returns -1 if there is no (non empty) scoreboard.
+	/// Throws:
+	/// 1. io_error if the file exists but could not be opened.
+	static int open_latest(std::string& name, size_t& size);
+
+	/// Merges the latest scoreboards of every shard (and of the server,
+	/// when it is not sharded) and returns it as to_string() would.
+	/// 'name' is set to the start time of the latest one that is not
+	/// empty (left as is if they are all empty).
+	/// Throws:
+	/// 1. io_error if a scoreboard could not be read.
+	/// 2. corruption_error if a scoreboard is corrupted.
+	static std::string merged(std::string& name);
+
+	/// Checks whether the top list of this server's scoreboard changed
+	/// since 'version' (0 before the first check). If it did, 'version'
+	/// is updated, 'name' set to its start time and 'sb' to it (as
+	/// to_string() returns it; empty if no game was won yet).
+	/// Must only be called from the worker that adds the records.
+	/// Returns true if it changed; false otherwise.
+	static bool changed_since(uint64_t& version, std::string& name, std::string& sb);
+
+	/// Same as changed_since, but for the merged scoreboard of every
+	/// shard (see merged), which is read again to tell if it changed.
+	/// Throws the same as merged.
+	static bool merged_since(uint64_t& version, std::string& name, std::string& sb);
+
+	/// Adds the records of the whole scoreboard file 'text', a word at a
+	/// time (see scan.hpp), provided it is exactly as the server writes it.
+	/// Returns false if it's not (leaving some records added).
+	bool scan(std::string_view text);
+
+	/// Adds the records of the scoreboard file 'fd', a field at a time.
+	/// Throws corruption_error if the file is corrupted.
+	void parse(int fd);
 private:
+	friend struct snapshot_file;
+
+	/// Reads the latest scoreboard in 'dir' (see get_latest).
+	static scoreboard read_latest(const std::string& dir, bool keep_name, const std::string& latest = "");
+
 	/// Finds where record 'g' should go relative to all other records
 	/// in the scoreboard.
     size_t find(const record& g);
@@ -62,7 +184,8 @@ private:
 	/// but does not write the updated scoreaboard to disk.
 	bool add_temp_record(record&& record);
 
-	/// Writes the scoreboard to disk.
+	/// Writes the scoreboard to disk. The file is replaced atomically,
+	/// so readers never see a partially written scoreboard.
 	/// Throws:
 	/// 1. io_error if writing to disk fails.
 	void materialize();
@@ -131,26 +254,94 @@ struct game {
 
 	/// Returns the game in a human readable format, ready to be
 	/// sent to the final user.
+	/// The trials are rendered as they're played (see guess), so only the
+	/// time left (of an ongoing game) is formatted here.
 	std::string to_string() const;
 
 	/// Creates a brand new game.
 	/// Writes the game to disk.
+	/// Throws game_error if the player has an ongoing game.
 	static game create(const char valid_plid[PLID_SIZE], uint16_t duration);
 
 	/// Creates a brand new game in debug mode.
 	/// Writes the game to disk.
+	/// Throws game_error if the player has an ongoing game.
 	static game create(const char valid_plid[PLID_SIZE], uint16_t duration, const char secret_key[GUESS_SIZE]);
 
+	/// Same as create, but returns a game failure instead of throwing
+	/// game_error (I/O errors are still thrown).
+	static net::expected<game> try_create(const char valid_plid[PLID_SIZE], uint16_t duration);
+
+	/// Same as create (in debug mode), but returns a game failure instead
+	/// of throwing game_error (I/O errors are still thrown).
+	static net::expected<game> try_create(const char valid_plid[PLID_SIZE], uint16_t duration,
+										const char secret_key[GUESS_SIZE]);
+
 	/// Finds the active game for the given plid (if it exists).
+	/// Players that have none are told apart in memory (see setup).
+	/// Throws game_error if there is none.
 	static game find_active(const char valid_plid[PLID_SIZE]);
 
+	/// Same as find_active, but returns a game failure instead of throwing
+	/// game_error (I/O errors and corrupted files are still thrown).
+	static net::expected<game> try_find_active(const char valid_plid[PLID_SIZE]);
+
 	/// Finds the latest recorded game (active or not) for the given
 	/// plid (provided it exists).
+	/// Players that never played are told apart in memory (see setup).
 	static game find_any(const char valid_plid[PLID_SIZE]);
+
+	/// Returns the latest recorded game (active or not) of the given plid
+	/// as to_string() would, setting 'finished' if it's over.
+	/// The transcripts of finished games never change, so they're kept
+	/// (up to MAX_FINISHED_TRANSCRIPTS) until the player finishes another
+	/// one, and shared as they are with every request that asks for them.
+	/// Throws like find_any.
+	static std::shared_ptr<const std::string> transcript(const char valid_plid[PLID_SIZE], bool& finished);
+
+	/// Reads the game file at 'path', as is (safe to call from any thread).
+	/// Throws:
+	/// 1. game_error if there is no such file.
+	/// 2. io_error if the file could not be read.
+	/// 3. corruption_error if the file is corrupted.
+	static game read(const std::string& path);
+
+	/// Keeps 'gm', read from its file at 'read_at' by the startup recovery
+	/// (see recovery.hpp), in memory, finishing it if it expired while the
+	/// server was down (which writes it to disk).
+	/// Does nothing if the game is already in memory or if its file changed
+	/// since (the game is then read again when needed).
+	/// Returns true if the game expired; false otherwise.
+	static bool recover(game gm, const timespec& read_at);
+
+	/// Parses the game file 'fd' (without closing it), with scan() if it
+	/// is as the server writes it, or as any other file otherwise.
+	/// Throws io_error if reading fails and corruption_error if the file
+	/// is corrupted.
+	static game parse(int fd);
+
+	/// Parses the whole game file 'text' into 'gm', a word at a time (see
+	/// scan.hpp), provided it is exactly as the server writes it.
+	/// Returns false if it's not (leaving 'gm' half parsed).
+	static bool scan(std::string_view text, game& gm);
+
+	/// Parses a game from disk, a field at a time.
+	static game parse(net::stream<net::file_source>& in);
+
+	/// Returns true if 'other' is the same game, as its file holds it (the
+	/// same player, mode, key, times and trials played); false otherwise.
+	bool operator==(const game& other) const;
 private:
+	friend struct snapshot_file;
+
 	game(const char valid_plid[PLID_SIZE], uint16_t duration);
 	game(const char valid_plid[PLID_SIZE], uint16_t duration, const char secret_key[GUESS_SIZE]);
-	void create();
+	/// Writes the new game to disk and keeps it in memory.
+	/// Returns a game failure if the player has an ongoing game.
+	net::failure create();
+
+	/// Adds the game to the session table, or updates its row.
+	void track() const;
 
 	/// Gets the path for the active game of the given plid.
 	static std::string get_active_path(const char valid_plid[PLID_SIZE]);
@@ -158,19 +349,22 @@ private:
 	/// Gets the path for the finished game directory of the given plid.
 	static std::string get_final_path(const char valid_plid[PLID_SIZE]);
 
-	/// Parses a game from disk.
-	static game parse(net::stream<net::file_source>& in);
+	/// Same as read, but returns a game failure if there is no such file.
+	static net::expected<game> try_read(const std::string& path);
 
 	/// Compares a guess with the secret key and returns {nB, nW}.
 	std::pair<uint8_t, uint8_t> compare(const char guess[GUESS_SIZE]);
 
-	/// Writes a single trial to disk.
-	void write_trial(uint8_t trial, std::ostream& out) const;
+	/// Renders trial 'trial' at its place in the transcript.
+	void render_trial(uint8_t trial);
+
+	/// Writes a single trial to 'out' (in the game file format).
+	void write_trial(uint8_t trial, net::format_buffer<TRIAL_RECORD_SIZE>& out) const;
 
 	/// Terminates the game (writes the termination reason to disk
 	/// and moves it to the finished games directory of the associated
 	/// plid).
-	void terminate(std::ostream& out);
+	void terminate();
 
 	uint16_t _duration{601}; // in seconds
 	std::time_t _start{std::time(nullptr)};
@@ -181,6 +375,7 @@ private:
 	char _plid[PLID_SIZE];
 	char _secret_key[GUESS_SIZE];
 	trial_record _trials[MAX_TRIALS - '0'];
+	char _transcript[(MAX_TRIALS - '0') * TRIAL_LINE_SIZE]; // a line per trial played
 };
 
 #endif
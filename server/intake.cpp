@@ -0,0 +1,50 @@
+#include "intake.hpp"
+#include "../common/frames.hpp"
+
+/// Returns true if 'datagram' is for a game in progress; false otherwise.
+static bool in_progress(const std::string& datagram) {
+	net::game_op op = net::is_binary(datagram) ? net::binary_op(datagram) : net::text_op(datagram);
+	return op == net::game_op::TRY || op == net::game_op::QUIT;
+}
+
+bool udp_intake::admit(const std::string& datagram, const timespec& received) {
+	if (received.tv_sec != 0) {
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		long waited = (now.tv_sec - received.tv_sec) * 1000 + (now.tv_nsec - received.tv_nsec) / 1000000;
+		if (waited > INTAKE_STALE_AFTER) {
+			_stale++;
+			return false;
+		}
+	}
+	if (_pending >= INTAKE_CAPACITY) {
+		_shed_full++;
+		return false;
+	}
+	if (_pending >= INTAKE_SHED_NEW && !in_progress(datagram)) {
+		_shed_new++;
+		return false;
+	}
+	_pending++;
+	return true;
+}
+
+void udp_intake::release() {
+	_pending--;
+}
+
+size_t udp_intake::pending() const {
+	return _pending;
+}
+
+uint64_t udp_intake::stale() const {
+	return _stale;
+}
+
+uint64_t udp_intake::shed_new() const {
+	return _shed_new;
+}
+
+uint64_t udp_intake::shed_full() const {
+	return _shed_full;
+}
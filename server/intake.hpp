@@ -0,0 +1,52 @@
+#ifndef _INTAKE_HPP_
+#define _INTAKE_HPP_
+
+#include "../common/common.hpp"
+
+#include <cstdint>
+#include <ctime>
+
+#define INTAKE_CAPACITY 256 // udp requests being handled at once
+#define INTAKE_SHED_NEW 64 // past this many, new games are refused
+#define INTAKE_STALE_AFTER UDP_MAX_RTO // in ms (clients retransmit before that)
+
+/// Overload control for the udp requests: decides, as soon as a datagram
+/// is received, if it's worth handling.
+/// Refused requests are dropped without an answer (the client retransmits
+/// later, backing off), so that a server that falls behind sheds load
+/// instead of queueing it:
+/// 1. Requests that waited more than INTAKE_STALE_AFTER in the socket
+///    (kernel receive timestamp) are dropped: their client already
+///    retransmitted them, so the copy is stale.
+/// 2. At most INTAKE_CAPACITY requests are handled at once (the internal
+///    queue, waiting for a player's lock or for the disk).
+/// 3. Past INTAKE_SHED_NEW requests, only the ones for games already in
+///    progress (TRY, QUT) are admitted: new games (SNG, DBG) wait.
+struct udp_intake {
+	/// Returns true if 'datagram', received by the kernel at 'received'
+	/// (zero if unknown), must be handled; false if it must be dropped.
+	/// Every admitted request must be release()'d once handled.
+	bool admit(const std::string& datagram, const timespec& received);
+
+	/// Marks an admitted request as handled.
+	void release();
+
+	/// Returns the number of requests being handled.
+	size_t pending() const;
+
+	/// Returns the number of requests dropped for being stale.
+	uint64_t stale() const;
+
+	/// Returns the number of new games dropped under pressure.
+	uint64_t shed_new() const;
+
+	/// Returns the number of requests dropped with the queue full.
+	uint64_t shed_full() const;
+private:
+	size_t _pending{0};
+	uint64_t _stale{0};
+	uint64_t _shed_new{0};
+	uint64_t _shed_full{0};
+};
+
+#endif
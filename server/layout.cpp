@@ -0,0 +1,189 @@
+#include "layout.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+#define BUCKET_NAME_SIZE 2 // hex digits of a byte of the hash
+
+static int levels = 0; // of the layout in use
+
+/// Hashes 'plid' (FNV-1a), so that consecutive plids land in different buckets.
+static uint32_t hash_plid(const char plid[PLID_SIZE]) {
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < PLID_SIZE; i++) {
+		h ^= static_cast<uint8_t>(plid[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/// Appends the name of bucket 'byte' (and a '/') to 'path'.
+static void append_bucket(std::string& path, uint8_t byte) {
+	static const char digits[] = "0123456789abcdef";
+	path += digits[byte >> 4];
+	path += digits[byte & 0xf];
+	path += '/';
+}
+
+/// Returns the bucket directory of 'plid' in the layout with 'lvls' levels.
+static std::string bucket_in(const char plid[PLID_SIZE], int lvls) {
+	std::string res{DEFAULT_GAME_DIR "/"};
+	uint32_t h = hash_plid(plid);
+	for (int i = 0; i < lvls; i++, h >>= 8)
+		append_bucket(res, static_cast<uint8_t>(h));
+	return res;
+}
+
+/// Returns true if 'entry' is a bucket directory; false otherwise.
+static bool is_bucket(const std::filesystem::directory_entry& entry) {
+	std::string name = entry.path().filename().string();
+	return name.size() == BUCKET_NAME_SIZE && name.find_first_not_of("0123456789abcdef") == std::string::npos
+		&& entry.is_directory();
+}
+
+/// Appends every bucket directory 'lvls' levels below 'dir' (that exists) to 'out'.
+static void list_buckets(const std::string& dir, int lvls, std::vector<std::string>& out) {
+	if (lvls == 0) {
+		out.push_back(dir);
+		return;
+	}
+	for (const auto& entry : std::filesystem::directory_iterator{dir})
+		if (is_bucket(entry))
+			list_buckets(entry.path().string() + '/', lvls - 1, out);
+}
+
+/// Returns the levels in the layout file; -1 if there's no layout file;
+/// -2 if a migration was interrupted.
+/// Throws:
+/// 1. io_error if it could not be read.
+/// 2. corruption_error if it's corrupted.
+static int read_layout() {
+	if (!std::filesystem::exists(DEFAULT_LAYOUT_FILE))
+		return -1;
+	std::ifstream file{DEFAULT_LAYOUT_FILE};
+	std::string word;
+	if (!(file >> word))
+		throw net::io_error{"Failed to read the layout file"};
+	if (word == LAYOUT_MIGRATING)
+		return -2;
+	if (word.size() != 1 || word[0] < '0' || word[0] > '0' + MAX_LAYOUT_LEVELS)
+		throw net::corruption_error{"Bad layout file"};
+	return word[0] - '0';
+}
+
+/// Replaces the layout file (atomically) with 'word'.
+/// Throws io_error if it could not be written.
+static void write_layout(const std::string& word) {
+	std::string temp_path = DEFAULT_LAYOUT_FILE ".tmp";
+	{
+		std::ofstream file{temp_path, std::ios::trunc};
+		if (!(file << word << '\n'))
+			throw net::io_error{"Failed to write the layout file"};
+	}
+	std::error_code err;
+	std::filesystem::rename(temp_path, DEFAULT_LAYOUT_FILE, err);
+	if (err)
+		throw net::io_error{"Failed to replace the layout file"};
+}
+
+/// Moves the games found in 'dir' (a bucket 'depth' levels down the game
+/// directory) and in the buckets below it to their buckets in the layout
+/// with 'lvls' levels, removing the buckets that layout has no use for.
+/// Adds the files and directories it moved to 'moved'.
+static void move_games(const std::string& dir, int depth, int lvls, size_t& moved) {
+	std::vector<std::filesystem::directory_entry> entries;
+	for (const auto& entry : std::filesystem::directory_iterator{dir})
+		entries.push_back(entry); // (before moving anything)
+	for (const auto& entry : entries) {
+		std::string name = entry.path().filename().string();
+		if (depth < MAX_LAYOUT_LEVELS && is_bucket(entry)) {
+			move_games(entry.path().string(), depth + 1, lvls, moved);
+			if (depth + 1 > lvls)
+				std::filesystem::remove(entry.path()); // (empty by now)
+			continue;
+		}
+		std::string plid;
+		if (net::is_valid_plid(name) && entry.is_directory())
+			plid = name; // finished games
+		else if (name.size() == PLID_SIZE + 10 && name.compare(0, 6, "STATE_") == 0
+			&& name.compare(6 + PLID_SIZE, 4, ".txt") == 0 && net::is_valid_plid(name.substr(6, PLID_SIZE)))
+			plid = name.substr(6, PLID_SIZE); // active game
+		else
+			continue; // (e.g. the layout file)
+		std::string target = bucket_in(plid.c_str(), lvls) + name;
+		if (target == entry.path().string())
+			continue;
+		std::filesystem::create_directories(bucket_in(plid.c_str(), lvls));
+		std::filesystem::rename(entry.path(), target);
+		moved++;
+	}
+}
+
+int open_layout(int wanted) {
+	try {
+		std::filesystem::create_directory(DEFAULT_GAME_DIR);
+		int current = read_layout();
+		if (current == -2) {
+			std::cout << "A migration of " << DEFAULT_GAME_DIR << " was interrupted, run it again (-m).\n";
+			return 1;
+		}
+		if (current == -1) { // new directory (or one from before layouts, which is flat)
+			current = wanted >= 0 && std::filesystem::is_empty(DEFAULT_GAME_DIR) ? wanted : 0;
+			write_layout(net::decimal(current).str());
+		}
+		if (wanted >= 0 && wanted != current) {
+			std::cout << DEFAULT_GAME_DIR << " has a layout with " << current
+				<< " levels, migrate it first (-l " << wanted << " -m).\n";
+			return 1;
+		}
+		levels = current;
+	} catch (std::exception& err) {
+		std::cout << "Failed to open the layout of " << DEFAULT_GAME_DIR << ": " << err.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
+
+int migrate_layout(int wanted) {
+	size_t moved = 0;
+	try {
+		std::filesystem::create_directory(DEFAULT_GAME_DIR);
+		if (read_layout() == wanted) {
+			std::cout << DEFAULT_GAME_DIR << " already has a layout with " << wanted << " levels.\n";
+			return 0;
+		}
+		write_layout(LAYOUT_MIGRATING);
+		move_games(DEFAULT_GAME_DIR, 0, wanted, moved);
+		write_layout(net::decimal(wanted).str());
+	} catch (std::exception& err) {
+		std::cout << "Failed to migrate " << DEFAULT_GAME_DIR << " (after moving " << moved
+			<< " games, run it again): " << err.what() << '\n';
+		return 1;
+	}
+	levels = wanted;
+	std::cout << "Moved " << moved << " game files and directories to a layout with "
+		<< wanted << " levels.\n";
+	return 0;
+}
+
+std::string bucket_of(const char valid_plid[PLID_SIZE]) {
+	return bucket_in(valid_plid, levels);
+}
+
+std::vector<std::string> bucket_chain(const char valid_plid[PLID_SIZE]) {
+	std::vector<std::string> res;
+	std::string dir = bucket_of(valid_plid);
+	for (int i = 0; i < levels; i++) {
+		res.insert(std::begin(res), dir);
+		dir.resize(dir.size() - BUCKET_NAME_SIZE - 1);
+	}
+	return res;
+}
+
+std::vector<std::string> bucket_dirs() {
+	std::vector<std::string> res;
+	list_buckets(DEFAULT_GAME_DIR "/", levels, res);
+	return res;
+}
@@ -0,0 +1,52 @@
+#ifndef _LAYOUT_HPP_
+#define _LAYOUT_HPP_
+
+#include "game.hpp"
+
+#include <string>
+#include <vector>
+
+#define DEFAULT_LAYOUT_FILE DEFAULT_GAME_DIR "/LAYOUT"
+#define MAX_LAYOUT_LEVELS 2
+#define LAYOUT_MIGRATING "migrating" // in the layout file while a migration goes on
+
+/// Where the game files of each player live in the game directory.
+/// With 0 levels (the flat layout), every active game is a file of the
+/// game directory (GAMES/STATE_<plid>.txt) next to the directories of
+/// finished games (GAMES/<plid>/), which gets slow with many players.
+/// With n levels, the games of a player live n bucket directories down
+/// (e.g. GAMES/ab/cd/STATE_<plid>.txt and GAMES/ab/cd/<plid>/ for 2),
+/// named after the bytes of a hash of the plid, so that every directory
+/// stays small (up to 256 buckets per level, each made when the first
+/// game of one of its players is, see bucket_chain).
+/// The layout in use is kept in the layout file, so that a server never
+/// looks for games where they are not.
+
+/// Picks the layout of the game directory, creating the directory if
+/// needed. If 'levels' is negative, it's whatever the directory already
+/// uses (the flat layout if it has none).
+/// Must run before setup() (once, before any shard starts).
+/// Returns 0 on success; 1 if the directory uses another layout (it must
+/// be migrated first, see migrate_layout) or could not be read.
+int open_layout(int levels);
+
+/// Moves every game in the game directory to the layout with 'levels'
+/// levels, with the server stopped.
+/// Safe to run again if it was interrupted (the layout file says so
+/// until it's done, which keeps servers from starting meanwhile).
+/// Returns 0 on success; 1 otherwise.
+int migrate_layout(int levels);
+
+/// Returns the bucket directory (ending in '/') of the games of 'valid_plid'.
+std::string bucket_of(const char valid_plid[PLID_SIZE]);
+
+/// Returns the bucket directories (ending in '/') that must exist before
+/// the games of 'valid_plid' are written, from the top one down.
+std::vector<std::string> bucket_chain(const char valid_plid[PLID_SIZE]);
+
+/// Returns every bucket directory (ending in '/') that may hold active games.
+/// Throws std::filesystem::filesystem_error if the game directory could
+/// not be read.
+std::vector<std::string> bucket_dirs();
+
+#endif
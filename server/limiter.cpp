@@ -0,0 +1,49 @@
+#include "limiter.hpp"
+
+#include <algorithm>
+
+static_assert(LIMITER_SLOTS == 1 << 12, "find() hashes addresses to 12 bits");
+
+rate_limiter::rate_limiter(double rate, double burst)
+	: _rate{rate}, _burst{std::max(burst, 1.0)} {}
+
+bool rate_limiter::enabled() const {
+	return _rate > 0;
+}
+
+bool rate_limiter::allow(const net::other_address& client) {
+	if (!enabled())
+		return true;
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		clock::now().time_since_epoch()).count();
+	slot& s = find(client.addr.sin_addr.s_addr, now);
+	double tokens = s.tokens + (now - s.last) * _rate / 1e9;
+	s.tokens = static_cast<float>(std::min(tokens, _burst));
+	s.last = now;
+	if (s.tokens < 1) {
+		_rejected++;
+		return false;
+	}
+	s.tokens -= 1;
+	return true;
+}
+
+uint64_t rate_limiter::rejected() const {
+	return _rejected;
+}
+
+rate_limiter::slot& rate_limiter::find(uint32_t addr, int64_t now) {
+	size_t start = (addr * 2654435769u) >> 20; // fibonacci hashing (the top 12 bits)
+	slot* oldest = nullptr;
+	for (size_t i = 0; i < LIMITER_PROBES; i++) {
+		slot& s = _slots[(start + i) & (LIMITER_SLOTS - 1)];
+		if (s.addr == addr)
+			return s;
+		if (!oldest || s.last < oldest->last)
+			oldest = &s; // free slots have last = 0
+	}
+	oldest->addr = addr;
+	oldest->tokens = static_cast<float>(_burst);
+	oldest->last = now;
+	return *oldest;
+}
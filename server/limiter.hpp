@@ -0,0 +1,53 @@
+#ifndef _LIMITER_HPP_
+#define _LIMITER_HPP_
+
+#include "../common/common.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+#define LIMITER_SLOTS 4096 // addresses tracked at once (a power of 2)
+#define LIMITER_PROBES 8 // slots looked at for each address
+
+/// Limits the rate of requests of each client address (IPv4 host, the
+/// port is ignored) with a token bucket: each request takes a token,
+/// buckets hold up to 'burst' tokens and refill at 'rate' tokens per
+/// second.
+/// Addresses are kept in a fixed size open addressing table, so flooding
+/// it from many addresses does not use more memory: when the slots an
+/// address hashes to are all taken, the least recently seen one is
+/// reused (that client starts over with a full bucket).
+struct rate_limiter {
+	using clock = std::chrono::steady_clock;
+
+	/// A 'rate' of 0 disables the limiter (every request is allowed).
+	rate_limiter(double rate = 0, double burst = 0);
+
+	/// Returns true if the limiter is enabled; false otherwise.
+	bool enabled() const;
+
+	/// Takes a token from the bucket of 'client'.
+	/// Returns true if there was one (the request may go on); false if
+	/// the request must be rejected.
+	bool allow(const net::other_address& client);
+
+	/// Returns the number of requests rejected so far.
+	uint64_t rejected() const;
+private:
+	struct slot {
+		uint32_t addr{0}; // network order (0 => free)
+		float tokens{0};
+		int64_t last{0}; // last refill, in nanoseconds
+	};
+
+	/// Returns the slot of 'addr' (taking a new one if needed).
+	slot& find(uint32_t addr, int64_t now);
+
+	double _rate;
+	double _burst;
+	uint64_t _rejected{0};
+	std::array<slot, LIMITER_SLOTS> _slots{};
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "recovery.hpp"
+#include "layout.hpp"
+#include "shard.hpp"
+
+#include <filesystem>
+#include <iostream>
+
+/// Returns the seconds elapsed since 'start'.
+static double seconds_since(const timespec& start) {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+recovery::recovery(unsigned threads, int shard, int shards) {
+	clock_gettime(CLOCK_MONOTONIC, &_started);
+	try {
+		for (const std::string& dir : bucket_dirs()) {
+			for (const auto& entry : std::filesystem::directory_iterator{dir}) {
+				std::string name = entry.path().filename().string();
+				if (name.compare(0, 6, "STATE_") != 0 || name.size() < 6 + PLID_SIZE || !entry.is_regular_file())
+					continue;
+				std::string plid = name.substr(6, PLID_SIZE);
+				if (!net::is_valid_plid(plid))
+					continue;
+				if (shard >= 0 && shard_of(plid.c_str(), shards) != shard)
+					continue; // (another shard's player, its own shard recovers it)
+				_paths.push_back(entry.path().string());
+			}
+		}
+	} catch (std::exception& err) {
+		std::cout << "Failed to list the active games: " << err.what() << '\n';
+		_paths.clear();
+	}
+	for (unsigned i = 0; i < threads && i < _paths.size(); i++)
+		_threads.emplace_back(&recovery::work, this);
+}
+
+recovery::~recovery() {
+	_next = _paths.size(); // stop early
+	for (std::thread& t : _threads)
+		t.join();
+}
+
+void recovery::work() {
+	std::vector<parsed> batch;
+	size_t batch_read = 0; // paths read into 'batch' (successfully or not)
+	while (true) {
+		size_t i = _next++;
+		if (i >= _paths.size())
+			break;
+		parsed p;
+		clock_gettime(CLOCK_REALTIME, &p.read_at); // (before reading it)
+		try {
+			p.gm = game::read(_paths[i]);
+			batch.push_back(p);
+		} catch (net::game_error& err) { // finished meanwhile
+		} catch (std::exception& err) {
+			_failed++;
+		}
+		batch_read++;
+		if (batch.size() < RECOVERY_BATCH)
+			continue;
+		std::lock_guard<std::mutex> guard{_lock};
+		_ready.insert(std::end(_ready), std::begin(batch), std::end(batch));
+		_read += batch_read; // (only once handed over, see done())
+		batch.clear();
+		batch_read = 0;
+	}
+	std::lock_guard<std::mutex> guard{_lock};
+	_ready.insert(std::end(_ready), std::begin(batch), std::end(batch));
+	_read += batch_read;
+}
+
+void recovery::merge() {
+	std::vector<parsed> ready;
+	{
+		std::lock_guard<std::mutex> guard{_lock};
+		ready.swap(_ready);
+	}
+	for (parsed& p : ready) {
+		try {
+			if (game::recover(p.gm, p.read_at))
+				_expired++;
+		} catch (std::exception& err) { // could not finish it => it's done when needed
+			_failed++;
+		}
+	}
+}
+
+bool recovery::done() const {
+	if (_read < _paths.size())
+		return false;
+	std::lock_guard<std::mutex> guard{_lock};
+	return _ready.empty();
+}
+
+void recovery::report() const {
+	double elapsed = seconds_since(_started);
+	size_t read = _read;
+	std::cout << "Recovery: read " << read << " of " << _paths.size() << " active games ("
+		<< _expired << " expired, " << _failed << " failed) in " << elapsed << "s, "
+		<< static_cast<uint64_t>(elapsed > 0 ? read / elapsed : 0) << " games/s with "
+		<< _threads.size() << " threads." << std::endl; // (progress => not buffered)
+}
@@ -0,0 +1,69 @@
+#ifndef _RECOVERY_HPP_
+#define _RECOVERY_HPP_
+
+#include "game.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MAX_RECOVERY_THREADS 64
+#define RECOVERY_BATCH 256 // games a thread parses before handing them over
+#define RECOVERY_MERGE_MS 100 // between merges
+#define RECOVERY_REPORT_MS 1000 // between progress reports
+
+/// Startup recovery of the active games: a pool of threads reads and
+/// parses every active game file (of the shard's players, see shard.hpp),
+/// so that the games that expired while
+/// the server was down are finished, and the others are kept in memory,
+/// before any player asks for them (see game::recover).
+/// The threads only read files: the parsed games are handed over to the
+/// game table by merge(), where the games are used (the executor's worker,
+/// or the main thread before the server starts), so the server may serve
+/// requests while the recovery goes on.
+struct recovery {
+	/// Lists the active game files of the players that shard 'shard' (out
+	/// of 'shards'; -1 if the server is not sharded) owns and starts
+	/// 'threads' threads to read them.
+	recovery(unsigned threads, int shard, int shards);
+
+	recovery(const recovery& other) = delete;
+
+	recovery& operator=(const recovery& other) = delete;
+
+	/// Waits for the threads (games not yet merged are dropped).
+	~recovery();
+
+	/// Hands the games parsed so far to the game table.
+	void merge();
+
+	/// Returns true once every file was read (and merged); false otherwise.
+	bool done() const;
+
+	/// Writes how far the recovery got (and how fast) to std::cout.
+	void report() const;
+private:
+	struct parsed {
+		game gm;
+		timespec read_at;
+	};
+
+	/// Reads files until there are none left.
+	void work();
+
+	std::vector<std::string> _paths;
+	std::vector<std::thread> _threads;
+	std::atomic<size_t> _next{0}; // next path to read
+	std::atomic<size_t> _read{0}; // paths read (successfully or not) and handed over to _ready
+	std::atomic<uint64_t> _failed{0}; // files that could not be read
+	mutable std::mutex _lock;
+	std::vector<parsed> _ready; // parsed but not yet merged
+	uint64_t _expired{0};
+	timespec _started;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "replica.hpp"
+#include "game.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+// each message: type (1 byte), path size, other size (4 bytes each), path, other, data
+#define RECORD_HEADER_SIZE (1 + 2 * sizeof(uint32_t))
+
+/// Fills in 'addr' with the unix socket 'path'.
+/// Returns false if it's too long; true otherwise.
+static bool unix_address(const std::string& path, sockaddr_un& addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		return false;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+/// Waits until 'fd' has data to read.
+/// Returns false if a signal came first; true otherwise.
+static bool wait_readable(int fd) {
+	pollfd p{fd, POLLIN, 0};
+	return poll(&p, 1, -1) != -1; // (unlike accept and recv, never restarted)
+}
+
+/// Flushes the operations 'disk' applied if 'fd' has nothing more to
+/// read (so each burst of operations is flushed once), then waits until
+/// it does.
+/// Returns false if a signal came first; true otherwise.
+static bool flush_and_wait(storage& disk, int fd) {
+	pollfd p{fd, POLLIN, 0};
+	if (poll(&p, 1, 0) == 0) {
+		try {
+			disk.commit();
+		} catch (net::io_error& err) {
+			std::cout << "Failed to flush the operations of the primary: " << err.what() << '\n';
+		}
+	}
+	return wait_readable(fd);
+}
+
+replica::replica(const std::string& path) {
+	sockaddr_un addr;
+	if (!unix_address(path, addr) || (_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+		return;
+	if (connect(_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+		close(_fd);
+		_fd = -1;
+	}
+}
+
+replica::~replica() {
+	if (_fd != -1)
+		close(_fd);
+}
+
+bool replica::valid() const {
+	return _fd != -1;
+}
+
+bool replica::snapshot() {
+	_blocking = true; // (the server is not serving yet)
+	try {
+		for (const char* dir : {DEFAULT_GAME_DIR, DEFAULT_SCORE_DIR}) {
+			send(storage::kind::MAKE_DIR, dir, {}, {});
+			for (const auto& entry : std::filesystem::recursive_directory_iterator{dir}) {
+				std::string path = entry.path().string();
+				if (entry.is_directory()) {
+					send(storage::kind::MAKE_DIR, path, {}, {});
+					continue;
+				}
+				std::ifstream file{path, std::ios::binary};
+				std::ostringstream data;
+				data << file.rdbuf();
+				if (!file)
+					return false;
+				send(storage::kind::WRITE, path, {}, data.str());
+			}
+		}
+	} catch (std::exception& err) {
+		_blocking = false;
+		return false;
+	}
+	_blocking = false;
+	return valid();
+}
+
+void replica::send(storage::kind type, const std::string& path, const std::string& other,
+			const std::string& data) {
+	if (_fd == -1)
+		return;
+	uint32_t sizes[2] = {static_cast<uint32_t>(path.size()), static_cast<uint32_t>(other.size())};
+	char header[RECORD_HEADER_SIZE];
+	header[0] = static_cast<char>(type);
+	memcpy(header + 1, sizes, sizeof(sizes));
+	iovec iov[4] = {
+		{header, sizeof(header)},
+		{const_cast<char*>(path.data()), path.size()},
+		{const_cast<char*>(other.data()), other.size()},
+		{const_cast<char*>(data.data()), data.size()},
+	};
+	size_t size = sizeof(header) + path.size() + other.size() + data.size();
+	if (!flush())
+		return drop("Lost the standby, no longer replicating.");
+	if (_queue.empty()) { // (or it would overtake them)
+		msghdr hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = 4;
+		ssize_t n;
+		while ((n = sendmsg(_fd, &hdr, MSG_NOSIGNAL | (_blocking ? 0 : MSG_DONTWAIT))) == -1 && errno == EINTR)
+			continue;
+		if (n != -1)
+			return;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return drop("Lost the standby, no longer replicating.");
+	}
+	if (_queued + size > MAX_REPLICA_BACKLOG)
+		return drop("The standby fell behind, no longer replicating.");
+	std::string& record = _queue.emplace_back();
+	record.reserve(size);
+	for (const iovec& part : iov)
+		record.append(static_cast<const char*>(part.iov_base), part.iov_len);
+	_queued += size;
+}
+
+bool replica::flush() {
+	while (!_queue.empty()) {
+		const std::string& record = _queue.front();
+		ssize_t n;
+		while ((n = ::send(_fd, record.data(), record.size(), MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		_queued -= record.size();
+		_queue.pop_front();
+	}
+	return true;
+}
+
+void replica::drop(const char* why) {
+	std::cout << why << '\n';
+	close(_fd);
+	_fd = -1;
+	_queue.clear();
+	_queued = 0;
+}
+
+/// Returns true if 'path' is one the primary may write to: a relative path
+/// inside the game or score directories (without going up); false otherwise.
+static bool replicated_path(const std::string& path) {
+	std::filesystem::path p{path};
+	if (p.empty() || p.is_absolute())
+		return false;
+	for (const auto& part : p)
+		if (part == "..")
+			return false;
+	return *p.begin() == DEFAULT_GAME_DIR || *p.begin() == DEFAULT_SCORE_DIR;
+}
+
+/// Returns true if the peer of the unix socket 'fd' runs as this user;
+/// false otherwise.
+static bool same_user(int fd) {
+	ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	return cred.uid == getuid();
+}
+
+/// Returns true if 'path' is a scoreboard file that's newer than the
+/// one named 'latest' (see get_latest_file in game.cpp).
+static bool newer_board(const std::string& path, const std::string& latest) {
+	std::string prefix = DEFAULT_SCORE_DIR + std::string{"/"};
+	if (path.compare(0, prefix.size(), prefix) != 0)
+		return false;
+	std::string name = path.substr(prefix.size());
+	if (name.empty() || name.find_first_not_of("0123456789") != std::string::npos)
+		return false; // in a subdirectory, or a temporary file
+	try {
+		return latest.empty() || std::stoul(name) > std::stoul(latest);
+	} catch (std::out_of_range& err) {
+		return false;
+	}
+}
+
+int follow(const std::string& path, storage& disk, std::string& latest_board) {
+	sockaddr_un addr;
+	if (!unix_address(path, addr))
+		return 1;
+	int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listener == -1)
+		return 1;
+	unlink(path.c_str()); // left behind by a previous standby
+	if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(listener, 1) == -1) {
+		close(listener);
+		return 1;
+	}
+	std::cout << "Standing by at " << path << ".\n";
+	int primary = -2; // interrupted
+	if (wait_readable(listener))
+		primary = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+	close(listener);
+	unlink(path.c_str());
+	if (primary < 0)
+		return primary == -1 ? 1 : 0;
+	if (!same_user(primary)) {
+		std::cout << "The primary runs as another user, refusing it.\n";
+		close(primary);
+		return 1;
+	}
+	std::vector<char> buf(MAX_REPLICA_RECORD);
+	while (flush_and_wait(disk, primary)) {
+		ssize_t n = recv(primary, buf.data(), buf.size(), MSG_TRUNC); // => its real size
+		if (n <= 0)
+			break; // the primary is gone
+		uint32_t sizes[2];
+		memcpy(sizes, buf.data() + 1, sizeof(sizes));
+		if (static_cast<size_t>(n) < RECORD_HEADER_SIZE || static_cast<size_t>(n) > buf.size()
+			|| sizes[0] + static_cast<size_t>(sizes[1]) > n - RECORD_HEADER_SIZE) {
+			std::cout << "Bad operation from the primary (ignoring).\n";
+			continue;
+		}
+		auto type = static_cast<storage::kind>(buf[0]);
+		const char* at = buf.data() + RECORD_HEADER_SIZE;
+		std::string file{at, sizes[0]};
+		std::string other{at + sizes[0], sizes[1]};
+		at += sizes[0] + sizes[1];
+		if (!replicated_path(file) || (!other.empty() && !replicated_path(other))) {
+			std::cout << "Operation of the primary outside the game directories (ignoring).\n";
+			continue;
+		}
+		try {
+			disk.apply(type, file, other, std::string{at, static_cast<size_t>(buf.data() + n - at)});
+		} catch (net::io_error& err) {
+			std::cout << "Failed to apply an operation of the primary: " << err.what() << '\n';
+			continue;
+		}
+		track_replicated(type, file, other);
+		if ((type == storage::kind::WRITE || type == storage::kind::REPLACE) && newer_board(file, latest_board))
+			latest_board = file.substr(sizeof(DEFAULT_SCORE_DIR));
+	}
+	close(primary);
+	return 0;
+}
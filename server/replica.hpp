@@ -0,0 +1,73 @@
+#ifndef _REPLICA_HPP_
+#define _REPLICA_HPP_
+
+#include "storage.hpp"
+
+#include <deque>
+#include <string>
+
+#define MAX_REPLICA_RECORD (1 << 20) // bytes in a single operation
+#define MAX_REPLICA_BACKLOG (64 << 20) // bytes of operations queued for a slow standby
+
+/// Primary end of a hot standby: streams every operation that the storage
+/// of this server completes (game creations, trials, terminations and
+/// scoreboard updates are all file operations) to a standby server, which
+/// applies them to its own copy of the game and score directories (see
+/// follow()).
+/// Each operation is a message of a SOCK_SEQPACKET unix socket.
+/// Replication is asynchronous: the standby may miss the last operations
+/// if the primary dies while sending them. Sends never block the storage:
+/// the operations the socket has no room for are queued (and go with the
+/// next ones), and a standby that falls MAX_REPLICA_BACKLOG bytes behind
+/// is dropped.
+struct replica {
+	/// Connects to the standby listening at the unix socket 'path'.
+	/// Check valid() to know if it's there.
+	explicit replica(const std::string& path);
+
+	replica(const replica& other) = delete;
+
+	replica& operator=(const replica& other) = delete;
+
+	~replica();
+
+	/// Returns true if the operations are reaching the standby; false otherwise.
+	bool valid() const;
+
+	/// Sends every file in the game and score directories, so that the
+	/// standby starts from the same state as this server.
+	/// Returns true on success; false otherwise.
+	bool snapshot();
+
+	/// Sends an operation (see storage::apply), or queues it if the standby
+	/// is behind. If the standby is gone (or too far behind), it says so and
+	/// stops replicating (this server keeps going).
+	void send(storage::kind type, const std::string& path, const std::string& other,
+			const std::string& data);
+private:
+	/// Sends the queued operations, as many as the socket takes.
+	/// Returns false if the standby is gone; true otherwise.
+	bool flush();
+
+	/// Stops replicating, saying 'why'.
+	void drop(const char* why);
+
+	int _fd{-1};
+	bool _blocking{false}; // sends wait for room (while snapshotting)
+	std::deque<std::string> _queue{}; // operations the socket had no room for
+	size_t _queued{0}; // bytes in _queue
+};
+
+/// Waits for a primary server (of the same user) to connect to the unix
+/// socket 'path', then applies the operations it streams through 'disk'
+/// (those on paths inside the game and score directories) until it goes away
+/// (committing them whenever it catches up, see storage::commit).
+/// On return, 'latest_board' is the name of the latest scoreboard file
+/// the primary sent (empty if none), and the players with games are
+/// tracked (see track_replicated), so that the standby can take over
+/// without looking for them (see setup).
+/// Returns 0 once the primary is gone (or a signal interrupted the wait);
+/// 1 if 'path' could not be listened on.
+int follow(const std::string& path, storage& disk, std::string& latest_board);
+
+#endif
@@ -1,13 +1,31 @@
+#include "feed.hpp"
 #include "game.hpp"
+#include "intake.hpp"
+#include "layout.hpp"
+#include "limiter.hpp"
+#include "recovery.hpp"
+#include "replica.hpp"
+#include "shard.hpp"
+#include "../common/async.hpp"
+#include "../common/frames.hpp"
+#include "../common/protocol.hpp"
 
 #include <iostream>
+#include <cstdlib>
 #include <ctime>
 #include <fcntl.h>
+#include <sys/prctl.h>
 #include <sys/wait.h>
 
 #define DEFAULT_PORT "58016"
+#define TAKEOVER_RETRY_MS 50 // between attempts to bind the port of a dead primary
+#define DEFAULT_RESIDENT_MB 256 // of active games kept in memory
 
-static bool exit_server = false;
+static net::executor* running = nullptr;
+static bool sharded = false; // this process is a shard of a sharded server (see shard.hpp)
+static bool routing = false; // this process is the router of a sharded server
+static scoreboard_feed feed; // pushes the scoreboard to its subscribers
+static net::keyed_mutex<std::string> plid_locks; // serializes the requests of each player
 
 //  Provides verbose logging funcitonality for the game server
 struct verbose {
@@ -45,60 +63,122 @@ private:
 	static bool _mode;
 };
 
+static volatile sig_atomic_t interrupted = 0; // in case it comes before the executor runs
+
 static void sigint_handler(int signal) {
-	exit_server = true;
+	interrupted = 1;
+	if (running)
+		running->stop();
+}
+
+/// What the server was asked to do in the command line.
+struct options {
+	std::string port{DEFAULT_PORT};
+	bool use_uring{false};
+	bool use_uring_net{false};
+	double rate{0};
+	double burst{0};
+	int shards{1};
+	std::string replica; // unix socket of the standby
+	std::string standby; // unix socket to wait for the primary at
+	double snapshot_every{0}; // seconds (0 => no snapshots)
+	unsigned recovery_threads{0}; // 0 => no startup recovery
+	bool serve_early{false}; // while the recovery goes on
+	int layout_levels{-1}; // of the game directory (-1 => whatever it has, see layout.hpp)
+	bool migrate{false}; // the game directory to that layout, then stop
+	storage::durability durability{storage::durability::WRITE};
+	double resident_mb{0}; // of active games kept in memory (0 => DEFAULT_RESIDENT_MB; all of them at -d none)
+	double expire_every{0}; // seconds between sweeps for expired games (0 => no sweeps)
+};
+
+/// Runs a blocking game/file operation on the executor's worker, so the
+/// event loop keeps serving other requests in the meantime.
+template<typename FUNC>
+static auto disk_op(FUNC&& func) {
+	return net::executor::current().offload(std::forward<FUNC>(func));
 }
 
 bool verbose::_mode{false};
 
-using udp_action_map = net::action_map<
-	net::udp_source,
-	const net::udp_connection&,
-	const net::other_address&
->;
+/// The client of a udp request, answered in the framing the request came in
+/// (text or binary, see frames.hpp).
+struct udp_peer {
+	const net::async_udp_connection& conn;
+	net::other_address addr;
+	bool binary;
+
+	void answer(const net::game_reply& rep) const {
+		conn.answer(binary ? net::encode_reply(rep) : net::make_reply(rep), addr);
+	}
+};
 
-using tcp_action_map = net::action_map<
-	net::tcp_source,
-	const net::tcp_connection&,
+using tcp_action_map = net::async_action_map<
+	net::tcp_buffer_source,
+	net::async_tcp_connection&,
 	const net::other_address&
 >;
 
-static void handle_udp(net::udp_connection& udp_conn, const udp_action_map& actions);
-static void handle_tcp(net::tcp_server& tcp_sv, const tcp_action_map& actions);
+static bool report_error(std::exception_ptr error);
 
-static void start_new_game(
-	net::stream<net::udp_source>& req,
-	const net::udp_connection& udp_conn,
-	const net::other_address& client_addr
+static net::task<void> serve_udp(net::async_udp_connection& udp_conn, rate_limiter& limiter, udp_intake& intake);
+static net::task<void> serve_tcp(net::async_tcp_server& tcp_sv, const tcp_action_map& actions,
+								rate_limiter& limiter, shard_router* router);
+static net::task<void> serve_routed(int channel, const tcp_action_map& actions);
+static net::task<void> collect_shard(shard_router& router, int shard);
+static bool read_rate(int argc, char** argv, int argi, double& rate);
+static int serve(const options& opts, net::udp_connection& udp_conn, net::tcp_server* tcp_sv,
+				int shard, int channel, const std::string& latest_board = "");
+static int serve_sharded(const options& opts);
+static int final_snapshot(const options& opts, int res);
+static net::task<void> take_snapshots(double every);
+static net::task<void> sweep_expired(double every, uint64_t& expired);
+static void recover_now(recovery& rec);
+static net::task<void> recover_meanwhile(recovery& rec);
+static net::task<void> refresh_feed();
+static net::task<void> publish_scoreboard();
+static net::task<void> watch_boards();
+
+static net::task<void> start_new_game(
+	const net::game_request& req,
+	const udp_peer& peer
 );
 
-static void end_game(
-	net::stream<net::udp_source>& req,
-	const net::udp_connection& udp_conn,
-	const net::other_address& client_addr
+static net::task<void> end_game(
+	const net::game_request& req,
+	const udp_peer& peer
+);
+
+static net::task<void> start_new_game_debug(
+	const net::game_request& req,
+	const udp_peer& peer
 );
 
-static void start_new_game_debug(
-	net::stream<net::udp_source>& req,
-	const net::udp_connection& udp_conn,
+static net::task<void> do_try(
+	const net::game_request& req,
+	const udp_peer& peer
+);
+
+static net::task<void> show_trials(
+	net::stream<net::tcp_buffer_source>& req,
+	net::async_tcp_connection& tcp_conn,
 	const net::other_address& client_addr
 );
 
-static void do_try(
-	net::stream<net::udp_source>& req,
-	const net::udp_connection& udp_conn,
+static net::task<void> show_scoreboard(
+	net::stream<net::tcp_buffer_source>& req,
+	net::async_tcp_connection& tcp_conn,
 	const net::other_address& client_addr
 );
 
-static void show_trials(
-	net::stream<net::tcp_source>& req,
-	const net::tcp_connection& tcp_conn,
+static net::task<void> start_keep_alive(
+	net::stream<net::tcp_buffer_source>& req,
+	net::async_tcp_connection& tcp_conn,
 	const net::other_address& client_addr
 );
 
-static void show_scoreboard(
-	net::stream<net::tcp_source>& req,
-	const net::tcp_connection& tcp_conn,
+static net::task<void> subscribe_scoreboard(
+	net::stream<net::tcp_buffer_source>& req,
+	net::async_tcp_connection& tcp_conn,
 	const net::other_address& client_addr
 );
 
@@ -106,7 +186,9 @@ int main(int argc, char** argv) {
 	int argi = 1;
 	bool read_gsport = false;
 	bool read_verbose = false;
-	std::string port = DEFAULT_PORT;
+	bool read_shards = false;
+	bool read_durability = false;
+	options opts;
 	while (argi <= argc - 1) {
 		std::string_view arg{argv[argi]};
 		if (arg == "-p") {
@@ -118,7 +200,7 @@ int main(int argc, char** argv) {
 				std::cout << "Please specify the port after -p.\n";
 				return 1;
 			}
-			port = argv[argi + 1];
+			opts.port = argv[argi + 1];
 			argi += 2;
 			read_gsport = true;
 			continue;
@@ -132,13 +214,190 @@ int main(int argc, char** argv) {
 			argi++;
 			continue;
 		}
+		if (arg == "-u") {
+			if (opts.use_uring) {
+				std::cout << "Duplicated -u.\n";
+				return 1;
+			}
+			opts.use_uring = true;
+			argi++;
+			continue;
+		}
+		if (arg == "-n") {
+			if (opts.use_uring_net) {
+				std::cout << "Duplicated -n.\n";
+				return 1;
+			}
+			opts.use_uring_net = true;
+			argi++;
+			continue;
+		}
+		if (arg == "-r" || arg == "-b") {
+			double& value = arg == "-r" ? opts.rate : opts.burst;
+			if (value != 0) {
+				std::cout << "Duplicated " << arg << ".\n";
+				return 1;
+			}
+			if (!read_rate(argc, argv, argi, value)) {
+				std::cout << "Please specify a positive number of requests after " << arg << ".\n";
+				return 1;
+			}
+			argi += 2;
+			continue;
+		}
+		if (arg == "-s") {
+			if (read_shards) {
+				std::cout << "Duplicated -s.\n";
+				return 1;
+			}
+			double shards;
+			if (!read_rate(argc, argv, argi, shards) || shards != static_cast<int>(shards) || shards > MAX_SHARDS) {
+				std::cout << "Please specify the number of shards (1 to " << MAX_SHARDS << ") after -s.\n";
+				return 1;
+			}
+			opts.shards = static_cast<int>(shards);
+			argi += 2;
+			read_shards = true;
+			continue;
+		}
+		if (arg == "-c") {
+			if (opts.snapshot_every != 0) {
+				std::cout << "Duplicated -c.\n";
+				return 1;
+			}
+			if (!read_rate(argc, argv, argi, opts.snapshot_every)) {
+				std::cout << "Please specify the seconds between snapshots after -c.\n";
+				return 1;
+			}
+			argi += 2;
+			continue;
+		}
+		if (arg == "-t") {
+			if (opts.recovery_threads != 0) {
+				std::cout << "Duplicated -t.\n";
+				return 1;
+			}
+			double threads;
+			if (!read_rate(argc, argv, argi, threads) || threads != static_cast<unsigned>(threads)
+				|| threads > MAX_RECOVERY_THREADS) {
+				std::cout << "Please specify the number of recovery threads (1 to "
+					<< MAX_RECOVERY_THREADS << ") after -t.\n";
+				return 1;
+			}
+			opts.recovery_threads = static_cast<unsigned>(threads);
+			argi += 2;
+			continue;
+		}
+		if (arg == "-a") {
+			if (opts.serve_early) {
+				std::cout << "Duplicated -a.\n";
+				return 1;
+			}
+			opts.serve_early = true;
+			argi++;
+			continue;
+		}
+		if (arg == "-l") {
+			if (opts.layout_levels != -1) {
+				std::cout << "Duplicated -l.\n";
+				return 1;
+			}
+			std::string_view lvls{argi + 1 == argc ? "" : argv[argi + 1]};
+			if (lvls.size() != 1 || lvls[0] < '0' || lvls[0] > '0' + MAX_LAYOUT_LEVELS) {
+				std::cout << "Please specify the levels of the game directory (0 to "
+					<< MAX_LAYOUT_LEVELS << ") after -l.\n";
+				return 1;
+			}
+			opts.layout_levels = lvls[0] - '0';
+			argi += 2;
+			continue;
+		}
+		if (arg == "-d") {
+			if (read_durability) {
+				std::cout << "Duplicated -d.\n";
+				return 1;
+			}
+			std::string_view level{argi + 1 == argc ? "" : argv[argi + 1]};
+			if (level == "none")
+				opts.durability = storage::durability::NONE;
+			else if (level == "write")
+				opts.durability = storage::durability::WRITE;
+			else if (level == "batch")
+				opts.durability = storage::durability::BATCH;
+			else if (level == "sync")
+				opts.durability = storage::durability::SYNC;
+			else {
+				std::cout << "Please specify the durability (none, write, batch or sync) after -d.\n";
+				return 1;
+			}
+			argi += 2;
+			read_durability = true;
+			continue;
+		}
+		if (arg == "-M") {
+			if (opts.resident_mb != 0) {
+				std::cout << "Duplicated -M.\n";
+				return 1;
+			}
+			if (!read_rate(argc, argv, argi, opts.resident_mb)) {
+				std::cout << "Please specify the megabytes of active games to keep in memory after -M.\n";
+				return 1;
+			}
+			argi += 2;
+			continue;
+		}
+		if (arg == "-e") {
+			if (opts.expire_every != 0) {
+				std::cout << "Duplicated -e.\n";
+				return 1;
+			}
+			if (!read_rate(argc, argv, argi, opts.expire_every)) {
+				std::cout << "Please specify the seconds between sweeps for expired games after -e.\n";
+				return 1;
+			}
+			argi += 2;
+			continue;
+		}
+		if (arg == "-m") {
+			if (opts.migrate) {
+				std::cout << "Duplicated -m.\n";
+				return 1;
+			}
+			opts.migrate = true;
+			argi++;
+			continue;
+		}
+		if (arg == "-R" || arg == "-S") {
+			std::string& path = arg == "-R" ? opts.replica : opts.standby;
+			if (!path.empty()) {
+				std::cout << "Duplicated " << arg << ".\n";
+				return 1;
+			}
+			if (argi + 1 == argc || *argv[argi + 1] == '\0') {
+				std::cout << "Please specify the path of a unix socket after " << arg << ".\n";
+				return 1;
+			}
+			path = argv[argi + 1];
+			argi += 2;
+			continue;
+		}
 		std::cout << "Unknown CLI argument.\n";
 		return 1;
 	}
-
-	if (setup() != 0) {
-		std::cout << "Failed to setup the " << DEFAULT_GAME_DIR << " directory.\n";
-		std::cout << "Shutting down.\n";
+	if (opts.serve_early && opts.recovery_threads == 0) {
+		std::cout << "-a needs a startup recovery (-t).\n";
+		return 1;
+	}
+	if (opts.resident_mb != 0 && opts.durability == storage::durability::NONE) {
+		std::cout << "-M needs game files to read evicted games from (not -d none).\n";
+		return 1;
+	}
+	if (opts.migrate && opts.layout_levels == -1) {
+		std::cout << "-m needs the layout to migrate to (-l).\n";
+		return 1;
+	}
+	if (opts.shards > 1 && (!opts.replica.empty() || !opts.standby.empty())) {
+		std::cout << "Cannot replicate a sharded server.\n";
 		return 1;
 	}
 
@@ -155,628 +414,962 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
-	net::udp_connection udp_conn{{port, SOCK_DGRAM}};
+	if (opts.burst == 0)
+		opts.burst = opts.rate; // one second worth of requests
+	std::srand(std::time(nullptr));
+	if (opts.migrate)
+		return migrate_layout(opts.layout_levels);
+	std::string latest_board;
+	int attempts = 1;
+	if (!opts.standby.empty()) { // copy the primary's files until it dies
+		storage disk{false, opts.durability};
+		if (follow(opts.standby, disk, latest_board) != 0) {
+			std::cout << "Failed to stand by at " << opts.standby << ".\n";
+			return 1;
+		}
+		if (interrupted)
+			return 0;
+		std::cout << "The primary is gone, taking over.\n";
+		attempts = DEFAULT_TIMEOUT * 1000 / TAKEOVER_RETRY_MS; // until its sockets are closed
+	}
+	if (open_layout(opts.layout_levels) != 0) // (a standby's is the primary's)
+		return 1;
+	if (opts.shards > 1)
+		return serve_sharded(opts);
+	net::udp_connection udp_conn{{opts.port, SOCK_DGRAM}};
+	net::tcp_server tcp_sv{{opts.port, SOCK_STREAM}};
+	while (!udp_conn.valid() || !tcp_sv.valid()) {
+		if (--attempts == 0 || interrupted)
+			break;
+		usleep(TAKEOVER_RETRY_MS * 1000);
+		if (!udp_conn.valid())
+			udp_conn = net::udp_connection{{opts.port, SOCK_DGRAM}};
+		if (!tcp_sv.valid())
+			tcp_sv = net::tcp_server{{opts.port, SOCK_STREAM}};
+	}
 	if (!udp_conn.valid()) {
-		std::cout << "Failed to open udp connection at " << port << ".\n";
+		std::cout << "Failed to open udp connection at " << opts.port << ".\n";
 		return 1;
 	}
-	net::tcp_server tcp_sv{{port, SOCK_STREAM}};
 	if (!tcp_sv.valid()) {
-		std::cout << "Failed to open tcp connection at " << port << ".\n";
+		std::cout << "Failed to open tcp connection at " << opts.port << ".\n";
 		return 1;
 	}
+	return final_snapshot(opts, serve(opts, udp_conn, &tcp_sv, -1, -1, latest_board));
+}
+
+/// Serves requests until the server is stopped: the udp requests of 'udp_conn'
+/// and either the tcp clients of 'tcp_sv' or, for shard 'shard' of a sharded
+/// server, the tcp requests the router hands over through 'channel'
+/// (see setup for 'latest_board')
+static int serve(const options& opts, net::udp_connection& udp_conn, net::tcp_server* tcp_sv,
+				int shard, int channel, const std::string& latest_board) {
+	sharded = shard >= 0;
+	std::optional<replica> rep;
+	if (!opts.replica.empty()) {
+		rep.emplace(opts.replica);
+		if (!rep->valid()) {
+			std::cout << "Failed to connect to the standby at " << opts.replica << ".\n";
+			return 1;
+		}
+	}
+	storage disk{opts.use_uring, opts.durability};
+	if (opts.use_uring && !disk.uses_uring())
+		std::cout << "io_uring is not available, writing game files with blocking calls.\n";
+	if (opts.durability != storage::durability::NONE) // (or evicted games would be lost)
+		limit_resident(static_cast<size_t>((opts.resident_mb != 0 ? opts.resident_mb : DEFAULT_RESIDENT_MB) * (1 << 20)));
+	if (setup(disk, shard, opts.shards, latest_board) != 0) {
+		std::cout << "Failed to setup the " << DEFAULT_GAME_DIR << " directory.\n";
+		std::cout << "Shutting down.\n";
+		return 1;
+	}
+	if (rep) {
+		if (!rep->snapshot()) {
+			std::cout << "Failed to send the game files to the standby.\n";
+			return 1;
+		}
+		disk.replicate_to(&*rep);
+	}
+	std::optional<recovery> recovering;
+	if (opts.recovery_threads != 0) {
+		recovering.emplace(opts.recovery_threads, shard, opts.shards);
+		if (!opts.serve_early)
+			recover_now(*recovering);
+	}
 
-	std::srand(std::time(nullptr));
-	udp_action_map udp_actions;
-	udp_actions.add_action("SNG", start_new_game);
-	udp_actions.add_action("QUT", end_game);
-	udp_actions.add_action("DBG", start_new_game_debug);
-	udp_actions.add_action("TRY", do_try);
 	tcp_action_map tcp_actions;
 	tcp_actions.add_action("STR", show_trials);
 	tcp_actions.add_action("SSB", show_scoreboard);
+	tcp_actions.add_action("KAL", start_keep_alive);
+	tcp_actions.add_action("SUB", subscribe_scoreboard);
 
-	fd_set r_fds;
-	int max_fd = udp_conn.get_fildes();
-	if (tcp_sv.get_fildes() > max_fd)
-		max_fd = tcp_sv.get_fildes();
-	while (!exit_server) {
-		FD_ZERO(&r_fds);
-		FD_SET(udp_conn.get_fildes(), &r_fds);
-		FD_SET(tcp_sv.get_fildes(), &r_fds);
-		int counter = select(max_fd + 1, &r_fds, nullptr, nullptr, nullptr);
-		if (counter <= 0) {
-			std::cout << "Failed to select the udp/tcp connection\n";
-			break;
+	net::executor ex{opts.use_uring_net};
+	if (!ex.valid()) {
+		std::cout << "Failed to start the event loop.\n";
+		return 1;
+	}
+	if (opts.use_uring_net && !ex.uses_uring())
+		std::cout << "io_uring is not available, serving the network through epoll.\n";
+	if (tcp_sv) {
+		int flags = fcntl(tcp_sv->get_fildes(), F_GETFL);
+		if (flags == -1 || fcntl(tcp_sv->get_fildes(), F_SETFL, flags | O_NONBLOCK) == -1) {
+			std::cout << "Failed to set the tcp connection to non-blocking mode.\n";
+			return 1;
 		}
-		try {
-			if (FD_ISSET(udp_conn.get_fildes(), &r_fds))
-				handle_udp(udp_conn, udp_actions);
-		} catch (net::socket_closed_error& err) { // ignore (client closed early)
-		} catch (net::socket_error& err) {
-			std::cout << "Socket error" << err.what() << "(terminating)\n";
-			break;
-		} catch (net::system_error& err) {
-			std::cout << "System error: " << err.what() << "(terminating)\n";
-			break;
-		} catch (net::io_error& err) {
-			std::cout << "IO error: " << err.what() << "(terminating)\n";
-			break;
-		} catch (net::corruption_error& err) {
-			std::cout << "Server corruption: " << err.what() << "(ignoring)\n";
-		} catch (std::exception& err) {
-			std::cout << "Unexpected exception: " << err.what() << "(terminating)\n";
-			break;
-		} catch (...) {
-			std::cout << "Unknown exception (terminating)\n";
-			break;
+	}
+	ex.on_batch_end([&disk]() { disk.commit(); });
+	running = &ex;
+	if (interrupted)
+		ex.stop();
+	rate_limiter udp_limiter{opts.rate, opts.burst};
+	rate_limiter tcp_limiter{opts.rate, opts.burst};
+	udp_intake intake;
+	net::async_udp_connection async_udp_conn{ex, udp_conn};
+	ex.spawn(serve_udp(async_udp_conn, udp_limiter, intake));
+	std::optional<net::async_tcp_server> async_tcp_sv;
+	if (tcp_sv) {
+		async_tcp_sv.emplace(ex, *tcp_sv);
+		ex.spawn(serve_tcp(*async_tcp_sv, tcp_actions, tcp_limiter, nullptr));
+		ex.spawn(feed.sweep());
+	} else
+		ex.spawn(serve_routed(channel, tcp_actions));
+	if (opts.snapshot_every != 0)
+		ex.spawn(take_snapshots(opts.snapshot_every));
+	uint64_t expired = 0;
+	if (opts.expire_every != 0)
+		ex.spawn(sweep_expired(opts.expire_every, expired));
+	if (recovering && !recovering->done())
+		ex.spawn(recover_meanwhile(*recovering));
+	try {
+		ex.run();
+	} catch (std::exception& err) {
+		report_error(std::current_exception());
+	}
+	running = nullptr;
+	if (udp_limiter.enabled()) {
+		std::cout << "Rate limited " << udp_limiter.rejected() << " udp requests and "
+			<< tcp_limiter.rejected() << " tcp connections.\n";
+	}
+	if (intake.stale() + intake.shed_new() + intake.shed_full() != 0) {
+		std::cout << "Overloaded: dropped " << intake.stale() << " stale udp requests, "
+			<< intake.shed_new() << " new games and " << intake.shed_full() << " udp requests with the queue full.\n";
+	}
+	resident_stats resident = get_resident_stats();
+	if (resident.hits + resident.misses != 0) {
+		std::cout << "Active games in memory: " << resident.hits << " hits, " << resident.misses << " misses ("
+			<< 100 * resident.hits / (resident.hits + resident.misses) << "% hit rate), "
+			<< resident.evictions << " evicted, " << resident.games << " kept.\n";
+	}
+	if (opts.expire_every != 0) {
+		session_stats sessions = get_session_stats();
+		std::cout << "Sessions: " << sessions.games << " active (" << sessions.debug << " in debug mode) with "
+			<< sessions.trials << " trials played, " << expired << " expired by the sweeps.\n";
+	}
+	if (feed.pushes() != 0) {
+		std::cout << "Scoreboard feed: " << feed.pushes() << " pushes (" << feed.coalesced()
+			<< " updates coalesced), " << feed.subscribers() << " still subscribed.\n";
+	}
+	return 0;
+}
+
+/// Starts opts.shards shard processes, each owning a range of player ids
+/// (see shard.hpp), and routes the tcp requests to them.
+/// The kernel steers each udp request to the socket of its shard.
+static int serve_sharded(const options& opts) {
+	std::vector<net::udp_connection> udp_conns;
+	for (int i = 0; i < opts.shards; i++) {
+		udp_conns.emplace_back(net::self_address{opts.port, SOCK_DGRAM}, DEFAULT_TIMEOUT, true);
+		if (!udp_conns.back().valid()) {
+			std::cout << "Failed to open udp connection at " << opts.port << ".\n";
+			return 1;
+		}
+	}
+	if (!steer_by_plid(udp_conns.front().get_fildes(), opts.shards)) {
+		std::cout << "Failed to steer the udp requests to the shards.\n";
+		return 1;
+	}
+	std::vector<int> channels; // router's ends
+	std::vector<int> shard_channels;
+	for (int i = 0; i < opts.shards; i++) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+			std::cout << "Failed to open the channels to the shards.\n";
+			return 1;
+		}
+		channels.push_back(pair[0]);
+		shard_channels.push_back(pair[1]);
+	}
+	std::cout.flush(); // or the shards print it again
+	std::vector<pid_t> pids;
+	for (int i = 0; i < opts.shards; i++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			std::cout << "Failed to start the shards.\n";
+			for (pid_t started : pids)
+				kill(started, SIGINT);
+			return 1;
+		}
+		if (pid != 0) {
+			pids.push_back(pid);
+			continue;
+		}
+		prctl(PR_SET_PDEATHSIG, SIGINT); // stop with the router
+		for (int j = 0; j < opts.shards; j++) {
+			close(channels[j]);
+			if (j != i)
+				close(shard_channels[j]);
+		}
+		net::udp_connection udp_conn{std::move(udp_conns[i])};
+		udp_conns.clear();
+		int res = serve(opts, udp_conn, nullptr, i, shard_channels[i]);
+		close(shard_channels[i]);
+		return final_snapshot(opts, res);
+	}
+	for (int channel : shard_channels)
+		close(channel);
+	udp_conns.clear(); // each shard has its own
+
+	net::tcp_server tcp_sv{{opts.port, SOCK_STREAM}};
+	int res = tcp_sv.valid() ? 0 : 1;
+	if (res != 0)
+		std::cout << "Failed to open tcp connection at " << opts.port << ".\n";
+	int flags = fcntl(tcp_sv.get_fildes(), F_GETFL);
+	if (res == 0 && (flags == -1 || fcntl(tcp_sv.get_fildes(), F_SETFL, flags | O_NONBLOCK) == -1)) {
+		std::cout << "Failed to set the tcp connection to non-blocking mode.\n";
+		res = 1;
+	}
+	if (res == 0) {
+		tcp_action_map tcp_actions; // the router only handles these itself
+		tcp_actions.add_action("KAL", start_keep_alive);
+		tcp_actions.add_action("SUB", subscribe_scoreboard);
+		routing = true;
+		net::executor ex{opts.use_uring_net};
+		shard_router router{ex, std::move(channels)};
+		rate_limiter tcp_limiter{opts.rate, opts.burst};
+		net::async_tcp_server async_tcp_sv{ex, tcp_sv};
+		if (!ex.valid()) {
+			std::cout << "Failed to start the event loop.\n";
+			res = 1;
+		} else {
+			running = &ex;
+			if (interrupted)
+				ex.stop();
+			for (int i = 0; i < router.shards(); i++)
+				ex.spawn(collect_shard(router, i));
+			ex.spawn(serve_tcp(async_tcp_sv, tcp_actions, tcp_limiter, &router));
+			ex.spawn(feed.sweep());
+			ex.spawn(watch_boards());
+			try {
+				ex.run();
+			} catch (std::exception& err) {
+				report_error(std::current_exception());
+			}
+			running = nullptr;
+			if (tcp_limiter.enabled())
+				std::cout << "Rate limited " << tcp_limiter.rejected() << " tcp connections.\n";
+			if (feed.pushes() != 0) {
+				std::cout << "Scoreboard feed: " << feed.pushes() << " pushes (" << feed.coalesced()
+					<< " updates coalesced), " << feed.subscribers() << " still subscribed.\n";
+			}
 		}
+	}
+	std::cout.flush();
+	for (pid_t pid : pids)
+		kill(pid, SIGINT);
+	while (wait(nullptr) != -1 || errno == EINTR) // SIGCHLD is ignored => until they all exit
+		continue;
+	return res;
+}
+
+/// Once the server stopped (serving returned 'res'), saves a last snapshot,
+/// if they were asked for, so that the next start begins where it ended.
+/// Returns 'res'.
+static int final_snapshot(const options& opts, int res) {
+	if (res == 0 && opts.snapshot_every != 0 && !snapshot(false))
+		std::cout << "Failed to save the snapshot.\n";
+	return res;
+}
+
+/// Snapshots the games every 'every' seconds, in the background (see snapshot)
+static net::task<void> take_snapshots(double every) {
+	net::executor& ex = net::executor::current();
+	while (true) {
+		co_await ex.sleep(static_cast<int>(every * 1000));
+		bool taken = co_await disk_op([]() { return snapshot(); });
+		if (!taken)
+			std::cout << "Failed to take a snapshot.\n";
+	}
+}
+
+/// Ends the games whose time ran out every 'every' seconds (see
+/// expire_games), adding them up in 'expired'
+static net::task<void> sweep_expired(double every, uint64_t& expired) {
+	net::executor& ex = net::executor::current();
+	while (true) {
+		co_await ex.sleep(static_cast<int>(every * 1000));
 		try {
-			if (FD_ISSET(tcp_sv.get_fildes(), &r_fds))
-				handle_tcp(tcp_sv, tcp_actions);
-		} catch (net::socket_closed_error& err) { // ignore (client closed early)
-		} catch (net::socket_error& err) {
-			std::cout << "Socket error" << err.what() << "(terminating)\n";
-			break;
-		} catch (net::system_error& err) {
-			std::cout << "System error: " << err.what() << "(terminating)\n";
-			break;
-		} catch (net::io_error& err) {
-			std::cout << "IO error: " << err.what() << "(terminating)\n";
-			break;
-		} catch (net::corruption_error& err) {
-			std::cout << "Server corruption: " << err.what() << "(ignoring)\n";
-		} catch (std::exception& err) {
-			std::cout << "Unexpected exception: " << err.what() << "(terminating)\n";
-			break;
-		} catch (...) {
-			std::cout << "Unknown exception (terminating)\n";
-			break;
+			expired += co_await disk_op([]() { return expire_games(); });
+		} catch (std::exception& err) { // (io_uring failed a job) => the rest is tried again
+			std::cout << "Failed to end the expired games: " << err.what() << '\n';
 		}
 	}
-	return 0;
 }
 
-/// Handles incoming UDP connections. It listens for incoming udp requests,
-/// executes the corresponding actions and communicates the results to the client
-static void handle_udp(net::udp_connection& udp_conn, const udp_action_map& actions) {
-	net::other_address client_addr;
-	auto request = udp_conn.listen(client_addr);
+/// Publishes the scoreboard to the feed if its top list changed since it
+/// was published last (the router merges the scoreboards of the shards)
+static net::task<void> refresh_feed() {
+	uint64_t version = feed.version();
+	std::string name;
+	std::string sb;
+	bool changed = co_await disk_op([&]() {
+		if (routing)
+			return scoreboard::merged_since(version, name, sb);
+		return scoreboard::changed_since(version, name, sb);
+	});
+	if (changed)
+		feed.publish(version, name, std::move(sb));
+}
+
+/// Refreshes the feed in the background, stopping the server on fatal errors
+static net::task<void> publish_scoreboard() {
 	try {
-		actions.execute(request, udp_conn, client_addr);
-	} catch (net::syntax_error& err) { // unknown req
-		verbose::write(client_addr, "unknown request", "?");
-		net::out_stream out;
-		out.write("ERR").prime();
-		udp_conn.answer(out, client_addr);
+		co_await refresh_feed();
+	} catch (...) {
+		if (!report_error(std::current_exception()))
+			net::executor::current().stop();
 	}
 }
 
-/// Handles incoming TCP connections. It accepts incoming TCP client connections and
-/// creates a child process to habdle each connection. Each child process executes the
-/// corresponding actions and communicates the results to the client
-static void handle_tcp(net::tcp_server& tcp_sv, const tcp_action_map& actions) {
-	net::other_address client_addr;
-	auto tcp_conn = tcp_sv.accept_client(client_addr);
-	pid_t pid = fork();
-	if (pid == -1)
-		throw net::system_error{"Failed to fork for tcp client"};
-	if (pid != 0)
-		return;
-	exit_server = true;
-	net::stream<net::tcp_source> request = tcp_conn.to_stream();
+/// Looks for changes of the shards' scoreboards every FEED_MIN_INTERVAL, as
+/// long as anyone is subscribed (the router does not see the games won)
+static net::task<void> watch_boards() {
+	net::executor& ex = net::executor::current();
+	while (true) {
+		co_await ex.sleep(FEED_MIN_INTERVAL);
+		if (feed.subscribers() != 0)
+			co_await publish_scoreboard();
+	}
+}
+
+/// Runs the startup recovery to the end before the server starts,
+/// reporting its progress
+static void recover_now(recovery& rec) {
+	for (int i = 1; !rec.done(); i++) {
+		usleep(RECOVERY_MERGE_MS * 1000);
+		rec.merge();
+		if (i % (RECOVERY_REPORT_MS / RECOVERY_MERGE_MS) == 0)
+			rec.report();
+	}
+	rec.report();
+}
+
+/// Runs the startup recovery while the server serves requests, reporting
+/// its progress
+static net::task<void> recover_meanwhile(recovery& rec) {
+	net::executor& ex = net::executor::current();
+	for (int i = 1; !rec.done(); i++) {
+		co_await ex.sleep(RECOVERY_MERGE_MS);
+		co_await disk_op([&rec]() { rec.merge(); });
+		if (i % (RECOVERY_REPORT_MS / RECOVERY_MERGE_MS) == 0)
+			rec.report();
+	}
+	rec.report();
+}
+
+/// Reads the (positive) number of requests per second after argv[argi].
+/// Returns true on success; false otherwise.
+static bool read_rate(int argc, char** argv, int argi, double& rate) {
+	if (argi + 1 == argc)
+		return false;
+	char* end;
+	rate = std::strtod(argv[argi + 1], &end);
+	return *argv[argi + 1] != '\0' && *end == '\0' && rate > 0;
+}
+
+/// Reports an error that escaped a request handler.
+/// Returns true if the server can keep running; false if it must terminate.
+static bool report_error(std::exception_ptr error) {
 	try {
-		actions.execute(request, tcp_conn, client_addr);
-	} catch (net::interaction_error& err) {
-		verbose::write(client_addr, "unknown request", "?");
-		net::out_stream out;
-		out.write("ERR").prime();
-		tcp_conn.answer(out);
-	} catch (std::exception&  err) {
-		std::cout << "Child tcp process encountered an exception: " << err.what() << '\n';
+		std::rethrow_exception(error);
+	} catch (net::socket_closed_error& err) { // ignore (client closed early)
+	} catch (net::socket_error& err) {
+		std::cout << "Socket error" << err.what() << "(terminating)\n";
+		return false;
+	} catch (net::system_error& err) {
+		std::cout << "System error: " << err.what() << "(terminating)\n";
+		return false;
+	} catch (net::io_error& err) {
+		std::cout << "IO error: " << err.what() << "(terminating)\n";
+		return false;
+	} catch (net::corruption_error& err) {
+		std::cout << "Server corruption: " << err.what() << "(ignoring)\n";
+	} catch (std::exception& err) {
+		std::cout << "Unexpected exception: " << err.what() << "(terminating)\n";
+		return false;
+	} catch (...) {
+		std::cout << "Unknown exception (terminating)\n";
+		return false;
 	}
+	return true;
 }
 
-/// Handles the 'start' command received from a client by creating a new game
-/// (only if the received plid doesn't have an ongoing game)
-static void start_new_game(net::stream<net::udp_source>& req,
-							const net::udp_connection& udp_conn,
-							const net::other_address& client_addr) {
-	net::out_stream out_strm;
-	out_strm.write("RSG");
-	net::message fields;
+/// Returns the handler of the (valid) request 'req' (ready to be co_await'ed).
+static net::task<void> execute_udp(const net::game_request& req, const udp_peer& peer) {
+	switch (req.op) {
+	case net::game_op::START:
+		return start_new_game(req, peer);
+	case net::game_op::TRY:
+		return do_try(req, peer);
+	case net::game_op::QUIT:
+		return end_game(req, peer);
+	default: // DEBUG
+		return start_new_game_debug(req, peer);
+	}
+}
+
+/// Handles an incoming UDP request, text or binary (see frames.hpp): executes
+/// the corresponding action, which communicates the result to the client in
+/// the same framing. Stops the server on fatal errors
+static net::task<void> handle_udp(const net::async_udp_connection& udp_conn, udp_intake& intake,
+								std::string datagram, net::other_address client_addr) {
+	udp_peer peer{udp_conn, client_addr, net::is_binary(datagram)};
+	std::exception_ptr error;
 	try {
-		fields = req.read({{PLID_SIZE, PLID_SIZE}, {1, MAX_PLAYTIME_SIZE}});
-		req.check_strict_end();
+		net::game_op op = peer.binary ? net::binary_op(datagram) : net::text_op(datagram);
+		net::expected<net::game_request> req = net::failure{net::failure::kind::SYNTAX, "Unknown request"};
+		if (op != net::game_op::NONE)
+			req = peer.binary ? net::decode_request(datagram) : net::parse_request(op, datagram);
+		if (req)
+			co_await execute_udp(*req, peer);
+		else if (op == net::game_op::NONE) { // unknown req
+			verbose::write(client_addr, "unknown request", "?");
+			peer.answer({net::game_op::NONE, net::game_status::ERR});
+		} else {
+			verbose::write(client_addr,
+				std::string{"malformed "} + net::op_name(op) + " request",
+				req.error().what
+			);
+			peer.answer({op, net::game_status::ERR});
+		}
+	} catch (...) {
+		error = std::current_exception();
+	}
+	intake.release();
+	if (error && !report_error(error))
+		net::executor::current().stop();
+}
+
+/// Listens for incoming udp requests, handling each one in its own coroutine
+/// Requests over the rate limit, or refused by the intake (overload control),
+/// are dropped before they are even parsed
+static net::task<void> serve_udp(net::async_udp_connection& udp_conn, rate_limiter& limiter, udp_intake& intake) {
+	net::executor& ex = net::executor::current();
+	try {
+		std::string datagram;
+		net::other_address client_addr;
+		timespec received;
+		while (true) {
+			co_await udp_conn.listen(datagram, client_addr, &received);
+			if (!limiter.allow(client_addr) || !intake.admit(datagram, received))
+				continue;
+			ex.spawn(handle_udp(udp_conn, intake, std::move(datagram), client_addr));
+		}
+	} catch (...) {
+		report_error(std::current_exception());
+	}
+	ex.stop();
+}
+
+/// Executes the action corresponding to the tcp request 'msg', which
+/// communicates the result to the client.
+/// co_await evaluates to false if the request was unknown (and the client
+/// was told so); true otherwise.
+static net::task<bool> execute_tcp(const tcp_action_map& actions, net::async_tcp_connection& tcp_conn,
+								const std::string& msg, const net::other_address& client_addr) {
+	net::stream<net::tcp_buffer_source> request{std::string_view{msg}};
+	bool failed = false;
+	try {
+		co_await actions.execute(request, tcp_conn, client_addr);
 	} catch (net::interaction_error& err) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, "malformed start request", "?");
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		failed = true;
 	}
-	if (!net::is_valid_plid(fields[0])) {
-		out_strm.write("ERR").prime();
-		verbose::write(
-			client_addr, "malformed player id",
-			"PLID=", fields[0],
-			", DURATION=", fields[1]
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+	if (!failed)
+		co_return true;
+	verbose::write(client_addr, "unknown request", "?");
+	co_await tcp_conn.answer(net::error_reply::make());
+	co_return false;
+}
+
+/// Serves a TCP client: executes the action corresponding to its request, which
+/// communicates the result to the client.
+/// If the client asked for keep-alive, it keeps serving the requests sent on
+/// the connection (in order) until it stays idle for DEFAULT_IDLE_TIMEOUT seconds
+/// The requests 'router' routes to a shard are handed over to it instead
+static net::task<void> handle_tcp(net::tcp_connection conn, net::other_address client_addr,
+								const tcp_action_map& actions, shard_router* router) {
+	net::async_tcp_connection tcp_conn{net::executor::current(), std::move(conn)};
+	try {
+		std::string msg;
+		int timeout = DEFAULT_TIMEOUT * 1000;
+		while (tcp_conn.valid()) {
+			bool received = co_await tcp_conn.receive(msg, timeout);
+			if (!received)
+				break;
+			int shard = router ? router->route(msg) : -1;
+			bool keep;
+			if (shard != -1)
+				keep = co_await router->forward(shard, tcp_conn.get_fildes(), msg);
+			else
+				keep = co_await execute_tcp(actions, tcp_conn, msg, client_addr);
+			if (!keep) // (unknown => cannot find where the next request starts)
+				break;
+			if (!tcp_conn.keep_alive())
+				break;
+			timeout = DEFAULT_IDLE_TIMEOUT * 1000;
+		}
+	} catch (net::socket_closed_error& err) { // ignore (client closed early)
+	} catch (std::exception& err) {
+		std::cout << "Tcp client encountered an exception: " << err.what() << '\n';
 	}
-	
-	if (!net::is_valid_max_playtime(fields[1])) {
-		out_strm.write("ERR").prime();
-		verbose::write(
-			client_addr, "malformed duration",
-			"PLID=", fields[0],
-			", DURATION=", fields[1]
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+}
+
+/// Accepts incoming TCP clients, serving each one in its own coroutine
+/// Clients over the rate limit are disconnected right away
+static net::task<void> serve_tcp(net::async_tcp_server& tcp_sv, const tcp_action_map& actions,
+								rate_limiter& limiter, shard_router* router) {
+	net::executor& ex = net::executor::current();
+	try {
+		net::other_address client_addr;
+		while (true) {
+			net::tcp_connection conn = co_await tcp_sv.accept_client(client_addr);
+			if (!limiter.allow(client_addr))
+				continue; // closes it
+			ex.spawn(handle_tcp(std::move(conn), client_addr, actions, router));
+		}
+	} catch (...) {
+		report_error(std::current_exception());
 	}
+	ex.stop();
+}
 
-	game res;
+/// Receives the answers of 'shard' for the router, stopping the server
+/// if the shard stops
+static net::task<void> collect_shard(shard_router& router, int shard) {
 	try {
-		res = game::create(fields[0].c_str(), std::stoul(fields[1]));
-	} catch (net::game_error& err) {
-		out_strm.write("NOK").prime();
-		verbose::write(
-			client_addr, "game already underway",
-			"PLID=", fields[0],
-			", DURATION=", fields[1]
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		co_await router.collect(shard);
+	} catch (...) {
+		report_error(std::current_exception());
 	}
-	out_strm.write("OK").prime();
-	verbose::write(
-		client_addr, "created new game",
-		"PLID=", fields[0],
-		", DURATION=", fields[1]
-	);
-	udp_conn.answer(out_strm, client_addr);
+	net::executor::current().stop();
 }
 
-/// Handles a request to end an ongoing game (if there is one) of a given player.
-static void end_game(net::stream<net::udp_source>& req,
-					const net::udp_connection& udp_conn,
-					const net::other_address& client_addr) {
-	net::out_stream out_strm;
-	out_strm.write("RQT");
-	net::field plid;
+/// Serves a tcp request handed over by the router, answering the client
+/// directly, and then tells the router it is done
+static net::task<void> handle_routed(int channel, const tcp_action_map& actions, shard_request req) {
+	net::other_address client_addr;
+	client_addr.addrlen = sizeof(client_addr.addr);
+	if (getpeername(req.fd, reinterpret_cast<sockaddr*>(&client_addr.addr), &client_addr.addrlen) == -1)
+		client_addr.addrlen = 0; // only used for logging
+	net::async_tcp_connection tcp_conn{net::executor::current(), net::tcp_connection{req.fd}};
+	bool keep = false;
 	try {
-		plid = req.read(PLID_SIZE, PLID_SIZE);
-		req.check_strict_end();
-	} catch (net::interaction_error& err) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, 
-			"malformed quit request",
-			"?"
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		keep = co_await execute_tcp(actions, tcp_conn, req.msg, client_addr);
+	} catch (net::socket_closed_error& err) { // ignore (client closed early)
+	} catch (std::exception& err) {
+		std::cout << "Tcp client encountered an exception: " << err.what() << '\n';
 	}
-	if (!net::is_valid_plid(plid)) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, 
-			"invalid plid in quit request",
-			"PLID=", plid
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+	try {
+		send_done(channel, req.id, keep); // (keep-alive is up to the router)
+	} catch (...) {
+		if (!report_error(std::current_exception()))
+			net::executor::current().stop();
 	}
+}
 
-	game gm;
+/// Serves the tcp requests the router hands over through 'channel' (for
+/// shards of a sharded server), each one in its own coroutine
+static net::task<void> serve_routed(int channel, const tcp_action_map& actions) {
+	net::executor& ex = net::executor::current();
 	try {
-		gm = game::find_active(plid.c_str());
-		if (gm.has_ended() != game::result::ONGOING)
-			throw net::game_error{"No active games"};
-	} catch (net::game_error& err) {
-		out_strm.write("NOK").prime();
+		shard_request req;
+		while (true) {
+			co_await ex.readable(channel);
+			while (receive_request(channel, req))
+				ex.spawn(handle_routed(channel, actions, std::move(req)));
+		}
+	} catch (...) {
+		report_error(std::current_exception());
+	}
+	ex.stop();
+}
+
+/// Handles the 'start' command received from a client by creating a new game
+/// (only if the received plid doesn't have an ongoing game)
+static net::task<void> start_new_game(const net::game_request& req, const udp_peer& peer) {
+	std::string_view plid{req.plid, PLID_SIZE};
+	auto guard = co_await plid_locks.lock(std::string{plid});
+	bool created = co_await disk_op([&]() { return game::try_create(req.plid, req.playtime).has_value(); });
+	if (!created) {
 		verbose::write(
-			client_addr, "plid did not have an ongoing game for quit request",
+			peer.addr, "game already underway",
+			"PLID=", plid,
+			", DURATION=", req.playtime
+		);
+		peer.answer({net::game_op::START, net::game_status::NOK});
+		co_return;
+	}
+	verbose::write(
+		peer.addr, "created new game",
+		"PLID=", plid,
+		", DURATION=", req.playtime
+	);
+	peer.answer({net::game_op::START, net::game_status::OK});
+}
+
+/// Handles a request to end an ongoing game (if there is one) of a given player.
+static net::task<void> end_game(const net::game_request& req, const udp_peer& peer) {
+	std::string_view plid{req.plid, PLID_SIZE};
+	auto guard = co_await plid_locks.lock(std::string{plid});
+	net::expected<game> found = co_await disk_op([&]() {
+		net::expected<game> active = game::try_find_active(req.plid);
+		if (active && active->has_ended() != game::result::ONGOING)
+			return net::expected<game>{net::failure{net::failure::kind::GAME, "No active games"}};
+		return active;
+	});
+	if (!found) {
+		verbose::write(
+			peer.addr, "plid did not have an ongoing game for quit request",
 			"PLID=", plid
 		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		peer.answer({net::game_op::QUIT, net::game_status::NOK});
+		co_return;
 	}
 
+	game& gm = *found;
 	try {
-		gm.quit();
+		co_await disk_op([&]() { gm.quit(); });
 	} catch (net::game_error& err) {
-		out_strm.write("NOK").prime();
 		verbose::write(
-			client_addr, "game in active directory was unexpectedly terminated",
+			peer.addr, "game in active directory was unexpectedly terminated",
 			"PLID=", plid
 		);
-		udp_conn.answer(out_strm, client_addr);
+		peer.answer({net::game_op::QUIT, net::game_status::NOK});
 		throw net::corruption_error{"Game in active directory was unexpectedly terminated"};
 	}
-	out_strm.write("OK");
-	for (int i = 0; i < GUESS_SIZE; i++)
-		out_strm.write(gm.secret_key()[i]);
-	out_strm.prime();
 	verbose::write(
-		client_addr, "quit game",
+		peer.addr, "quit game",
 		"PLID=", plid
 	);
-	udp_conn.answer(out_strm, client_addr);
+	net::game_reply rep{net::game_op::QUIT, net::game_status::OK};
+	std::memcpy(rep.key, gm.secret_key(), GUESS_SIZE);
+	peer.answer(rep);
 }
 
 /// Handles the 'debug' command received from a client by creating a new game
 /// with the given secret key. (a new game is created only if the plid doesn't
-/// have an ongoing game)                                                                                                                                                 )
-static void start_new_game_debug(net::stream<net::udp_source>& req,
-								const net::udp_connection& udp_conn,
-								const net::other_address& client_addr) {
-	net::out_stream out_strm;
-	out_strm.write("RDB");
-	net::message fields;
-	try {
-		fields = req.read({{PLID_SIZE, PLID_SIZE}, {1, MAX_PLAYTIME_SIZE}});
-	} catch (net::interaction_error& err) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, "malformed debug request", "?");
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-	if (!net::is_valid_plid(fields[0])) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr,
-			"malformed player id",
-			"PLID=", fields[0]
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-	if (!net::is_valid_max_playtime(fields[1])) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr,
-			"malformed duration",
-			"PLID=", fields[0],
-			", DURATION=", fields[1]
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-	char secret_key[GUESS_SIZE];
-	for (int i = 0; i< GUESS_SIZE; i++) {
-		net::field col;
-		try {
-			col = req.read(1, 1);
-			if (!net::is_valid_color(col))
-				throw net::syntax_error{"Bad color"};
-		} catch (net::interaction_error& err) {
-			out_strm.write("ERR").prime();
-			secret_key[i] = '\0';
-			verbose::write(client_addr,
-				"malformed color",
-				"PLID=", fields[0],
-				", DURATION=", fields[1],
-				", CODE[0:", i, "]=", secret_key
-			);
-			udp_conn.answer(out_strm, client_addr);
-			return;
-		}
-		secret_key[i] = col[0];
-	}
-	try {
-		req.check_strict_end();
-	} catch (net::interaction_error& error) {
-		out_strm.write("ERR").prime();
+/// have an ongoing game)
+static net::task<void> start_new_game_debug(const net::game_request& req, const udp_peer& peer) {
+	std::string_view plid{req.plid, PLID_SIZE};
+	std::string_view secret_key{req.code, GUESS_SIZE};
+	auto guard = co_await plid_locks.lock(std::string{plid});
+	bool created = co_await disk_op([&]() {
+		return game::try_create(req.plid, req.playtime, req.code).has_value();
+	});
+	if (!created) {
 		verbose::write(
-			client_addr, "malformed debug request",
-			"PLID=", fields[0],
-			", DURATION=", fields[1],
-			", CODE=", std::string_view{secret_key, GUESS_SIZE}
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-
-	game res;
-	try {
-		res = game::create(fields[0].c_str(), std::stoul(fields[1]), secret_key);
-	} catch (net::game_error& err) {
-		out_strm.write("NOK").prime();
-		verbose::write(
-			client_addr, "game already underway",
-			"PLID=", fields[0],
-			", DURATION=", fields[1],
-			", CODE=", std::string_view{secret_key, GUESS_SIZE}
+			peer.addr, "game already underway",
+			"PLID=", plid,
+			", DURATION=", req.playtime,
+			", CODE=", secret_key
 		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		peer.answer({net::game_op::DEBUG, net::game_status::NOK});
+		co_return;
 	}
-	out_strm.write("OK").prime();
 	verbose::write(
-		client_addr, "created new game",
-		"PLID=", fields[0],
-		", DURATION=", fields[1],
-		", CODE=", std::string_view{secret_key, GUESS_SIZE}
+		peer.addr, "created new game",
+		"PLID=", plid,
+		", DURATION=", req.playtime,
+		", CODE=", secret_key
 	);
-	udp_conn.answer(out_strm, client_addr);
+	peer.answer({net::game_op::DEBUG, net::game_status::OK});
+}
+
+/// Returns the reply to a try that ended the game of 'gm' (ENT or ETM),
+/// which reveals the secret key.
+static net::game_reply key_reply(net::game_status status, const game& gm) {
+	net::game_reply rep{net::game_op::TRY, status};
+	std::memcpy(rep.key, gm.secret_key(), GUESS_SIZE);
+	return rep;
+}
+
+/// Returns the reply to an accepted try (the trial and its counts).
+static net::game_reply result_reply(const game& gm) {
+	net::game_reply rep{net::game_op::TRY, net::game_status::OK};
+	rep.trial = gm.current_trial();
+	rep.nB = gm.last_trial()->nB;
+	rep.nW = gm.last_trial()->nW;
+	return rep;
 }
 
 /// Handles the 'try' command received from a client by checking if the guess made
 /// by the player is the secret key. Also checks if the maximum number of trials
 /// has been exceeded or if the maximum playtime has been reached (in this cases
 /// the player loses the game)
-static void do_try(net::stream<net::udp_source>& req,
-					const net::udp_connection& udp_conn,
-					const net::other_address& client_addr) {
-	net::out_stream out_strm;
-	out_strm.write("RTR");
-	net::field plid;
-	try {
-		plid = req.read(PLID_SIZE, PLID_SIZE);
-	} catch (net::interaction_error& err) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, 
-			"malformed try request",
-			"?"
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-	if (!net::is_valid_plid(plid)) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, 
-			"invalid plid",
-			"PLID=", plid
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-
+static net::task<void> do_try(const net::game_request& req, const udp_peer& peer) {
+	std::string_view plid{req.plid, PLID_SIZE};
 	char play[GUESS_SIZE];
-	for (int i = 0; i< GUESS_SIZE; i++) {
-		net::field col;
-		try {
-			col = req.read(1, 1);
-			if (!net::is_valid_color(col))
-				throw net::syntax_error{"Bad color"};
-		} catch (net::interaction_error& err) {
-			play[i] = '\0';
-			out_strm.write("ERR").prime();
-			verbose::write(client_addr, 
-				"invalid guess color",
-				"PLID=", plid,
-				", GUESS[0:", i, "]=", play
-			);
-			udp_conn.answer(out_strm, client_addr);
-			return;
-		}
-		play[i] = col[0];
-	}
+	std::memcpy(play, req.code, GUESS_SIZE);
+	std::string_view guess{play, GUESS_SIZE};
+	char trial = req.trial;
 
-	char trial;
-	try {
-		trial = req.read(1, 1)[0];
-		req.check_strict_end();
-	} catch (net::interaction_error& err) {
-		out_strm.write("ERR").prime();
-		verbose::write(client_addr, 
-			"could not read trial number/incorrect message ending",
-			"PLID=", plid,
-			", GUESS=", std::string_view{play, GUESS_SIZE}
-		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
-	}
-
-	game gm;
-	try {
-		gm = game::find_active(plid.c_str());
-	} catch (net::game_error& err) {
-		out_strm.write("NOK").prime();
-		verbose::write(client_addr, 
+	auto guard = co_await plid_locks.lock(std::string{plid});
+	net::expected<game> found = co_await disk_op([&]() { return game::try_find_active(req.plid); });
+	if (!found) {
+		verbose::write(peer.addr,
 			"plid did not have an ongoing game",
 			"PLID=", plid,
-			", GUESS=", std::string_view{play, GUESS_SIZE},
+			", GUESS=", guess,
 			", TRIAL_NUMBER=", trial
 		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		peer.answer({net::game_op::TRY, net::game_status::NOK});
+		co_return;
 	}
 
-	if (gm.has_ended() == game::result::LOST_TIME) {
-		out_strm.write("ETM");
-		for (int i = 0; i < GUESS_SIZE; i++)
-			out_strm.write(gm.secret_key()[i]);
-		out_strm.prime();
-		verbose::write(client_addr, 
+	game& gm = *found;
+	auto ended = co_await disk_op([&]() { return gm.has_ended(); });
+	if (ended == game::result::LOST_TIME) {
+		verbose::write(peer.addr,
 			"maximum time achieved",
 			"PLID=", plid,
-			", GUESS=", std::string_view{play, GUESS_SIZE},
+			", GUESS=", guess,
 			", TRIAL_NUMBER=", trial
 		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		peer.answer(key_reply(net::game_status::ETM, gm));
+		co_return;
 	}
 
 	char duplicate_at = gm.is_duplicate(play);
 	if (trial != gm.current_trial() + 1) { // unexpected nT
-		// trial received is a resend 
+		// trial received is a resend
 		// (nT = expected - 1 & guess repeats the one of the previous message)
 		if (trial == gm.current_trial() && duplicate_at == gm.current_trial()) {
-			out_strm.write("OK");
-			out_strm.write(gm.current_trial());
-			out_strm.write(gm.last_trial()->nB + '0');
-			out_strm.write(gm.last_trial()->nW + '0').prime();
-			verbose::write(client_addr, 
+			verbose::write(peer.addr,
 				"resend identified, number of trials not increased",
 				"PLID=", plid,
-				", GUESS=", std::string_view{play, GUESS_SIZE},
+				", GUESS=", guess,
 				", TRIAL_NUMBER=", trial
 			);
-			udp_conn.answer(out_strm, client_addr);
-			return;
+			peer.answer(result_reply(gm));
+			co_return;
 		}
 
 		// nT != expected - 1 OR
 		// nT = expected - 1 & guess is different from the previous message
-		out_strm.write("INV").prime();
-		verbose::write(client_addr, 
+		verbose::write(peer.addr,
 			"invalid trial request",
 			"PLID=", plid,
-			", GUESS=", std::string_view{play, GUESS_SIZE},
+			", GUESS=", guess,
 			", TRIAL_NUMBER=", trial
 		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		peer.answer({net::game_op::TRY, net::game_status::INV});
+		co_return;
 	}
 
 	// guess repeats a previous trial's guess
 	if (duplicate_at != MAX_TRIALS + 1) {
-		out_strm.write("DUP").prime();
-		verbose::write(client_addr, 
+		verbose::write(peer.addr,
 			"duplicated guess received",
 			"PLID=", plid,
-			", GUESS=", std::string_view{play, GUESS_SIZE},
+			", GUESS=", guess,
 			", TRIAL_NUMBER=", trial
 		);
-		udp_conn.answer(out_strm, client_addr);
-		return;
+		peer.answer({net::game_op::TRY, net::game_status::DUP});
+		co_return;
 	}
 
-	game::result play_res = gm.guess(play);
+	game::result play_res = co_await disk_op([&]() { return gm.guess(play); });
 	// check enging game conditions
-	if (play_res == game::result::LOST_TIME || play_res == game::result::LOST_TRIES) {
-		if (play_res == game::result::LOST_TIME) {
-			out_strm.write("ETM");
-			verbose::write(client_addr, 
-				"maximum time achieved",
-				"PLID=", plid,
-				", GUESS=", std::string_view{play, GUESS_SIZE},
-				", TRIAL_NUMBER=", trial
-			);
-		}
-		else {
-			out_strm.write("ENT");
-			verbose::write(client_addr, 
-				"maximum number of trials (8) achieved",
-				"PLID=", plid,
-				", GUESS=", std::string_view{play, GUESS_SIZE},
-				", TRIAL_NUMBER=", trial
-			);
-		}
-		for (int i = 0; i < GUESS_SIZE; i++)
-			out_strm.write(gm.secret_key()[i]);
-		out_strm.prime();
-		udp_conn.answer(out_strm, client_addr);
-		return;
+	if (play_res == game::result::LOST_TIME) {
+		verbose::write(peer.addr,
+			"maximum time achieved",
+			"PLID=", plid,
+			", GUESS=", guess,
+			", TRIAL_NUMBER=", trial
+		);
+		peer.answer(key_reply(net::game_status::ETM, gm));
+		co_return;
+	}
+	if (play_res == game::result::LOST_TRIES) {
+		verbose::write(peer.addr,
+			"maximum number of trials (8) achieved",
+			"PLID=", plid,
+			", GUESS=", guess,
+			", TRIAL_NUMBER=", trial
+		);
+		peer.answer(key_reply(net::game_status::ENT, gm));
+		co_return;
 	}
 
 	// trial is valid
-	out_strm.write("OK");
-	out_strm.write(gm.current_trial());
-	out_strm.write(gm.last_trial()->nB + '0');
-	out_strm.write(gm.last_trial()->nW + '0').prime();
-	verbose::write(client_addr, 
+	verbose::write(peer.addr,
 			"try request sucessfully received",
 			"PLID=", plid,
-			", GUESS=", std::string_view{play, GUESS_SIZE},
+			", GUESS=", guess,
 			", TRIAL_NUMBER=", trial
 		);
-	udp_conn.answer(out_strm, client_addr);
+	peer.answer(result_reply(gm));
+	if (play_res == game::result::WON && feed.subscribers() != 0) // (the top list may have changed)
+		net::executor::current().spawn(publish_scoreboard());
 }
 
 /// Handles the 'show trials'/'st' command received from a client by sending a file
-///  containing a list of the trials made by the player. 
-static void show_trials(net::stream<net::tcp_source>& req,
-									  const net::tcp_connection& tcp_conn,
+///  containing a list of the trials made by the player.
+static net::task<void> show_trials(net::stream<net::tcp_buffer_source>& req,
+									  net::async_tcp_connection& tcp_conn,
 									  const net::other_address& client_addr) {
-	net::field plid;
-	net::out_stream out_strm;
-	out_strm.write("RST");
-	try {
-		plid = req.read(PLID_SIZE, PLID_SIZE);
-		req.check_strict_end();
-	} catch (net::interaction_error& err) {
-		out_strm.write("NOK").prime();
-		verbose::write(client_addr, 
+	net::expected<net::trials_request::fields> parsed = net::trials_request::parse(req.text());
+	if (!parsed) {
+		verbose::write(client_addr,
 			"malformed show trials request",
-			"?"
+			parsed.error().what
 		);
-		tcp_conn.answer(out_strm);
-		return;
-	}
-	if (!net::is_valid_plid(plid)) {
-		out_strm.write("NOK").prime();
-		verbose::write(client_addr, 
-			"malformed plid",
-			"PLID=", plid
-		);
-		tcp_conn.answer(out_strm);
-		return;
+		co_await tcp_conn.answer(net::trials_reply::make("NOK"));
+		co_return;
 	}
+	std::string plid{(*parsed)[0]};
 
-	game gm;
-	try {
-		gm = game::find_any(plid.c_str());
-	} catch (net::game_error& err) {
-		out_strm.write("NOK").prime();
-		verbose::write(client_addr, 
+	std::shared_ptr<const std::string> transcript;
+	bool finished = false;
+	bool found = true;
+	{
+		auto guard = co_await plid_locks.lock(plid);
+		try {
+			transcript = co_await disk_op([&]() { return game::transcript(plid.c_str(), finished); });
+		} catch (net::game_error& err) {
+			found = false;
+		}
+	}
+	if (!found) {
+		verbose::write(client_addr,
 			"no recorded games for this player",
 			"PLID=", plid
 		);
-		tcp_conn.answer(out_strm);
-		return;
-	}
-
-	game::result res = gm.has_ended();
-	std::string out = gm.to_string();
-	if (res != game::result::ONGOING)
-		out_strm.write("FIN");
-	else
-		out_strm.write("ACT");
-	out_strm.write("STATE_" + plid + ".txt");
-	out_strm.write(std::to_string(out.size()));
-	out_strm.write(out).prime();
-	verbose::write(client_addr, 
+		co_await tcp_conn.answer(net::trials_reply::make("NOK"));
+		co_return;
+	}
+
+	verbose::write(client_addr,
 			"list of previously made trials sent",
 			"PLID=", plid
 		);
-	tcp_conn.answer(out_strm);
-	return;
+	co_await tcp_conn.answer(
+		net::trials_file_reply::header(
+			finished ? "FIN" : "ACT",
+			"STATE_" + plid + ".txt",
+			net::decimal(transcript->size()).view()
+		),
+		*transcript
+	);
 }
 
 /// Handles the 'show scoreboard'/'sb' command received from a client by sending a file
 /// containing the scoreboard (the top 10 scores)
-static void show_scoreboard(net::stream<net::tcp_source>& req,
-							const net::tcp_connection& tcp_conn,
+static net::task<void> show_scoreboard(net::stream<net::tcp_buffer_source>& req,
+							net::async_tcp_connection& tcp_conn,
 							const net::other_address& client_addr) {
-	try {
-		req.check_strict_end();
-	} catch (net::interaction_error& err) {
-		verbose::write(client_addr, "unknown request", "?");
-		net::out_stream out;
-		out.write("ERR").prime();
-		tcp_conn.answer(out);
-		return;
-	}
-	scoreboard sb = scoreboard::get_latest();
-	net::out_stream out_strm;
-	out_strm.write("RSS");
-	if (sb.empty()) {
-		out_strm.write("EMPTY").prime();
+	net::expected<net::scoreboard_request::fields> parsed = net::scoreboard_request::parse(req.text());
+	if (!parsed) {
+		verbose::write(client_addr, "unknown request", parsed.error().what);
+		co_await tcp_conn.answer(net::error_reply::make());
+		co_return;
+	}
+	std::string sb_name;
+	if (sharded) { // every shard has its own scoreboard
+		std::string sb = co_await disk_op([&]() { return scoreboard::merged(sb_name); });
+		if (sb.empty()) {
+			verbose::write(client_addr,
+				"no game was yet won by any player",
+				"show_scoreboard"
+			);
+			co_await tcp_conn.answer(net::scoreboard_reply::make("EMPTY"));
+			co_return;
+		}
+		verbose::write(client_addr,
+			"scoreboard sent",
+			"show_scoreboard"
+		);
+		co_await tcp_conn.answer(
+			net::scoreboard_file_reply::header("SB_" + sb_name + ".txt", net::decimal(sb.size()).view()),
+			sb
+		);
+		co_return;
+	}
+	size_t sb_size = 0;
+	int sb_fd = co_await disk_op([&]() { return scoreboard::open_latest(sb_name, sb_size); });
+	if (sb_fd == -1) {
 		verbose::write(client_addr,
 			"no game was yet won by any player",
 			"show_scoreboard"
 		);
-		tcp_conn.answer(out_strm);
-		return;
-	}
-	net::field file = sb.to_string();
-	out_strm.write("OK");
-	out_strm.write("SB_" + sb.start_time() + ".txt");
-	out_strm.write(std::to_string(file.size()));
-	out_strm.write(file).prime();
-	verbose::write(client_addr, 
+		co_await tcp_conn.answer(net::scoreboard_reply::make("EMPTY"));
+		co_return;
+	}
+	net::out_stream out_strm = net::scoreboard_file_reply::header(
+		"SB_" + sb_name + ".txt",
+		net::decimal(sb_size).view()
+	);
+	verbose::write(client_addr,
 		"scoreboard sent",
 		"show_scoreboard"
 	);
-	tcp_conn.answer(out_strm);
+	std::exception_ptr error;
+	try {
+		co_await tcp_conn.answer_file(out_strm, sb_fd, sb_size);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	close(sb_fd);
+	if (error)
+		std::rethrow_exception(error);
+}
+
+/// Handles the keep-alive request by marking the connection as persistent: the
+/// requests that follow it on the same connection are answered in order
+static net::task<void> start_keep_alive(net::stream<net::tcp_buffer_source>& req,
+							net::async_tcp_connection& tcp_conn,
+							const net::other_address& client_addr) {
+	net::expected<net::keep_alive_request::fields> parsed = net::keep_alive_request::parse(req.text());
+	if (!parsed) {
+		verbose::write(client_addr, "unknown request", parsed.error().what);
+		co_await tcp_conn.answer(net::error_reply::make());
+		co_return;
+	}
+	tcp_conn.set_keep_alive(true);
+	verbose::write(client_addr,
+		"connection kept alive",
+		"keep_alive"
+	);
+	co_await tcp_conn.answer(net::keep_alive_reply::make("OK"));
+}
+
+/// Handles the subscribe request by pushing the scoreboard to the client right
+/// away, and then whenever its top list changes, until the client leaves (see
+/// feed.hpp). The subscription is the last request of the connection
+static net::task<void> subscribe_scoreboard(net::stream<net::tcp_buffer_source>& req,
+							net::async_tcp_connection& tcp_conn,
+							const net::other_address& client_addr) {
+	net::expected<net::subscribe_request::fields> parsed = net::subscribe_request::parse(req.text());
+	if (!parsed) {
+		verbose::write(client_addr, "unknown request", parsed.error().what);
+		co_await tcp_conn.answer(net::error_reply::make());
+		co_return;
+	}
+	tcp_conn.set_keep_alive(false);
+	if (!routing || feed.subscribers() == 0) // (the router only watches the shards with subscribers)
+		co_await refresh_feed();
+	verbose::write(client_addr,
+		"subscribed to the scoreboard",
+		"subscribe"
+	);
+	co_await feed.serve(tcp_conn);
 }
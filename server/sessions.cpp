@@ -0,0 +1,74 @@
+#include "sessions.hpp"
+
+#include <algorithm>
+
+session_table::session_table(size_t max_plids) : _rows(max_plids, NO_ROW) {}
+
+void session_table::update(uint32_t plid, int64_t start, uint16_t duration, uint8_t trials, char mode) {
+	uint32_t row = _rows[plid];
+	if (row == NO_ROW) {
+		_rows[plid] = static_cast<uint32_t>(_plids.size());
+		_plids.push_back(plid);
+		_starts.push_back(start);
+		_durations.push_back(duration);
+		_trials.push_back(trials);
+		_modes.push_back(mode);
+		return;
+	}
+	_starts[row] = start;
+	_durations[row] = duration;
+	_trials[row] = trials;
+	_modes[row] = mode;
+}
+
+void session_table::erase(uint32_t plid) {
+	uint32_t row = _rows[plid];
+	if (row == NO_ROW)
+		return;
+	uint32_t last = static_cast<uint32_t>(_plids.size() - 1);
+	_rows[_plids[last]] = row; // (the last row takes its place)
+	_plids[row] = _plids[last];
+	_starts[row] = _starts[last];
+	_durations[row] = _durations[last];
+	_trials[row] = _trials[last];
+	_modes[row] = _modes[last];
+	_rows[plid] = NO_ROW;
+	_plids.pop_back();
+	_starts.pop_back();
+	_durations.pop_back();
+	_trials.pop_back();
+	_modes.pop_back();
+}
+
+size_t session_table::expired(int64_t now, std::vector<uint32_t>& out) const {
+	size_t found = 0;
+	const int64_t* starts = _starts.data();
+	const uint16_t* durations = _durations.data();
+	for (size_t begin = 0; begin < _starts.size(); begin += SESSION_SCAN_BLOCK) {
+		size_t end = std::min(begin + SESSION_SCAN_BLOCK, _starts.size());
+		size_t count = 0;
+		for (size_t i = begin; i < end; i++) // (no branches => vectorized)
+			count += starts[i] + durations[i] < now;
+		if (count == 0)
+			continue; // (most blocks, as games rarely expire)
+		for (size_t i = begin; i < end; i++) {
+			if (starts[i] + durations[i] < now)
+				out.push_back(_plids[i]);
+		}
+		found += count;
+	}
+	return found;
+}
+
+session_stats session_table::stats() const {
+	session_stats res{_plids.size(), 0, 0};
+	for (char mode : _modes)
+		res.debug += mode == 'D';
+	for (uint8_t trials : _trials)
+		res.trials += trials;
+	return res;
+}
+
+size_t session_table::size() const {
+	return _plids.size();
+}
@@ -0,0 +1,55 @@
+#ifndef _SESSIONS_HPP_
+#define _SESSIONS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define SESSION_SCAN_BLOCK 256 // rows checked at a time for expired games
+
+/// What the active games tracked by a session table add up to.
+struct session_stats {
+	size_t games; // active
+	size_t debug; // of those, in debug mode
+	uint64_t trials; // played in them
+};
+
+/// The active games the server knows of, as a table with a column per
+/// field (plid, start, duration, trials played and mode), each a dense
+/// array, so that scanning them all (for the ones that expired, or to add
+/// them up) reads only the columns it needs, in order, and vectorizes.
+/// Rows are kept packed: removing one moves the last row into its place.
+/// Plids are numbers (below 'max_plids'), indexing a dense array of rows.
+/// Finished games are removed, so every row is an ongoing game (as far as
+/// the table knows: games also end when they are next used).
+struct session_table {
+	explicit session_table(size_t max_plids);
+
+	/// Adds the game of 'plid', or updates it if it's already there.
+	void update(uint32_t plid, int64_t start, uint16_t duration, uint8_t trials, char mode);
+
+	/// Removes the game of 'plid' (does nothing if it's not there).
+	void erase(uint32_t plid);
+
+	/// Appends to 'out' the plid of every game whose time ran out by 'now'
+	/// (i.e. start + duration < now).
+	/// Returns the number of plids appended.
+	size_t expired(int64_t now, std::vector<uint32_t>& out) const;
+
+	/// Adds up the games in the table.
+	session_stats stats() const;
+
+	/// Returns the number of games in the table.
+	size_t size() const;
+private:
+	static constexpr uint32_t NO_ROW = UINT32_MAX;
+
+	std::vector<uint32_t> _rows; // plid -> row (NO_ROW => none)
+	std::vector<uint32_t> _plids;
+	std::vector<int64_t> _starts;
+	std::vector<uint16_t> _durations;
+	std::vector<uint8_t> _trials;
+	std::vector<char> _modes;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "shard.hpp"
+
+#include <linux/filter.h>
+
+int shard_of(const char plid[PLID_SIZE], int shards) {
+	uint64_t value = 0;
+	for (int i = 0; i < PLID_SIZE; i++)
+		value = value * 10 + (plid[i] - '0');
+	return static_cast<int>(value * shards / 1000000);
+}
+
+bool steer_by_plid(int fd, int shards) {
+	// binary frames: A = the 20 bit plid at the start of the payload (see frames.hpp)
+	std::vector<sock_filter> binary;
+	binary.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, BINARY_PLID_OFFSET + 2));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0F));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 16));
+	binary.push_back(BPF_STMT(BPF_ST, 0));
+	binary.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, BINARY_PLID_OFFSET + 1));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8));
+	binary.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+	binary.push_back(BPF_STMT(BPF_LD | BPF_MEM, 0));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0));
+	binary.push_back(BPF_STMT(BPF_ST, 0));
+	binary.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, BINARY_PLID_OFFSET));
+	binary.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+	binary.push_back(BPF_STMT(BPF_LD | BPF_MEM, 0));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, static_cast<uint32_t>(shards)));
+	binary.push_back(BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 1000000));
+	binary.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+
+	// text: M[0] = plid (parsed digit by digit); A = M[0] * shards / 10^6
+	// (invalid plids give an out of range index => the kernel picks a socket)
+	std::vector<sock_filter> code;
+	code.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0));
+	code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BINARY_MAGIC, 0, static_cast<uint8_t>(binary.size())));
+	code.insert(code.end(), binary.begin(), binary.end());
+	code.push_back(BPF_STMT(BPF_LD | BPF_IMM, 0));
+	code.push_back(BPF_STMT(BPF_ST, 0));
+	for (int i = 0; i < PLID_SIZE; i++) {
+		code.push_back(BPF_STMT(BPF_LD | BPF_MEM, 0));
+		code.push_back(BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 10));
+		code.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+		code.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, static_cast<uint32_t>(UDP_PLID_OFFSET + i)));
+		code.push_back(BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, '0'));
+		code.push_back(BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0));
+		code.push_back(BPF_STMT(BPF_ST, 0));
+	}
+	code.push_back(BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, static_cast<uint32_t>(shards)));
+	code.push_back(BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 1000000));
+	code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+	sock_fprog prog;
+	prog.len = static_cast<unsigned short>(code.size());
+	prog.filter = code.data();
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+bool receive_request(int channel, shard_request& req) {
+	char buf[sizeof(uint32_t) + MAX_TCP_REQUEST_SIZE];
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	iovec iov{buf, sizeof(buf)};
+	msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+	ssize_t n = recvmsg(channel, &hdr, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return false;
+	if (n == 0)
+		throw net::socket_closed_error{"The router stopped"};
+	if (n == -1)
+		throw net::socket_error{"Lost the channel to the router"};
+	cmsghdr* c = CMSG_FIRSTHDR(&hdr);
+	if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS
+		|| static_cast<size_t>(n) < sizeof(uint32_t))
+		throw net::socket_error{"Bad request from the router"};
+	memcpy(&req.fd, CMSG_DATA(c), sizeof(int));
+	memcpy(&req.id, buf, sizeof(uint32_t));
+	req.msg.assign(buf + sizeof(uint32_t), n - sizeof(uint32_t));
+	return true;
+}
+
+void send_done(int channel, uint32_t id, bool keep) {
+	char buf[sizeof(uint32_t) + 1];
+	memcpy(buf, &id, sizeof(uint32_t));
+	buf[sizeof(uint32_t)] = keep;
+	// tiny message => only blocks if the router stopped reading
+	if (send(channel, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf))
+		throw net::socket_error{"Lost the channel to the router"};
+}
+
+shard_router::shard_router(net::executor& ex, std::vector<int>&& channels)
+	: _ex{ex}, _channels{std::move(channels)} {}
+
+shard_router::~shard_router() {
+	for (int channel : _channels)
+		close(channel);
+}
+
+int shard_router::route(const std::string& msg) {
+	bool trials = msg.compare(0, 3, "STR") == 0
+		&& (msg.size() == 3 || msg[3] == DEFAULT_SEP || msg[3] == DEFAULT_EOM);
+	if (trials && msg.size() >= 4 + PLID_SIZE && net::is_valid_plid(msg.substr(4, PLID_SIZE)))
+		return shard_of(msg.data() + 4, shards());
+	if (trials || msg.compare(0, 3, "SSB") == 0) { // (a bad STR is turned down by any shard)
+		_next_shard = (_next_shard + 1) % shards();
+		return _next_shard;
+	}
+	return -1;
+}
+
+net::task<bool> shard_router::forward(int shard, int fd, const std::string& msg) {
+	uint32_t id = ++_next_id;
+	char buf[sizeof(uint32_t) + MAX_TCP_REQUEST_SIZE];
+	memcpy(buf, &id, sizeof(uint32_t));
+	size_t len = std::min(msg.size(), static_cast<size_t>(MAX_TCP_REQUEST_SIZE));
+	memcpy(buf + sizeof(uint32_t), msg.data(), len);
+	iovec iov{buf, sizeof(uint32_t) + len};
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+	cmsghdr* c = CMSG_FIRSTHDR(&hdr);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	while (sendmsg(_channels[shard], &hdr, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw net::socket_error{"Lost the channel to a shard"};
+		co_await _ex.writable(_channels[shard]);
+	}
+	pending& p = _pending[id];
+	co_await done_awaiter{p};
+	bool keep = p.keep;
+	_pending.erase(id);
+	co_return keep;
+}
+
+net::task<void> shard_router::collect(int shard) {
+	int channel = _channels[shard];
+	while (true) {
+		co_await _ex.readable(channel);
+		char buf[sizeof(uint32_t) + 1];
+		ssize_t n;
+		while ((n = recv(channel, buf, sizeof(buf), MSG_DONTWAIT)) == sizeof(buf)) {
+			uint32_t id;
+			memcpy(&id, buf, sizeof(uint32_t));
+			auto it = _pending.find(id);
+			if (it == std::end(_pending))
+				continue;
+			it->second.done = true;
+			it->second.keep = buf[sizeof(uint32_t)];
+			if (it->second.waiter)
+				_ex.schedule(it->second.waiter);
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			continue;
+		throw net::socket_error{"Lost the channel to a shard"};
+	}
+}
+
+int shard_router::shards() const {
+	return static_cast<int>(_channels.size());
+}
@@ -0,0 +1,103 @@
+#ifndef _SHARD_HPP_
+#define _SHARD_HPP_
+
+#include "../common/async.hpp"
+#include "../common/frames.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#define MAX_SHARDS 64
+#define UDP_PLID_OFFSET 4 // every udp request is "XXX PLID..."
+#define BINARY_PLID_OFFSET 2 // or a binary frame (see frames.hpp)
+
+/// Returns the shard (out of 'shards') that owns 'plid': shard i owns
+/// the i-th of 'shards' equal ranges of player ids.
+int shard_of(const char plid[PLID_SIZE], int shards);
+
+/// Has the kernel deliver each datagram sent to the SO_REUSEPORT group
+/// of the udp socket 'fd' to the socket of the shard that owns its plid
+/// (the i-th socket bound to the port belongs to shard i), parsing the
+/// plid (of text requests and binary frames alike) with a classic BPF program.
+/// Datagrams without a plid go to any socket.
+/// Returns true on success; false otherwise.
+bool steer_by_plid(int fd, int shards);
+
+/// A tcp request handed to a shard by the router.
+struct shard_request {
+	uint32_t id;
+	int fd; // a copy of the client's socket (owned by the receiver)
+	std::string msg;
+};
+
+/// Receives the next request from the router through 'channel' (a shard's
+/// end of a SOCK_SEQPACKET socket pair), if one is already waiting.
+/// Returns false if there was none; true otherwise.
+/// Throws:
+/// 1. socket_closed_error if the router stopped.
+/// 2. socket_error if the channel failed.
+bool receive_request(int channel, shard_request& req);
+
+/// Tells the router that the request 'id' was answered. If 'keep' is false,
+/// the router must close the connection.
+/// Throws:
+/// 1. socket_error if the router is gone.
+void send_done(int channel, uint32_t id, bool keep);
+
+/// Front of a sharded server: hands the tcp requests it receives to the
+/// shards that own them, one at a time per connection. The shard answers
+/// the client directly and tells the router when it's done, so that the
+/// router can go on with the next request of the connection.
+struct shard_router {
+	/// 'channels' are the router's ends of the socket pairs of each shard.
+	shard_router(net::executor& ex, std::vector<int>&& channels);
+
+	shard_router(const shard_router& other) = delete;
+
+	shard_router& operator=(const shard_router& other) = delete;
+
+	~shard_router();
+
+	/// Returns the shard that must handle the tcp request 'msg' (STR goes
+	/// to the owner of the plid, SSB and a STR without a valid plid to any
+	/// shard), or -1 if the router handles it.
+	int route(const std::string& msg);
+
+	/// Hands 'msg', received from the client socket 'fd', to 'shard' and
+	/// waits until the shard answered it.
+	/// co_await evaluates to false if the connection must be closed.
+	net::task<bool> forward(int shard, int fd, const std::string& msg);
+
+	/// Receives the answers of 'shard', waking up the forward()'s
+	/// waiting for them (must be spawned once per shard).
+	/// Throws:
+	/// 1. socket_error when the shard stops.
+	net::task<void> collect(int shard);
+
+	/// Returns the number of shards.
+	int shards() const;
+private:
+	struct pending {
+		std::coroutine_handle<> waiter{};
+		bool done{false};
+		bool keep{false};
+	};
+
+	/// Suspends until the request of a pending is done.
+	struct done_awaiter {
+		bool await_ready() const noexcept { return _pending.done; }
+		void await_suspend(std::coroutine_handle<> h) noexcept { _pending.waiter = h; }
+		void await_resume() const noexcept {}
+
+		pending& _pending;
+	};
+
+	net::executor& _ex;
+	std::vector<int> _channels;
+	std::unordered_map<uint32_t, pending> _pending;
+	uint32_t _next_id{0};
+	int _next_shard{0}; // for requests any shard can handle
+};
+
+#endif
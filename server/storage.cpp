@@ -0,0 +1,428 @@
+#include "storage.hpp"
+#include "replica.hpp"
+#include "../common/async.hpp"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cerrno>
+
+#define FILE_MODE 0666
+#define DIR_MODE 0777
+
+storage::storage(bool use_uring, durability level) : _level{level} {
+	if (_level == durability::BATCH)
+		_root = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+		_max_open = std::min(_max_open, static_cast<size_t>(limit.rlim_cur / 4)); // (sockets need the rest)
+	if (!use_uring)
+		return;
+	auto ring = std::make_unique<net::uring>(URING_ENTRIES);
+	if (!ring->valid())
+		return;
+	for (uint8_t opcode : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC,
+		IORING_OP_CLOSE, IORING_OP_MKDIRAT, IORING_OP_RENAMEAT})
+		if (!ring->supports(opcode))
+			return;
+	if (!ring->register_file_slots(URING_FILE_SLOTS))
+		return;
+	_ring = std::move(ring);
+}
+
+storage::~storage() {
+	close_oldest(_open.size());
+	if (_root != -1)
+		close(_root);
+}
+
+bool storage::uses_uring() const {
+	return _ring != nullptr;
+}
+
+void storage::write(std::string path, std::string&& data) {
+	stage({kind::WRITE, std::move(path), {}, std::move(data)});
+}
+
+void storage::append(std::string path, std::string&& data) {
+	stage({kind::APPEND, std::move(path), {}, std::move(data)});
+}
+
+void storage::replace(std::string path, std::string temp_path, std::string&& data) {
+	if (_level == durability::NONE)
+		return;
+	std::exception_ptr* job = net::executor::job_error();
+	if (!_ring || !job)
+		return run({kind::REPLACE, std::move(path), std::move(temp_path), std::move(data)});
+	forget(path);
+	auto it = _replaces.find(path);
+	if (it == std::end(_replaces)) {
+		_replaces.insert({path, _chains.size()});
+		_chains.push_back({{{kind::REPLACE, std::move(path), std::move(temp_path), std::move(data)}}, {job}});
+		return;
+	}
+	chain& c = _chains[it->second];
+	c.ops.front().data = std::move(data); // only the last version matters
+	if (std::find(std::begin(c.jobs), std::end(c.jobs), job) == std::end(c.jobs))
+		c.jobs.push_back(job);
+}
+
+void storage::make_dir(std::string path) {
+	stage({kind::MAKE_DIR, std::move(path), {}, {}});
+}
+
+void storage::rename(std::string from, std::string to) {
+	stage({kind::RENAME, std::move(from), std::move(to), {}});
+}
+
+void storage::stage(op&& o) {
+	if (_level == durability::NONE)
+		return;
+	std::exception_ptr* job = net::executor::job_error();
+	if (!_ring && job)
+		return run(o); // (flushed when the batch ends)
+	if (!job) { // => no batch to wait for
+		run(o);
+		return flush();
+	}
+	if (o.type == kind::RENAME) { // (queued appends never use the open files)
+		forget(o.path);
+		forget(o.other);
+	}
+	auto it = _job_chains.find(job);
+	if (it == std::end(_job_chains)) {
+		it = _job_chains.insert({job, _chains.size()}).first;
+		_chains.push_back({{}, {job}});
+	}
+	_chains[it->second].ops.push_back(std::move(o));
+}
+
+/// Writes all of 'data' to 'fd'.
+/// Returns false if it failed; true otherwise.
+static bool write_all(int fd, const std::string& data) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+/// Flushes the directory that holds 'path' (its entry for 'path') to disk.
+/// Throws:
+/// 1. io_error if it fails.
+static void flush_dir(const std::string& path) {
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		throw net::io_error{"Failed to open directory"};
+	if (fsync(fd) == -1) {
+		close(fd);
+		throw net::io_error{"Failed to flush directory to disk"};
+	}
+	close(fd);
+}
+
+static void put(const std::string& path, int flags, const std::string& data, bool sync) {
+	int fd = open(path.c_str(), flags, FILE_MODE);
+	if (fd == -1)
+		throw net::io_error{"Failed to open file"};
+	if (!write_all(fd, data)) {
+		close(fd);
+		throw net::io_error{"Failed to write file"};
+	}
+	if (sync && fdatasync(fd) == -1) {
+		close(fd);
+		throw net::io_error{"Failed to flush file to disk"};
+	}
+	if (close(fd) == -1)
+		throw net::io_error{"Failed to close file"};
+}
+
+void storage::run(const op& o) {
+	bool sync = _level == durability::SYNC;
+	switch (o.type) {
+	case kind::WRITE:
+		put(o.path, O_WRONLY | O_CREAT | O_TRUNC, o.data, sync);
+		break;
+	case kind::APPEND: {
+		int fd = appender(o.path);
+		if (!write_all(fd, o.data)) {
+			forget(o.path);
+			throw net::io_error{"Failed to write file"};
+		}
+		if (sync && fdatasync(fd) == -1)
+			throw net::io_error{"Failed to flush file to disk"};
+		break;
+	}
+	case kind::REPLACE:
+		put(o.other, O_WRONLY | O_CREAT | O_TRUNC, o.data, true);
+		forget(o.path);
+		if (::rename(o.other.c_str(), o.path.c_str()) == -1)
+			throw net::io_error{"Failed to rename file"};
+		break;
+	case kind::MAKE_DIR:
+		if (mkdir(o.path.c_str(), DIR_MODE) == -1 && errno != EEXIST)
+			throw net::io_error{"Failed to create directory"};
+		break;
+	case kind::RENAME:
+		forget(o.path);
+		forget(o.other);
+		if (::rename(o.path.c_str(), o.other.c_str()) == -1)
+			throw net::io_error{"Failed to rename file"};
+		if (sync)
+			flush_dir(o.path);
+		break;
+	}
+	if (sync && o.type != kind::APPEND) // (new entries)
+		flush_dir(o.type == kind::RENAME ? o.other : o.path);
+	_unflushed = true;
+	replicate(o);
+}
+
+int storage::appender(const std::string& path) {
+	auto it = _open_paths.find(path);
+	if (it != std::end(_open_paths)) {
+		_open.splice(std::begin(_open), _open, it->second); // most recent
+		return it->second->second;
+	}
+	if (_max_open == 0)
+		throw net::io_error{"Failed to open file"};
+	if (_open.size() >= _max_open)
+		close_oldest(1);
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE);
+	if (fd == -1 && (errno == EMFILE || errno == ENFILE) && !_open.empty()) {
+		close_oldest((_open.size() + 1) / 2); // make room for sockets too
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE);
+	}
+	if (fd == -1)
+		throw net::io_error{"Failed to open file"};
+	_open.emplace_front(path, fd);
+	_open_paths[path] = std::begin(_open);
+	return fd;
+}
+
+void storage::forget(const std::string& path) {
+	auto it = _open_paths.find(path);
+	if (it == std::end(_open_paths))
+		return;
+	close(it->second->second);
+	_open.erase(it->second);
+	_open_paths.erase(it);
+}
+
+void storage::close_oldest(size_t count) {
+	for (size_t i = 0; i < count && !_open.empty(); i++) {
+		close(_open.back().second);
+		_open_paths.erase(_open.back().first);
+		_open.pop_back();
+	}
+}
+
+void storage::replicate_to(replica* rep) {
+	_replica = rep;
+}
+
+void storage::apply(kind type, const std::string& path, const std::string& other, std::string&& data) {
+	if (_level != durability::NONE)
+		run({type, path, other, std::move(data)});
+}
+
+void storage::replicate(const op& o) {
+	if (_replica)
+		_replica->send(o.type, o.path, o.other, o.data);
+}
+
+unsigned storage::entries_needed(size_t index) const {
+	unsigned needed = 0;
+	for (const op& o : _chains[index].ops) {
+		switch (o.type) {
+		case kind::WRITE:
+		case kind::APPEND:
+			needed += _level == durability::SYNC ? 4 : 3; // open, write, (sync,) close
+			break;
+		case kind::REPLACE:
+			needed += 5; // open, write, sync, close, rename
+			break;
+		case kind::MAKE_DIR:
+		case kind::RENAME:
+			needed += 1;
+			break;
+		}
+	}
+	return needed;
+}
+
+io_uring_sqe* storage::queue(size_t index, uint8_t opcode, int expected, const char* what) {
+	io_uring_sqe* sqe = _ring->get_sqe();
+	sqe->opcode = opcode;
+	sqe->user_data = _entries.size();
+	_entries.push_back({index, expected, false, what});
+	return sqe;
+}
+
+void storage::prepare(size_t index, unsigned slot) {
+	std::vector<io_uring_sqe*> sqes;
+	auto open_file = [&](const std::string& path, int flags) {
+		io_uring_sqe* sqe = queue(index, IORING_OP_OPENAT, -1, "Failed to open file");
+		sqe->fd = AT_FDCWD;
+		sqe->addr = reinterpret_cast<uintptr_t>(path.c_str());
+		sqe->len = FILE_MODE;
+		sqe->open_flags = flags;
+		sqe->file_index = slot + 1; // 0 means a regular file descriptor
+		sqes.push_back(sqe);
+	};
+	auto write_file = [&](const std::string& data, bool at_end) {
+		io_uring_sqe* sqe = queue(index, IORING_OP_WRITE, static_cast<int>(data.size()), "Failed to write file");
+		sqe->fd = slot;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->addr = reinterpret_cast<uintptr_t>(data.data());
+		sqe->len = data.size();
+		sqe->off = at_end ? static_cast<__u64>(-1) : 0; // -1 => current position
+		sqes.push_back(sqe);
+	};
+	auto close_file = [&]() {
+		io_uring_sqe* sqe = queue(index, IORING_OP_CLOSE, -1, "Failed to close file");
+		sqe->file_index = slot + 1;
+		sqes.push_back(sqe);
+	};
+	auto rename_file = [&](const std::string& from, const std::string& to) {
+		io_uring_sqe* sqe = queue(index, IORING_OP_RENAMEAT, -1, "Failed to rename file");
+		sqe->fd = AT_FDCWD;
+		sqe->addr = reinterpret_cast<uintptr_t>(from.c_str());
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = reinterpret_cast<uintptr_t>(to.c_str());
+		sqes.push_back(sqe);
+	};
+	auto sync_file = [&]() {
+		io_uring_sqe* sqe = queue(index, IORING_OP_FSYNC, 0, "Failed to flush file to disk");
+		sqe->fd = slot;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqes.push_back(sqe);
+	};
+	bool sync = _level == durability::SYNC;
+	for (const op& o : _chains[index].ops) {
+		switch (o.type) {
+		case kind::WRITE:
+			open_file(o.path, O_WRONLY | O_CREAT | O_TRUNC);
+			write_file(o.data, false);
+			if (sync)
+				sync_file();
+			close_file();
+			break;
+		case kind::APPEND:
+			open_file(o.path, O_WRONLY | O_CREAT | O_APPEND);
+			write_file(o.data, true);
+			if (sync)
+				sync_file();
+			close_file();
+			break;
+		case kind::REPLACE:
+			open_file(o.other, O_WRONLY | O_CREAT | O_TRUNC);
+			write_file(o.data, false);
+			sync_file();
+			close_file();
+			rename_file(o.other, o.path);
+			break;
+		case kind::MAKE_DIR: {
+			io_uring_sqe* sqe = queue(index, IORING_OP_MKDIRAT, 0, "Failed to create directory");
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<uintptr_t>(o.path.c_str());
+			sqe->len = DIR_MODE;
+			_entries.back().may_exist = true;
+			sqes.push_back(sqe);
+			break;
+		}
+		case kind::RENAME:
+			rename_file(o.path, o.other);
+			break;
+		}
+		if (sync && o.type != kind::APPEND) // (their directories are flushed by commit)
+			_unflushed_dirs.insert(o.type == kind::RENAME ? o.other : o.path);
+		if (sync && o.type == kind::RENAME)
+			_unflushed_dirs.insert(o.path);
+	}
+	_unflushed = true;
+	for (size_t i = 0; i + 1 < sqes.size(); i++) { // link the chain
+		if (sqes[i]->opcode == IORING_OP_MKDIRAT)
+			sqes[i]->flags |= IOSQE_IO_HARDLINK; // => -EEXIST does not break the chain
+		else
+			sqes[i]->flags |= IOSQE_IO_LINK;
+	}
+}
+
+void storage::commit() {
+	if (!_ring || _chains.empty())
+		return flush();
+	try {
+		submit_all();
+	} catch (...) {
+		_chains.clear();
+		_job_chains.clear();
+		_replaces.clear();
+		throw;
+	}
+	for (chain& c : _chains) {
+		if (!c.error) {
+			for (const op& o : c.ops)
+				replicate(o);
+			continue;
+		}
+		for (std::exception_ptr* job : c.jobs)
+			if (!*job)
+				*job = std::make_exception_ptr(net::io_error{c.error});
+	}
+	_chains.clear();
+	_job_chains.clear();
+	_replaces.clear();
+	flush();
+}
+
+void storage::flush() {
+	std::unordered_set<std::string> dirs;
+	dirs.swap(_unflushed_dirs);
+	for (const std::string& path : dirs)
+		flush_dir(path);
+	if (_level != durability::BATCH || !_unflushed)
+		return;
+	_unflushed = false;
+	if (_root == -1 || syncfs(_root) == -1)
+		throw net::io_error{"Failed to flush files to disk"};
+}
+
+void storage::submit_all() {
+	size_t next = 0;
+	while (next < _chains.size()) {
+		_entries.clear();
+		unsigned slot = 0;
+		while (next < _chains.size() && slot < URING_FILE_SLOTS
+			&& entries_needed(next) <= _ring->free_sqes())
+			prepare(next++, slot++);
+		if (_entries.empty()) // a single chain does not fit in the ring
+			throw net::system_error{"Too many operations for a single job"};
+		size_t left = _entries.size();
+		_ring->submit(left);
+		while (true) {
+			left -= _ring->for_each_completion([this](const io_uring_cqe& cqe) {
+				const entry& e = _entries[cqe.user_data];
+				chain& c = _chains[e.chain];
+				bool ok = e.expected == -1 ? cqe.res >= 0 : cqe.res == e.expected;
+				if (!ok && e.may_exist && cqe.res == -EEXIST)
+					ok = true;
+				if (!ok && (cqe.res != -ECANCELED || !c.error))
+					c.error = e.what; // prefer the operation that failed to the ones it canceled
+			});
+			if (left == 0)
+				break;
+			_ring->submit(left);
+		}
+	}
+}
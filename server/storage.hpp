@@ -0,0 +1,205 @@
+#ifndef _STORAGE_HPP_
+#define _STORAGE_HPP_
+
+#include "../common/common.hpp"
+#include "../common/uring.hpp"
+
+#include <exception>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define URING_ENTRIES 256
+#define URING_FILE_SLOTS 64 // files open at once (one per chain of operations)
+#define MAX_CACHED_FILES 1024 // kept open for appending (at most a quarter of the fd limit)
+
+struct replica;
+
+/// Writes the game and score files to disk.
+/// By default, each operation happens right away, through blocking system
+/// calls, and throws io_error if it fails.
+/// With io_uring, the operations are queued and submitted all at once when
+/// commit() is called (at the end of each batch of jobs, see
+/// net::executor::on_batch_end), which waits for them to complete:
+/// 1. The operations of a job are linked, so they run in the order they
+///    were issued and stop at the first failure, which fails the job
+///    (see net::executor::job_error) instead of throwing.
+/// 2. The operations of different jobs run concurrently.
+/// 3. Replacing the same file more than once in a batch only writes the
+///    last version.
+/// Operations issued outside of a job run right away, as if io_uring
+/// was not in use.
+/// Must only be used by one thread at a time (the executor's worker).
+/// Every operation that succeeds can also be streamed to a standby server
+/// (see replicate_to).
+/// Blocking appends keep their files open, so that appending to the same
+/// file again (e.g. the trials of an active game) is a single write.
+/// How soon the operations reach the disk depends on the durability level.
+/// Paths are taken by value, so the ones built for a single operation are
+/// moved into it instead of copied.
+struct storage {
+	enum class kind : char {
+		WRITE,
+		APPEND,
+		REPLACE,
+		MAKE_DIR,
+		RENAME
+	};
+
+	/// When an operation is on disk (safe from a crash of the machine).
+	/// At the NONE level, nothing is written at all, to measure the rest of
+	/// the server: active games live in memory, but finished games (past
+	/// the transcripts kept, see game::transcript) and the scoreboard
+	/// (which are read from their files) are never found.
+	enum class durability : char {
+		NONE, // never
+		WRITE, // when the kernel writes it back (nothing is flushed)
+		BATCH, // before its job ends, with a single flush for a batch of jobs (see commit)
+		SYNC // before its job ends, with a flush per operation
+	};
+
+	/// Uses io_uring if 'use_uring' is set and the kernel supports it
+	/// (check uses_uring()); otherwise falls back to blocking calls.
+	/// The operations are made as durable as 'level' says.
+	storage(bool use_uring = false, durability level = durability::WRITE);
+
+	storage(const storage& other) = delete;
+
+	storage& operator=(const storage& other) = delete;
+
+	/// Closes the files kept open.
+	~storage();
+
+	/// Returns true if the operations go through io_uring; false otherwise.
+	bool uses_uring() const;
+
+	/// Creates the file at 'path' (truncating it, if it exists) with 'data'.
+	void write(std::string path, std::string&& data);
+
+	/// Appends 'data' to the file at 'path' (creating it if needed).
+	/// Without io_uring, the file is kept open for the next append, until
+	/// it's renamed or replaced (or, if too many files are open, until it
+	/// is the one appended to the longest ago).
+	void append(std::string path, std::string&& data);
+
+	/// Replaces the file at 'path' with one containing 'data', atomically:
+	/// it's written to 'temp_path', flushed to disk and renamed over 'path'.
+	void replace(std::string path, std::string temp_path, std::string&& data);
+
+	/// Creates the directory at 'path' (does nothing if it already exists).
+	void make_dir(std::string path);
+
+	/// Renames the file at 'from' to 'to'.
+	void rename(std::string from, std::string to);
+
+	/// Submits every queued operation and waits for them to finish (and,
+	/// at the BATCH and SYNC levels, for them to reach the disk).
+	/// The jobs whose operations failed are failed with an io_error.
+	/// Without io_uring, only flushes what the durability level asks for.
+	/// Throws:
+	/// 1. system_error if io_uring refuses the submission.
+	/// 2. io_error if the operations could not be flushed.
+	void commit();
+
+	/// Streams every operation that succeeds from now on to 'rep'
+	/// (nullptr stops it). 'rep' must outlive the storage.
+	void replicate_to(replica* rep);
+
+	/// Runs an operation of type 'type' right away (with blocking calls, and
+	/// not at all at the NONE durability level),
+	/// as the storage of a primary server did (see replica.hpp).
+	/// 'other' is only used by REPLACE and RENAME and 'data' by the ones
+	/// that write files.
+	/// Throws:
+	/// 1. io_error if it fails.
+	void apply(kind type, const std::string& path, const std::string& other, std::string&& data);
+private:
+	struct op {
+		kind type;
+		std::string path;
+		std::string other; // the new path (RENAME) or the temporary file (REPLACE)
+		std::string data;
+	};
+
+	/// Operations that must run in order (the ones of a job, or the
+	/// coalesced replacements of a file).
+	struct chain {
+		std::vector<op> ops;
+		std::vector<std::exception_ptr*> jobs; // failed if an operation fails
+		const char* error{nullptr}; // what failed
+	};
+
+	/// What a submission queue entry was for.
+	struct entry {
+		size_t chain;
+		int expected; // result that means success (-1 => any non negative)
+		bool may_exist; // -EEXIST also means success
+		const char* what;
+	};
+
+	/// Runs 'o' right away (with blocking calls) or queues it in the
+	/// chain of the running job.
+	void stage(op&& o);
+
+	/// Runs 'o' with blocking calls (and replicates it).
+	/// Throws:
+	/// 1. io_error if it fails.
+	void run(const op& o);
+
+	/// Returns a descriptor for appending to 'path', either kept open
+	/// by an earlier append or opened now (and kept open).
+	/// Throws:
+	/// 1. io_error if it could not be opened.
+	int appender(const std::string& path);
+
+	/// Closes the descriptor kept open for 'path', if any (before it's
+	/// renamed or replaced, which would leave it pointing elsewhere).
+	void forget(const std::string& path);
+
+	/// Closes the 'count' descriptors appended to the longest ago.
+	void close_oldest(size_t count);
+
+	/// Flushes what the operations since the last call left unflushed:
+	/// the whole file system (BATCH) or the directories they changed (SYNC).
+	/// Throws:
+	/// 1. io_error if it fails.
+	void flush();
+
+	/// Sends 'o', which succeeded, to the standby (if any).
+	void replicate(const op& o);
+
+	/// Returns the number of queue entries chain 'index' needs.
+	unsigned entries_needed(size_t index) const;
+
+	/// Fills in the queue entries for chain 'index', opening its files
+	/// in the fixed file slot 'slot'.
+	void prepare(size_t index, unsigned slot);
+
+	/// Submits every chain (as many at a time as the ring and the file
+	/// slots allow), waiting for them to complete.
+	/// Throws:
+	/// 1. system_error if io_uring refuses the submission.
+	void submit_all();
+
+	/// Queues a single entry that belongs to chain 'index'.
+	io_uring_sqe* queue(size_t index, uint8_t opcode, int expected, const char* what);
+
+	std::unique_ptr<net::uring> _ring{};
+	std::vector<chain> _chains;
+	std::unordered_map<std::exception_ptr*, size_t> _job_chains; // job -> chain
+	std::unordered_map<std::string, size_t> _replaces; // path -> chain
+	std::vector<entry> _entries; // indexed by the queue entries' user_data
+	replica* _replica{nullptr};
+	using open_file = std::pair<std::string, int>; // path, descriptor
+	std::list<open_file> _open; // most recently appended to first
+	std::unordered_map<std::string, std::list<open_file>::iterator> _open_paths;
+	size_t _max_open{MAX_CACHED_FILES};
+	durability _level;
+	int _root{-1}; // the working directory (to flush its file system)
+	bool _unflushed{false}; // operations ran since the last flush (BATCH)
+	std::unordered_set<std::string> _unflushed_dirs; // changed by the queued operations (SYNC)
+};
+
+#endif
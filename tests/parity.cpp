@@ -0,0 +1,237 @@
+#include "../server/game.hpp"
+#include "../common/except.hpp"
+#include "../common/scan.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// Checks that the word at a time scanners of the game and scoreboard
+/// files (game::scan, scoreboard::scan) agree with the parsers that read
+/// them a field at a time (with stream::read): a file the scanner takes
+/// must be read the same by both, and the files the scanner turns down
+/// (which are then parsed a field at a time) must include every file not
+/// exactly as the server writes it.
+/// Run with "make check". Prints every check that fails and exits with 1
+/// if any did.
+struct parity_test {
+	/// Returns an fd (at offset 0) of a file holding 'text'.
+	static int to_fd(const std::string& text) {
+		int fd = memfd_create("parity", 0);
+		if (fd == -1 || write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size())
+			|| lseek(fd, 0, SEEK_SET) == -1)
+			throw net::io_error{"Failed to make a file for the test"};
+		return fd;
+	}
+
+	/// Parses the game file 'text' a field at a time into 'gm'.
+	/// Returns false if it's turned down as corrupted.
+	static bool stream_game(const std::string& text, game& gm) {
+		int fd = to_fd(text);
+		bool ok = true;
+		try {
+			net::stream<net::file_source> in{{fd}};
+			gm = game::parse(in);
+		} catch (std::runtime_error& err) {
+			ok = false;
+		}
+		close(fd);
+		return ok;
+	}
+
+	/// Parses the game file 'text' as the server does (scan, then
+	/// field at a time if it's not as written).
+	static bool read_game(const std::string& text, game& gm) {
+		int fd = to_fd(text);
+		bool ok = true;
+		try {
+			gm = game::parse(fd);
+		} catch (std::runtime_error& err) {
+			ok = false;
+		}
+		close(fd);
+		return ok;
+	}
+
+	/// Checks game file 'text', which the scanner should take if
+	/// 'well_formed' and turn down otherwise.
+	static void check_game(const std::string& name, const std::string& text, bool well_formed) {
+		game scanned, streamed, read;
+		bool scan_ok = game::scan(text, scanned);
+		bool stream_ok = stream_game(text, streamed);
+		bool read_ok = read_game(text, read);
+		if (scan_ok != well_formed)
+			fail(name, well_formed ? "the scanner turned it down" : "the scanner took it");
+		else if (scan_ok && !stream_ok)
+			fail(name, "the scanner took a file stream::read turns down");
+		else if (scan_ok && !(scanned == streamed))
+			fail(name, "the scanner read it differently from stream::read");
+		if (read_ok != stream_ok || (read_ok && !(read == streamed)))
+			fail(name, "game::parse disagrees with stream::read");
+	}
+
+	/// Reads the records of scoreboard file 'text' a field at a time.
+	/// Returns false if it's turned down as corrupted.
+	static bool stream_board(const std::string& text, scoreboard& sb) {
+		int fd = to_fd(text);
+		bool ok = true;
+		try {
+			sb.parse(fd);
+		} catch (std::runtime_error& err) {
+			ok = false;
+		}
+		close(fd);
+		return ok;
+	}
+
+	/// Same as check_game, for scoreboard file 'text'.
+	static void check_board(const std::string& name, const std::string& text, bool well_formed) {
+		scoreboard scanned, streamed;
+		bool scan_ok = scanned.scan(text);
+		bool stream_ok = stream_board(text, streamed);
+		if (scan_ok != well_formed)
+			fail(name, well_formed ? "the scanner turned it down" : "the scanner took it");
+		else if (scan_ok && !stream_ok)
+			fail(name, "the scanner took a file stream::read turns down");
+		else if (scan_ok && scanned.to_string() != streamed.to_string())
+			fail(name, "the scanner read it differently from stream::read");
+	}
+
+	/// Checks the kernels of scan.hpp on texts of every length up to three
+	/// words (so every tail, of 0 to SCAN_WORD_SIZE - 1 bytes), with a bad
+	/// byte (or delimiter) at every position.
+	static void check_kernels() {
+		for (size_t len = 0; len <= 3 * net::SCAN_WORD_SIZE; len++) {
+			std::string digits(len, '7'), colors(len, 'Y');
+			std::string tail = std::to_string(len % net::SCAN_WORD_SIZE);
+			if (!net::all_digits(digits) || !net::all_colors(colors) || !net::all_fname_chars(digits))
+				fail("kernels, length " + std::to_string(len) + " (tail " + tail + ")", "turned down good bytes");
+			if (net::find_delimiter(digits, 0) != len)
+				fail("kernels, length " + std::to_string(len) + " (tail " + tail + ")", "found a delimiter in none");
+			for (size_t at = 0; at < len; at++) {
+				std::string where = "kernels, length " + std::to_string(len) + " (tail " + tail
+					+ "), byte " + std::to_string(at);
+				std::string bad_digit = digits, bad_color = colors, delimited = digits;
+				bad_digit[at] = '/'; // (just below '0')
+				bad_color[at] = 'Z';
+				delimited[at] = at % 2 == 0 ? DEFAULT_SEP : DEFAULT_EOM;
+				if (net::all_digits(bad_digit) || net::all_colors(bad_color) || net::all_fname_chars(delimited))
+					fail(where, "took a bad byte");
+				for (size_t from = 0; from <= at; from++)
+					if (net::find_delimiter(delimited, from) != at)
+						fail(where + ", from " + std::to_string(from), "missed the delimiter");
+			}
+		}
+	}
+
+	static void check_games() {
+		const std::string header = "123456 P RGBY 600 1733000000\n";
+		const std::string trials[] = {
+			"1 RRRR 1 0 5\n", "2 GGGG 0 1 17\n", "3 BBBB 1 1 30\n", "4 YYYY 0 0 31\n",
+			"5 OOOO 2 0 100\n", "6 PPPP 0 2 200\n", "7 RGBY 2 2 300\n", "8 YBGR 0 4 599\n",
+		};
+		std::string text = header;
+		check_game("no trials", text, true);
+		for (int i = 0; i < 8; i++) {
+			text += trials[i];
+			check_game(std::to_string(i + 1) + " trials", text, true);
+		}
+		check_game("lost on tries", text + "F 1733000599\n", true);
+		check_game("9th trial", text + "9 RGBY 0 0 600\n", false);
+		check_game("9th trial, then lost on tries", text + "9 RGBY 0 0 600\nF 1733000600\n", false);
+		const std::string played = header + trials[0] + trials[1];
+		check_game("won", header + trials[0] + "2 RGBY 4 0 20\nW 1733000020\n", true);
+		check_game("lost on time", played + "T 1733000600\n", true);
+		check_game("quit", played + "Q 1733000042\n", true);
+		check_game("debug mode", "000001 D OOPP 1 0\n", true);
+
+		// every length of the last word of the file (the end time grows)
+		bool tails[net::SCAN_WORD_SIZE] = {};
+		std::string end = "1";
+		for (int i = 0; i < 2 * static_cast<int>(net::SCAN_WORD_SIZE); i++, end += std::to_string(i % 10)) {
+			std::string file = played + "Q " + end + "\n";
+			tails[file.size() % net::SCAN_WORD_SIZE] = true;
+			check_game("end time of " + std::to_string(end.size()) + " digits (tail "
+				+ std::to_string(file.size() % net::SCAN_WORD_SIZE) + ")", file, true);
+		}
+		for (size_t i = 0; i < net::SCAN_WORD_SIZE; i++)
+			if (!tails[i])
+				fail("tail " + std::to_string(i), "no game file ended with it");
+		// every offset of the fields of a line (the duration and start grow)
+		for (const char* duration : {"1", "10", "600"})
+			for (std::string start = "1"; start.size() <= 12; start += "0")
+				check_game("duration " + std::string{duration} + ", start " + start,
+					"654321 P GGBB " + std::string{duration} + " " + start + "\n" + trials[0], true);
+
+		check_game("double separator in the header", "123456  P RGBY 600 1733000000\n", false);
+		check_game("double separator in a trial", header + "1  RRRR 1 0 5\n", false);
+		check_game("double separator before the end time", played + "Q  1733000042\n", false);
+		check_game("separator ending a line", header + "1 RRRR 1 0 5 \n", false);
+		check_game("separator starting a line", header + " 1 RRRR 1 0 5\n", false);
+		check_game("non-digit nB", header + "1 RRRR x 0 5\n", false);
+		check_game("non-digit nW", header + "1 RRRR 1 - 5\n", false);
+		check_game("non-digit trial time", header + "1 RRRR 1 0 5s\n", false);
+		check_game("non-digit start", "123456 P RGBY 600 17330000x0\n", false);
+		check_game("non-digit end time", played + "Q 17330000y2\n", false);
+		check_game("bad color", header + "1 RRXR 1 0 5\n", false);
+		check_game("bad mode", "123456 X RGBY 600 1733000000\n", false);
+		check_game("skipped trial", header + trials[0] + trials[2], false);
+		check_game("bad termination reason", played + "Z 1733000042\n", false);
+		check_game("missing EOM after the header", "123456 P RGBY 600 1733000000", false);
+		check_game("missing EOM after a trial", header + "1 RRRR 1 0 5", false);
+		check_game("missing EOM after the end time", played + "Q 1733000042", false);
+		check_game("line after the end", played + "Q 1733000042\n" + trials[2], false);
+		check_game("empty", "", false);
+	}
+
+	static void check_boards() {
+		std::string text;
+		check_board("empty", text, true);
+		const std::string lines[] = {
+			"95 123456 RGBY 1\n", "100 000001 PPPP 1\n", "7 999999 OYGB 8\n", "50 123456 BBGG 4\n",
+		};
+		for (int i = 0; i < 4; i++) {
+			text += lines[i];
+			check_board(std::to_string(i + 1) + " records", text, true);
+		}
+		for (int i = 0; i < 12; i++) // (more than MAX_TOP_SCORES)
+			text += std::to_string(10 + i) + " 1000" + std::to_string(10 + i) + " RGBY 5\n";
+		check_board("full", text, true);
+		text = "9 123456 RGBY 2\n"; // (a word and a half)
+		for (size_t i = 0; i < net::SCAN_WORD_SIZE; i++, text = lines[0] + text) // every tail (each line adds 1)
+			check_board("tail " + std::to_string(text.size() % net::SCAN_WORD_SIZE), text, true);
+
+		check_board("double separator", "95  123456 RGBY 1\n", false);
+		check_board("double separator before the tries", "95 123456 RGBY  1\n", false);
+		check_board("non-digit score", "9x 123456 RGBY 1\n", false);
+		check_board("non-digit plid", "95 12a456 RGBY 1\n", false);
+		check_board("non-digit tries", "95 123456 RGBY x\n", false);
+		check_board("tries past the last trial", "95 123456 RGBY 9\n", false);
+		check_board("no tries", "95 123456 RGBY 0\n", false);
+		check_board("bad color", "95 123456 RGBX 1\n", false);
+		check_board("score too long", "1000 123456 RGBY 1\n", false);
+		check_board("missing EOM", lines[0] + "95 123456 RGBY 1", false);
+		check_board("missing field", "95 123456 RGBY\n", false);
+	}
+
+	static void fail(const std::string& check, const char* what) {
+		std::cout << "FAIL " << check << ": " << what << ".\n";
+		failures++;
+	}
+
+	static inline int failures = 0;
+};
+
+int main() {
+	parity_test::check_kernels();
+	parity_test::check_games();
+	parity_test::check_boards();
+	if (parity_test::failures != 0) {
+		std::cout << parity_test::failures << " checks failed.\n";
+		return 1;
+	}
+	std::cout << "All checks passed.\n";
+	return 0;
+}
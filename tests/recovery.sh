@@ -0,0 +1,47 @@
+#!/bin/sh
+# Checks the startup recovery of a sharded server (-s 2 -t 2): each shard
+# must read only the active games of its own players, so that every game
+# that expired while the server was down is finished exactly once (and its
+# finished game file keeps the whole game).
+# Run with "make check" (from the root of the repository).
+
+SERVER="$PWD/app_server"
+PORT=$((40000 + $$ % 20000))
+GAMES=3000 # plids 100000 to 699800: 2000 of shard 0, 1000 of shard 1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+fail() {
+	echo "FAIL sharded recovery: $1."
+	cat log
+	exit 1
+}
+
+mkdir GAMES
+i=0
+while [ $i -lt $GAMES ]; do
+	plid=$((100000 + i * 200))
+	printf '%s P RGBY 60 1000000000\n' $plid > GAMES/STATE_$plid.txt
+	i=$((i + 1))
+done
+
+# (in a process group of its own, with SIGINT as usual: a background job
+# of a script starts with it ignored)
+setsid env --default-signal=INT "$SERVER" -p $PORT -s 2 -t 2 > log 2>&1 &
+server=$!
+waited=0
+while [ "$(grep -c 'Recovery: read \([0-9]*\) of \1 ' log)" -lt 2 ] && [ $waited -lt 60 ]; do
+	sleep 1
+	waited=$((waited + 1))
+done
+kill -INT -$server
+wait $server
+
+grep -q 'read 2000 of 2000 ' log || fail "shard 0 did not read its 2000 games alone"
+grep -q 'read 1000 of 1000 ' log || fail "shard 1 did not read its 1000 games alone"
+[ -z "$(find GAMES -name 'STATE_*')" ] || fail "expired games were left active"
+[ "$(find GAMES -mindepth 2 -type f | wc -l)" -eq $GAMES ] || fail "not one finished file per game"
+[ "$(cat GAMES/*/* | grep -c ' P RGBY 60 1000000000$')" -eq $GAMES ] || fail "finished games lost their header"
+[ "$(cat GAMES/*/* | grep -c '^T 1000000060$')" -eq $GAMES ] || fail "finished games lost their ending"
+echo "Sharded recovery passed."